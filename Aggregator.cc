@@ -0,0 +1,322 @@
+#include <syslog.h>
+
+#include <algorithm>
+
+#include "Aggregator.h"
+
+using namespace nghttp2::asio_http2;
+
+// a peer parks /v1/list?since= for its longpoll-timeout (30 seconds by
+// default) before it answers 304, so the change stream gets more time than
+// a plain request. peers with a longer longpoll-timeout just reconnect.
+static const unsigned watch_timeout = 75;
+
+Aggregator::Aggregator(unsigned timeout_ms, const std::string &ca_file):
+    work(new boost::asio::io_service::work(io)), timeout_ms(timeout_ms), ca_file(ca_file)
+{
+}
+
+Aggregator::~Aggregator() {
+    work.reset();
+    io.stop();
+    if(thread.joinable()) thread.join();
+}
+
+int Aggregator::configure(const json11::Json &config, std::string &err) {
+    if(!config.is_array()) {
+        err = "peers must be an array of peer objects";
+        return 1;
+    }
+    for(auto &c: config.array_items()) {
+        std::unique_ptr<peer> p(new peer());
+        p->id = c["id"].string_value();
+        p->host = c["host"].string_value();
+        p->port = c["port"].is_number() ? std::to_string(c["port"].int_value()) : c["port"].string_value();
+        if(p->port=="") p->port = "443";
+        p->tls = c["tls"].is_bool() ? c["tls"].bool_value() : true;
+        p->token = c["token"].string_value();
+        if(p->id=="" || p->host=="" || p->id.find('/')!=std::string::npos) {
+            err = "peer needs an id without / and a host: " + c.dump();
+            return 1;
+        }
+        if(find(p->id)) {
+            err = "duplicate peer id " + p->id;
+            return 1;
+        }
+        if(p->tls) {
+            boost::system::error_code ec;
+            p->tls_ctx.reset(new boost::asio::ssl::context(boost::asio::ssl::context::sslv23));
+            client::configure_tls_context(ec, *p->tls_ctx);
+            if(ca_file!="") {
+                p->tls_ctx->load_verify_file(ca_file, ec);
+                if(ec) {
+                    err = "cannot load peer-ca " + ca_file + ": " + ec.message();
+                    return 1;
+                }
+                p->tls_ctx->set_verify_mode(boost::asio::ssl::verify_peer);
+                p->tls_ctx->set_verify_callback(boost::asio::ssl::rfc2818_verification(p->host));
+            }
+            else {
+                // the lightsrv default is a self signed certificate
+                p->tls_ctx->set_verify_mode(boost::asio::ssl::verify_none);
+            }
+        }
+        p->timer.reset(new boost::asio::deadline_timer(io));
+        p->connected = false;
+        p->reconnecting = false;
+        p->generation = 0;
+        p->backoff = 1;
+        p->boot = p->version = 0;
+        p->updated = 0;
+        p->requests = p->errors = p->timeouts = p->updates = 0;
+        peers.push_back(std::move(p));
+    }
+    return 0;
+}
+
+void Aggregator::start() {
+    if(peers.empty()) return;
+    for(auto &p: peers) {
+        peer *pp = p.get();
+        io.post([this, pp](){ connect(*pp); });
+    }
+    thread = std::thread([this](){ io.run(); });
+}
+
+bool Aggregator::empty() const {
+    return peers.empty();
+}
+
+// ids never change after configure(), so this is safe from any thread
+bool Aggregator::has(const std::string &id) const {
+    for(auto &p: peers) if(p->id==id) return true;
+    return false;
+}
+
+Aggregator::peer *Aggregator::find(const std::string &id) {
+    for(auto &p: peers) if(p->id==id) return p.get();
+    return nullptr;
+}
+
+void Aggregator::connect(peer &p) {
+    if(p.session) p.session->shutdown();
+    p.reconnecting = false;
+    unsigned generation = ++p.generation;
+    auto connect_timeout = boost::posix_time::milliseconds(timeout_ms);
+    if(p.tls) p.session.reset(new client::session(io, *p.tls_ctx, p.host, p.port, connect_timeout));
+    else p.session.reset(new client::session(io, p.host, p.port, connect_timeout));
+    p.session->read_timeout(boost::posix_time::seconds(2*watch_timeout));
+    p.session->on_connect([this, &p, generation](boost::asio::ip::tcp::resolver::iterator endpoint) {
+        (void)endpoint;
+        if(generation!=p.generation) return;
+        syslog(LOG_INFO, "connected to node %s at %s:%s", p.id.c_str(), p.host.c_str(), p.port.c_str());
+        p.connected = true;
+        p.backoff = 1;
+        p.last_error = "";
+        // the node may have restarted and count its versions from 1 again,
+        // the old version would park the stream until it caught up
+        p.boot = p.version = 0;
+        p.state = json11::Json();
+        watch(p);
+    });
+    p.session->on_error([this, &p, generation](const boost::system::error_code &ec) {
+        disconnected(p, generation, ec.message());
+    });
+}
+
+void Aggregator::disconnected(peer &p, unsigned generation, const std::string &why) {
+    if(generation!=p.generation || p.reconnecting) return;
+    syslog(LOG_WARNING, "node %s: %s, reconnecting in %u seconds", p.id.c_str(), why.c_str(), p.backoff);
+    p.connected = false;
+    p.reconnecting = true;
+    p.last_error = why;
+    p.timer->expires_from_now(boost::posix_time::seconds(p.backoff));
+    p.timer->async_wait([this, &p](const boost::system::error_code &ec) {
+        if(!ec) connect(p);
+    });
+    p.backoff = std::min(2*p.backoff, 60u);
+}
+
+void Aggregator::watch(peer &p) {
+    if(!p.connected) return;
+    std::string path = "/v1/list";
+    std::string etag;
+    if(p.version) {
+        // a bare version from a node without boot ids
+        std::string tag = (p.boot ? std::to_string(p.boot) + "-" : "") + std::to_string(p.version);
+        path += "?since=" + tag;
+        etag = "\"" + tag + "\"";
+    }
+    unsigned generation = p.generation;
+    request(p, "GET", path, "", etag, watch_timeout*1000, [this, &p, generation](const result &r) {
+        if(generation!=p.generation) return;
+        if(!r.error.empty()) {
+            // no answer on the change stream means the connection is gone,
+            // even if the session did not notice yet
+            disconnected(p, generation, "change stream: " + r.error);
+            return;
+        }
+        if(r.status==304 || (r.status==200 && update(p, r))) {
+            watch(p);
+            return;
+        }
+        p.errors++;
+        if(r.status!=200) p.last_error = "change stream: status " + std::to_string(r.status);
+        p.timer->expires_from_now(boost::posix_time::seconds(p.backoff));
+        p.timer->async_wait([this, &p, generation](const boost::system::error_code &ec) {
+            if(!ec && generation==p.generation) watch(p);
+        });
+    });
+}
+
+bool Aggregator::update(peer &p, const result &r) {
+    std::string err;
+    json11::Json j = json11::Json::parse(r.body, err);
+    if(!err.empty() || !j["response"].is_object()) {
+        p.last_error = "invalid list from node: " + (err.empty() ? r.body.substr(0, 80) : err);
+        return false;
+    }
+    // "<boot>-<version>", or just the version from older nodes
+    char *end;
+    uint64_t boot = std::strtoull(r.etag.c_str()+(r.etag.size() && r.etag[0]=='"'), &end, 10), version = 0;
+    if(*end=='-') version = std::strtoull(end+1, nullptr, 10);
+    else std::swap(boot, version);
+    // a plain fetch may have overtaken the change stream, within one run
+    if(version && boot==p.boot && version<p.version) return true;
+    p.state = j["response"];
+    p.boot = boot;
+    p.version = version;
+    p.updated = std::time(nullptr);
+    p.updates++;
+    return true;
+}
+
+void Aggregator::request(peer &p, const std::string &method, const std::string &path, const std::string &body, const std::string &etag, unsigned timeout_ms, result_fn cb) {
+    struct pending {
+        bool done;
+        result r;
+        boost::asio::deadline_timer timer;
+        const client::request *req;
+        pending(boost::asio::io_service &io): done(false), r { 0, "", "", "" }, timer(io), req(nullptr) {}
+    };
+    p.requests++;
+    if(!p.connected) {
+        cb(result { 502, "", "", "not connected" + (p.last_error!="" ? ": " + p.last_error : "") });
+        return;
+    }
+    header_map h;
+    if(etag!="") h.emplace("if-none-match", header_value { etag, false });
+    if(body!="") h.emplace("content-type", header_value { "application/json", false });
+    if(p.token!="") h.emplace("authorization", header_value { "Bearer " + p.token, true });
+    std::string uri = std::string(p.tls ? "https://" : "http://") + p.host + ":" + p.port + path;
+    boost::system::error_code ec;
+    const client::request *req = body=="" ? p.session->submit(ec, method, uri, h) : p.session->submit(ec, method, uri, body, h);
+    if(!req) {
+        p.errors++;
+        cb(result { 502, "", "", "submit failed: " + ec.message() });
+        return;
+    }
+
+    auto pd = std::make_shared<pending>(io);
+    pd->req = req;
+    req->on_response([pd](const client::response &res) {
+        pd->r.status = res.status_code();
+        auto it = res.header().find("etag");
+        if(it!=res.header().end()) pd->r.etag = it->second.value;
+        res.on_data([pd](const uint8_t *data, std::size_t len) {
+            pd->r.body.append((const char *)data, len);
+        });
+    });
+    req->on_close([&p, pd, cb](uint32_t error_code) {
+        if(pd->done) return;
+        pd->done = true;
+        pd->timer.cancel();
+        if(error_code || pd->r.status==0) {
+            p.errors++;
+            pd->r.status = 502;
+            pd->r.error = "stream closed with error code " + std::to_string(error_code);
+        }
+        cb(pd->r);
+    });
+    pd->timer.expires_from_now(boost::posix_time::milliseconds(timeout_ms));
+    pd->timer.async_wait([&p, pd, cb](const boost::system::error_code &ec) {
+        if(ec || pd->done) return;
+        pd->done = true;
+        p.timeouts++;
+        pd->req->cancel();
+        cb(result { 504, "", "", "timeout" });
+    });
+}
+
+json11::Json Aggregator::node_json(const peer &p) const {
+    return json11::Json::object {
+        { "online", p.connected },
+        { "version", (double)p.version },
+        { "age", p.updated ? json11::Json((double)(std::time(nullptr)-p.updated)) : json11::Json() },
+        { "state", p.state }
+    };
+}
+
+void Aggregator::list(bool fresh, json_fn cb) {
+    io.post([this, fresh, cb]() {
+        struct merge {
+            json11::Json::object nodes;
+            unsigned pending;
+        };
+        auto m = std::make_shared<merge>();
+        m->pending = 1;
+        auto finish = [m, cb]() {
+            if(--m->pending==0) cb(json11::Json::object { { "nodes", m->nodes } });
+        };
+        for(auto &pp: peers) {
+            peer &p = *pp;
+            if(!p.connected || (!fresh && !p.state.is_null())) {
+                m->nodes[p.id] = node_json(p);
+                continue;
+            }
+            // all asked at once, so the slowest node bounds the reply
+            m->pending++;
+            request(p, "GET", "/v1/list", "", "", timeout_ms, [this, &p, m, finish](const result &r) {
+                bool ok = r.status==200 && update(p, r);
+                json11::Json::object n = node_json(p).object_items();
+                if(!ok) n["error"] = r.error!="" ? r.error : p.last_error;
+                m->nodes[p.id] = n;
+                finish();
+            });
+        }
+        finish();
+    });
+}
+
+void Aggregator::forward(const std::string &id, const std::string &method, const std::string &path, const std::string &body, result_fn cb) {
+    io.post([this, id, method, path, body, cb]() {
+        peer *p = find(id);
+        if(!p) {
+            cb(result { 404, "", "", "unknown node " + id });
+            return;
+        }
+        request(*p, method, path, body, "", timeout_ms, cb);
+    });
+}
+
+void Aggregator::status(json_fn cb) {
+    io.post([this, cb]() {
+        json11::Json::array a;
+        for(auto &p: peers) {
+            a.push_back(json11::Json::object {
+                { "id", p->id },
+                { "host", p->host },
+                { "port", p->port },
+                { "tls", p->tls },
+                { "online", p->connected },
+                { "version", (double)p->version },
+                { "requests", (double)p->requests },
+                { "errors", (double)p->errors },
+                { "timeouts", (double)p->timeouts },
+                { "updates", (double)p->updates },
+                { "last_error", p->last_error }
+            });
+        }
+        cb(a);
+    });
+}
@@ -0,0 +1,98 @@
+#ifndef LIGHTSRV_AGGREGATOR_H
+#define LIGHTSRV_AGGREGATOR_H
+
+#include <cstdint>
+#include <ctime>
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <boost/asio/deadline_timer.hpp>
+#include <boost/asio/io_service.hpp>
+#include <boost/asio/ssl.hpp>
+#include <boost/noncopyable.hpp>
+
+#include <nghttp2/asio_http2_client.h>
+
+#include "json11.git/json11.hpp"
+
+// aggregator mode: keeps one persistent HTTP/2 connection per peer lightsrv,
+// all requests to a peer are multiplexed over it. the state of each peer is
+// cached and kept current by a long poll on its /v1/list?since=, so the
+// merged list usually needs no round trip at all.
+//
+// the client sessions live on an own io_service and thread; the callbacks
+// are called from there, so the server side has to post its reply back to
+// the io_service of the response.
+//
+// config: [{"id": "tank", "host": "10.0.0.2", "port": "443"},
+//          {"id": "porch", "host": "127.0.0.1", "port": "8081", "tls": false}]
+// a peer with authentication on gets a "token", sent as bearer token.
+
+class Aggregator : boost::noncopyable {
+public:
+    struct result {
+        unsigned status;
+        std::string body;
+        std::string etag;
+        std::string error;  // set if the peer did not answer, status is 502/504 then
+    };
+    typedef std::function<void(const result &r)> result_fn;
+    typedef std::function<void(const json11::Json &j)> json_fn;
+    Aggregator(unsigned timeout_ms, const std::string &ca_file);
+    ~Aggregator();
+    int configure(const json11::Json &config, std::string &err);
+    void start();
+    bool empty() const;
+    bool has(const std::string &id) const;
+    // per node cached state. with fresh, or for a connected node without
+    // cached state, the nodes are asked in parallel, each with the timeout
+    void list(bool fresh, json_fn cb);
+    // method path?query with body to node id, path relative to its root
+    void forward(const std::string &id, const std::string &method, const std::string &path, const std::string &body, result_fn cb);
+    // connection state and counters per node
+    void status(json_fn cb);
+private:
+    struct peer {
+        std::string id;
+        std::string host;
+        std::string port;
+        bool tls;
+        std::string token;
+        std::unique_ptr<boost::asio::ssl::context> tls_ctx;
+        std::unique_ptr<nghttp2::asio_http2::client::session> session;
+        std::unique_ptr<boost::asio::deadline_timer> timer;
+        bool connected;
+        bool reconnecting;
+        unsigned generation;    // of the session, late callbacks of older ones are ignored
+        unsigned backoff;
+        json11::Json state;
+        uint64_t boot;          // the node's run, from the etag "<boot>-<version>"
+        uint64_t version;
+        time_t updated;
+        unsigned long requests;
+        unsigned long errors;
+        unsigned long timeouts;
+        unsigned long updates;
+        std::string last_error;
+    };
+    void connect(peer &p);
+    void disconnected(peer &p, unsigned generation, const std::string &why);
+    // watch the change stream of p: long poll /v1/list?since=version
+    void watch(peer &p);
+    bool update(peer &p, const result &r);
+    void request(peer &p, const std::string &method, const std::string &path, const std::string &body, const std::string &etag, unsigned timeout_ms, result_fn cb);
+    json11::Json node_json(const peer &p) const;
+    peer *find(const std::string &id);
+    // before peers, whose timers and sessions use it
+    boost::asio::io_service io;
+    std::unique_ptr<boost::asio::io_service::work> work;
+    unsigned timeout_ms;
+    std::string ca_file;
+    std::vector<std::unique_ptr<peer>> peers;
+    std::thread thread;
+};
+
+#endif
@@ -0,0 +1,152 @@
+#include <syslog.h>
+
+#include <algorithm>
+
+#include "Arbiter.h"
+
+const unsigned Arbiter::SOURCES;
+const time_t Arbiter::FOREVER;
+
+Arbiter::Arbiter(unsigned switches, unsigned pwms, unsigned hold):
+    switches(switches), hold(hold), priorities { 2, 0, 2, 2, 3, 2 }, claims(switches+pwms+1, 0),
+    next_expiry(FOREVER), admitted(0), blocked(0), expired(0), passes(0)
+{
+}
+
+const char *Arbiter::source_name(unsigned s) {
+    static const char *names[SOURCES] = { "api", "auto", "scene", "input", "control", "mqtt" };
+    return s<SOURCES ? names[s] : "unknown";
+}
+
+int Arbiter::set_priorities(const json11::Json &p, std::string &err) {
+    if(!p.is_object()) {
+        err = "priorities must be an object of source names and numbers";
+        return 1;
+    }
+    unsigned prio[SOURCES];
+    std::copy(priorities, priorities+SOURCES, prio);
+    for(auto &kv: p.object_items()) {
+        unsigned s = 0;
+        while(s<SOURCES && kv.first!=source_name(s)) s++;
+        if(s==SOURCES || !kv.second.is_number() || kv.second.int_value()<0 || kv.second.int_value()>255) {
+            err = "invalid source priority " + kv.first + ": " + kv.second.dump();
+            return 1;
+        }
+        prio[s] = kv.second.int_value();
+    }
+    std::lock_guard<std::mutex> lock(mtx);
+    std::copy(prio, prio+SOURCES, priorities);
+    return 0;
+}
+
+unsigned Arbiter::index(BCM2835::change::kind_t kind, unsigned channel) const {
+    unsigned i = kind==BCM2835::change::PWM ? switches+channel : channel;
+    if(kind==BCM2835::change::AUTO || (kind==BCM2835::change::SWITCH && channel>=switches) || i>=claims.size()-1) return claims.size()-1;
+    return i;
+}
+
+bool Arbiter::admit_locked(unsigned i, BCM2835::source_t s, uint32_t now) {
+    uint64_t &c = claims[i];
+    unsigned prio = priorities[s];
+    // an explicit claim keeps out every other source, a hold the lower ones
+    if(c && until(c)>now && (priority(c)>prio || expl(c)) && source(c)!=(unsigned)s) {
+        blocked++;
+        return false;
+    }
+    admitted++;
+    if(s==BCM2835::AUTO) return true;
+    if(c && until(c)>now && source(c)==(unsigned)s && expl(c)) return true;
+    uint32_t u = std::min<uint64_t>(uint64_t(now)+hold, FOREVER-1);
+    c = pack(u, s, prio, false);
+    next_expiry = std::min(next_expiry, u);
+    return true;
+}
+
+bool Arbiter::admit(BCM2835::change::kind_t kind, unsigned channel, BCM2835::source_t s, time_t now) {
+    std::lock_guard<std::mutex> lock(mtx);
+    return admit_locked(index(kind, channel), s, now);
+}
+
+uint64_t Arbiter::admit_mask(uint64_t mask, BCM2835::source_t s, time_t now) {
+    std::lock_guard<std::mutex> lock(mtx);
+    for(uint64_t m=mask; m; m&=m-1) {
+        unsigned channel = __builtin_ctzll(m);
+        if(!admit_locked(index(BCM2835::change::SWITCH, channel), s, now)) mask &= ~(uint64_t(1)<<channel);
+    }
+    return mask;
+}
+
+bool Arbiter::claim(BCM2835::change::kind_t kind, unsigned channel, BCM2835::source_t s, time_t hold, time_t now) {
+    std::lock_guard<std::mutex> lock(mtx);
+    if(hold==0) return admit_locked(index(kind, channel), s, now);
+    uint64_t &c = claims[index(kind, channel)];
+    if(c && until(c)>now && (priority(c)>priorities[s] || expl(c)) && source(c)!=(unsigned)s) {
+        blocked++;
+        return false;
+    }
+    uint32_t u = hold==FOREVER ? FOREVER : std::min<uint64_t>(uint64_t(now)+hold, FOREVER-1);
+    c = pack(u, s, priorities[s], true);
+    next_expiry = std::min(next_expiry, u);
+    return true;
+}
+
+void Arbiter::release(BCM2835::change::kind_t kind, unsigned channel) {
+    std::lock_guard<std::mutex> lock(mtx);
+    claims[index(kind, channel)] = 0;
+}
+
+Arbiter::holder Arbiter::get(BCM2835::change::kind_t kind, unsigned channel, time_t now) const {
+    std::lock_guard<std::mutex> lock(mtx);
+    uint64_t c = claims[index(kind, channel)];
+    if(!c || until(c)<=now) return holder { false, BCM2835::AUTO, 0, 0 };
+    return holder { true, (BCM2835::source_t)source(c), priority(c), until(c) };
+}
+
+void Arbiter::tick(time_t now) {
+    std::lock_guard<std::mutex> lock(mtx);
+    if(now<next_expiry) return;
+    passes++;
+    uint32_t next = FOREVER;
+    for(auto &c: claims) {
+        if(!c) continue;
+        if(until(c)<=now) {
+            c = 0;
+            expired++;
+        }
+        else next = std::min(next, until(c));
+    }
+    next_expiry = next;
+}
+
+json11::Json Arbiter::to_json(time_t now) const {
+    std::lock_guard<std::mutex> lock(mtx);
+    auto claims_json = [this, now](unsigned from, unsigned to) {
+        json11::Json::array a;
+        for(unsigned i=from; i<to; i++) {
+            uint64_t c = claims[i];
+            if(!c || until(c)<=now) {
+                a.push_back(nullptr);
+                continue;
+            }
+            a.push_back(json11::Json::object {
+                { "source", source_name(source(c)) },
+                { "priority", (int)priority(c) },
+                { "locked", until(c)==FOREVER },
+                { "remaining", until(c)==FOREVER ? json11::Json() : json11::Json((double)(until(c)-now)) }
+            });
+        }
+        return a;
+    };
+    json11::Json::object prio;
+    for(unsigned s=0; s<SOURCES; s++) prio[source_name(s)] = (int)priorities[s];
+    return json11::Json::object {
+        { "hold", (int)hold },
+        { "priorities", prio },
+        { "switches", claims_json(0, switches) },
+        { "pwms", claims_json(switches, claims.size()-1) },
+        { "admitted", (double)admitted },
+        { "blocked", (double)blocked },
+        { "expired", (double)expired },
+        { "passes", (double)passes }
+    };
+}
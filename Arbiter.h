@@ -0,0 +1,81 @@
+#ifndef LIGHTSRV_ARBITER_H
+#define LIGHTSRV_ARBITER_H
+
+#include <cstdint>
+#include <ctime>
+#include <mutex>
+#include <vector>
+
+#include <boost/noncopyable.hpp>
+
+#include "json11.git/json11.hpp"
+#include "BCM2835.h"
+
+// decides which source may drive a channel. a write of a manual source
+// (api, scene, input, mqtt, control) claims the channel for hold seconds,
+// during which writes of sources with a lower priority, automode by
+// default, are dropped. equal priorities merge as latest wins, the claim
+// moves to the newer source. after the hold the channel goes back to
+// whoever writes next, i.e. automode at its next tick. an explicit claim,
+// hold or lock, keeps every other source out until it ends, whatever its
+// priority.
+//
+// a claim is one packed word per channel, so admit() is a load, a compare
+// and a store whatever the number of sources, and tick() skips its pass
+// over the table unless the earliest claim expired.
+//
+// the backend calls admit() from its write paths under its own lock; the
+// explicit claim()/release() of the API come from the server threads.
+
+class Arbiter : boost::noncopyable {
+public:
+    static const unsigned SOURCES = BCM2835::MQTT+1;
+    static const time_t FOREVER = 0xffffffff;
+    struct holder {
+        bool held;
+        BCM2835::source_t source;
+        unsigned priority;
+        time_t until;       // FOREVER for a lock
+    };
+    // hold: seconds a manual write claims its channel
+    Arbiter(unsigned switches, unsigned pwms, unsigned hold);
+    // JSON object source name: priority, the others keep theirs
+    int set_priorities(const json11::Json &p, std::string &err);
+    // whether s may write channel, claims it for s if so
+    bool admit(BCM2835::change::kind_t kind, unsigned channel, BCM2835::source_t s, time_t now);
+    // the switch channels of mask s may write, claims them
+    uint64_t admit_mask(uint64_t mask, BCM2835::source_t s, time_t now);
+    // explicit claim for hold seconds or FOREVER, not extended by later
+    // writes of s; hold 0 is the default hold, like a write. fails if a
+    // higher priority or another source's explicit claim holds the channel
+    bool claim(BCM2835::change::kind_t kind, unsigned channel, BCM2835::source_t s, time_t hold, time_t now);
+    void release(BCM2835::change::kind_t kind, unsigned channel);
+    holder get(BCM2835::change::kind_t kind, unsigned channel, time_t now) const;
+    // drops expired claims
+    void tick(time_t now);
+    json11::Json to_json(time_t now) const;
+    static const char *source_name(unsigned s);
+private:
+    // bits 0..31 expiry, 32..39 source+1 (0: free), 40..47 priority, 48 explicit
+    static uint64_t pack(uint32_t until, unsigned s, unsigned priority, bool expl) {
+        return until | uint64_t(s+1)<<32 | uint64_t(priority)<<40 | uint64_t(expl)<<48;
+    }
+    static uint32_t until(uint64_t c) { return c; }
+    static unsigned source(uint64_t c) { return ((c>>32)&0xff)-1; }
+    static unsigned priority(uint64_t c) { return (c>>40)&0xff; }
+    static bool expl(uint64_t c) { return (c>>48)&1; }
+    bool admit_locked(unsigned index, BCM2835::source_t s, uint32_t now);
+    unsigned index(BCM2835::change::kind_t kind, unsigned channel) const;
+    unsigned switches;
+    unsigned hold;
+    unsigned priorities[SOURCES];
+    mutable std::mutex mtx;
+    std::vector<uint64_t> claims;   // switches, then pwms, and a spare for invalid channels
+    uint32_t next_expiry;
+    unsigned long admitted;
+    unsigned long blocked;
+    unsigned long expired;
+    unsigned long passes;
+};
+
+#endif
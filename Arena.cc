@@ -0,0 +1,155 @@
+#include <malloc.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
+#include <new>
+
+#include "Arena.h"
+
+const std::size_t Arena::CHUNK;
+
+// heap allocations of this thread, counted by operator new below
+static thread_local unsigned long heap_allocations = 0;
+
+// operator delete and the array forms end up in free() and this one anyway
+void *operator new(std::size_t size) {
+    heap_allocations++;
+    if(size==0) size = 1;
+    while(true) {
+        void *p = std::malloc(size);
+        if(p) return p;
+        std::new_handler h = std::get_new_handler();
+        if(!h) throw std::bad_alloc();
+        h();
+    }
+}
+
+std::mutex Arena::registry_mtx;
+std::vector<Arena::stats *> Arena::registry;
+
+// the stats are written by their own thread only, no read-modify-write
+template <typename T> static void add(std::atomic<T> &c, T n) {
+    c.store(c.load(std::memory_order_relaxed)+n, std::memory_order_relaxed);
+}
+
+template <typename T> static void raise(std::atomic<T> &c, T n) {
+    if(n>c.load(std::memory_order_relaxed)) c.store(n, std::memory_order_relaxed);
+}
+
+Arena::Arena(): used(0), total(0), depth(0), st(new stats()) {
+    chunks.emplace_back(new uint8_t[CHUNK]);
+    sizes.push_back(CHUNK);
+    std::lock_guard<std::mutex> lock(registry_mtx);
+    registry.push_back(st);
+}
+
+Arena &Arena::local() {
+    static thread_local Arena arena;
+    return arena;
+}
+
+void *Arena::allocate(std::size_t size, std::size_t align) {
+    if(!depth) {
+        add(st->fallbacks, 1ul);
+        return ::operator new(size);
+    }
+    // new[] aligns the chunks for any type, so aligning the offset will do
+    std::size_t at = (used+align-1) & ~(align-1);
+    if(at+size>sizes.back()) {
+        std::size_t n = std::max(CHUNK, size);
+        chunks.emplace_back(new uint8_t[n]);
+        sizes.push_back(n);
+        add(st->chunks, 1ul);
+        at = 0;
+    }
+    used = at+size;
+    total += size;
+    return chunks.back().get()+at;
+}
+
+bool Arena::owns(const void *p) const {
+    for(std::size_t i=0; i<chunks.size(); i++) {
+        if(p>=chunks[i].get() && p<chunks[i].get()+sizes[i]) return true;
+    }
+    return false;
+}
+
+void Arena::deallocate(void *p) {
+    if(!owns(p)) ::operator delete(p);
+}
+
+void Arena::rewind() {
+    raise(st->arena_bytes, (unsigned long)total);
+    // back to the first chunk, a large request does not keep its memory
+    chunks.resize(1);
+    sizes.resize(1);
+    used = 0;
+    total = 0;
+}
+
+Arena::scope::scope(): allocations(heap_allocations) {
+    local().depth++;
+}
+
+Arena::scope::~scope() {
+    Arena &a = local();
+    if(--a.depth) return;
+    unsigned long n = heap_allocations-allocations;
+    add(a.st->requests, 1ul);
+    add(a.st->allocations, n);
+    raise(a.st->max_allocations, n);
+    a.rewind();
+}
+
+json11::Json Arena::to_json() {
+    long page = sysconf(_SC_PAGESIZE);
+    unsigned long vm = 0, rss = 0;
+    std::ifstream statm("/proc/self/statm");
+    statm >> vm >> rss;
+
+#if defined(__GLIBC__) && (__GLIBC__>2 || __GLIBC_MINOR__>=33)
+    struct mallinfo2 mi = mallinfo2();
+#else
+    struct mallinfo mi = mallinfo();
+#endif
+
+    unsigned long requests = 0, allocations = 0, max_allocations = 0, arena_bytes = 0, fallbacks = 0, chunks = 0;
+    std::size_t threads;
+    {
+        std::lock_guard<std::mutex> lock(registry_mtx);
+        threads = registry.size();
+        for(stats *s: registry) {
+            requests += s->requests.load(std::memory_order_relaxed);
+            allocations += s->allocations.load(std::memory_order_relaxed);
+            max_allocations = std::max(max_allocations, s->max_allocations.load(std::memory_order_relaxed));
+            arena_bytes = std::max(arena_bytes, s->arena_bytes.load(std::memory_order_relaxed));
+            fallbacks += s->fallbacks.load(std::memory_order_relaxed);
+            chunks += s->chunks.load(std::memory_order_relaxed);
+        }
+    }
+
+    return json11::Json::object {
+        { "rss_bytes", (double)rss*page },
+        { "vm_bytes", (double)vm*page },
+        { "heap", json11::Json::object {
+            { "arena_bytes", (double)mi.arena },
+            { "mmap_bytes", (double)mi.hblkhd },
+            { "in_use_bytes", (double)mi.uordblks },
+            { "free_bytes", (double)mi.fordblks },
+            { "free_chunks", (double)mi.ordblks },
+            { "trimmable_bytes", (double)mi.keepcost }
+        }},
+        { "requests", json11::Json::object {
+            { "count", (double)requests },
+            { "heap_allocations", (double)allocations },
+            { "heap_allocations_per_request", requests ? (double)allocations/requests : 0.0 },
+            { "max_heap_allocations", (double)max_allocations },
+            { "arena_threads", (int)threads },
+            { "arena_max_bytes", (double)arena_bytes },
+            { "arena_extra_chunks", (double)chunks },
+            { "arena_fallbacks", (double)fallbacks }
+        }}
+    };
+}
@@ -0,0 +1,87 @@
+#ifndef LIGHTSRV_ARENA_H
+#define LIGHTSRV_ARENA_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <boost/noncopyable.hpp>
+
+#include "json11.git/json11.hpp"
+
+// per thread monotonic arena for the temporaries of a request handler: path
+// parts, query parameters, etags. allocating is a pointer bump, freeing
+// does nothing, and the whole arena is rewound when the handler returns, so
+// the steady state of a server thread does not touch malloc for them and
+// leaves no holes in the heap.
+//
+// only the synchronous part of a handler runs inside a scope. whatever a
+// handler keeps for later, captured by an on_data or on_close callback,
+// must not live in the arena; outside of a scope the allocator falls back
+// to the heap.
+//
+// use:
+//     Arena::scope scope;                    // once per request, in the wrapper
+//     Arena::vector<int> v;                  // anywhere below it
+//
+// the scope also counts the heap allocations the handler made, see
+// Arena::to_json().
+
+class Arena : boost::noncopyable {
+public:
+    template <typename T> class allocator {
+    public:
+        typedef T value_type;
+        allocator(): arena(&local()) {}
+        template <typename U> allocator(const allocator<U> &o): arena(o.arena) {}
+        T *allocate(std::size_t n) { return (T *)arena->allocate(n*sizeof(T), alignof(T)); }
+        void deallocate(T *p, std::size_t) { arena->deallocate(p); }
+        template <typename U> bool operator==(const allocator<U> &o) const { return arena==o.arena; }
+        template <typename U> bool operator!=(const allocator<U> &o) const { return arena!=o.arena; }
+        Arena *arena;
+    };
+    template <typename T> using vector = std::vector<T, allocator<T>>;
+
+    class scope : boost::noncopyable {
+    public:
+        scope();
+        ~scope();
+    private:
+        unsigned long allocations;
+    };
+
+    // the calling thread's arena
+    static Arena &local();
+    void *allocate(std::size_t size, std::size_t align);
+    void deallocate(void *p);
+    // RSS, heap and arena statistics of all threads
+    static json11::Json to_json();
+private:
+    struct stats {
+        std::atomic<unsigned long> requests;
+        std::atomic<unsigned long> allocations;     // heap, inside scopes
+        std::atomic<unsigned long> max_allocations; // of a single request
+        std::atomic<unsigned long> arena_bytes;     // high water mark
+        std::atomic<unsigned long> fallbacks;       // arena allocations outside scopes
+        std::atomic<unsigned long> chunks;          // beyond the first, allocated for large requests
+    };
+    Arena();
+    void rewind();
+    bool owns(const void *p) const;
+    static const std::size_t CHUNK = 16384;
+    // the stats of every thread which had an arena, never freed so
+    // to_json() can read them from any thread
+    static std::mutex registry_mtx;
+    static std::vector<stats *> registry;
+    std::vector<std::unique_ptr<uint8_t[]>> chunks;
+    std::vector<std::size_t> sizes;
+    std::size_t used;           // in the last chunk
+    std::size_t total;          // over all chunks, this request
+    unsigned depth;
+    stats *st;
+};
+
+#endif
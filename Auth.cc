@@ -0,0 +1,295 @@
+#include <syslog.h>
+
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+
+#include "Auth.h"
+
+static const char b64url[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+
+static std::string base64url_encode(const std::string &in) {
+    std::string out;
+    unsigned v = 0;
+    int bits = 0;
+    for(unsigned char c: in) {
+        v = v<<8 | c;
+        bits += 8;
+        while(bits>=6) {
+            bits -= 6;
+            out += b64url[(v>>bits)&0x3f];
+        }
+    }
+    if(bits) out += b64url[(v<<(6-bits))&0x3f];
+    return out;
+}
+
+static bool base64url_decode(const std::string &in, std::string &out) {
+    out.clear();
+    unsigned v = 0;
+    int bits = 0;
+    for(char c: in) {
+        const char *p = c ? std::strchr(b64url, c) : nullptr;
+        if(!p) return false;
+        v = v<<6 | (p-b64url);
+        bits += 6;
+        if(bits>=8) {
+            bits -= 8;
+            out += (char)((v>>bits)&0xff);
+        }
+    }
+    return true;
+}
+
+// true, "*" or a list of channel numbers
+static uint64_t channel_bits(const json11::Json &j) {
+    if(j.bool_value() || j.string_value()=="*") return ~uint64_t(0);
+    uint64_t bits = 0;
+    for(auto &c: j.array_items()) if(c.is_number() && c.int_value()>=0 && c.int_value()<64) bits |= uint64_t(1)<<c.int_value();
+    return bits;
+}
+
+static json11::Json channel_json(uint64_t bits) {
+    if(bits==~uint64_t(0)) return "*";
+    json11::Json::array a;
+    for(int i=0; i<64; i++) if(bits&(uint64_t(1)<<i)) a.push_back(i);
+    return a;
+}
+
+Auth::permissions Auth::permissions::parse(const json11::Json &j) {
+    return permissions {
+        j["read"].bool_value(), j["auto"].bool_value(), j["scenes"].bool_value(), j["admin"].bool_value(),
+        channel_bits(j["switch"]), channel_bits(j["pwm"])
+    };
+}
+
+Auth::permissions &Auth::permissions::operator|=(const permissions &o) {
+    read |= o.read;
+    automode |= o.automode;
+    scenes |= o.scenes;
+    admin |= o.admin;
+    switches |= o.switches;
+    pwms |= o.pwms;
+    return *this;
+}
+
+json11::Json Auth::permissions::to_json() const {
+    return json11::Json::object {
+        { "read", read }, { "auto", automode }, { "scenes", scenes }, { "admin", admin },
+        { "switch", channel_json(switches) }, { "pwm", channel_json(pwms) }
+    };
+}
+
+Auth::Auth(unsigned cache_size):
+    on(false), mtls(false), anonymous { true, true, true, true, ~uint64_t(0), ~uint64_t(0) }, cert(anonymous),
+    hits(0), misses(0), unauthenticated(0), forbidden(0), certs_refused(0)
+{
+    unsigned n = 16;
+    while(n<cache_size) n *= 2;
+    tokens.resize(n, entry { "", permissions(), 0, false });
+    certs.resize(n, entry { "", permissions(), 0, false });
+}
+
+int Auth::configure(const std::string &secret_file, const json11::Json &anonymous, std::string &err) {
+    if(secret_file!="") {
+        std::ifstream f(secret_file);
+        std::stringstream ss;
+        ss << f.rdbuf();
+        secret = ss.str();
+        while(!secret.empty() && (secret.back()=='\n' || secret.back()=='\r')) secret.pop_back();
+        if(!f || secret.size()<16) {
+            err = "cannot read a secret of at least 16 bytes from " + secret_file;
+            secret.clear();
+            return 1;
+        }
+    }
+    this->anonymous = permissions::parse(anonymous);
+    on = true;
+    return 0;
+}
+
+void Auth::set_client_certs(const json11::Json &cert_permissions, const std::vector<std::string> &fingerprints) {
+    cert = permissions::parse(cert_permissions);
+    for(auto f: fingerprints) {
+        // accept the openssl x509 -fingerprint form AB:CD:... as well
+        std::string hex;
+        for(char c: f) if(c!=':') hex += std::tolower((unsigned char)c);
+        this->fingerprints.insert(hex);
+    }
+    mtls = true;
+}
+
+// the cache is keyed by SHA-256 of the token, so a lookup compares fixed
+// size digests in constant time and no string compare leaks how much of a
+// guessed token is right
+static std::string digest(const std::string &key) {
+    unsigned char md[EVP_MAX_MD_SIZE];
+    unsigned int len = 0;
+    EVP_Digest(key.data(), key.size(), md, &len, EVP_sha256(), nullptr);
+    return std::string((const char *)md, len);
+}
+
+static std::size_t slot(const std::string &d, std::size_t size) {
+    std::size_t h;
+    std::memcpy(&h, d.data(), sizeof(h));
+    return h&(size-1);
+}
+
+bool Auth::lookup(std::vector<entry> &cache, const std::string &key, time_t now, permissions &p, bool &valid) {
+    std::string d = digest(key);
+    std::lock_guard<std::mutex> lock(mtx);
+    const entry &e = cache[slot(d, cache.size())];
+    if(e.key.size()!=d.size() || CRYPTO_memcmp(e.key.data(), d.data(), d.size()) || e.exp<=now) return false;
+    p = e.p;
+    valid = e.valid;
+    return true;
+}
+
+void Auth::store(std::vector<entry> &cache, const std::string &key, const permissions &p, time_t exp, bool valid) {
+    std::string d = digest(key);
+    std::lock_guard<std::mutex> lock(mtx);
+    cache[slot(d, cache.size())] = entry { d, p, exp, valid };
+}
+
+std::string Auth::sign(const std::string &data) const {
+    unsigned char mac[EVP_MAX_MD_SIZE];
+    unsigned int len = 0;
+    HMAC(EVP_sha256(), secret.data(), secret.size(), (const unsigned char *)data.data(), data.size(), mac, &len);
+    return std::string((const char *)mac, len);
+}
+
+bool Auth::verify_token(const std::string &token, permissions &p, time_t &exp) const {
+    if(secret.empty()) return false;
+    auto dot = token.find('.');
+    if(dot==std::string::npos) return false;
+    std::string payload = token.substr(0, dot), mac, claims_str;
+    if(!base64url_decode(token.substr(dot+1), mac) || !base64url_decode(payload, claims_str)) return false;
+    std::string expected = sign(payload);
+    if(mac.size()!=expected.size() || CRYPTO_memcmp(mac.data(), expected.data(), mac.size())) return false;
+    std::string err;
+    json11::Json claims = json11::Json::parse(claims_str, err);
+    if(!err.empty() || !claims["exp"].is_number()) return false;
+    exp = claims["exp"].number_value();
+    p = permissions::parse(claims);
+    return true;
+}
+
+Auth::verdict Auth::check(const std::string &method, const std::string &path, const std::string &authorization) {
+    if(!on) return ALLOWED;
+    // CORS preflights carry no credentials, the page itself and its assets
+    // are public so a token can be entered at all
+    if(method=="OPTIONS" || path.compare(0, 4, "/v1/")) return ALLOWED;
+
+    permissions p = anonymous;
+    if(mtls) p |= cert;
+    bool credentials = mtls;
+    if(authorization.compare(0, 7, "Bearer ")==0) {
+        std::string token = authorization.substr(7);
+        time_t now = std::time(nullptr);
+        permissions tp;
+        bool valid = false;
+        if(lookup(tokens, token, now, tp, valid)) hits++;
+        else {
+            misses++;
+            time_t exp = 0;
+            valid = verify_token(token, tp, exp) && exp>now;
+            // invalid tokens are cached too, for a minute, so guessing costs no crypto
+            store(tokens, token, tp, valid ? exp : now+60, valid);
+        }
+        if(!valid) {
+            unauthenticated++;
+            return UNAUTHENTICATED;
+        }
+        p |= tp;
+        credentials = true;
+    }
+
+    bool ok;
+    bool write = method=="PUT" || method=="POST" || method=="DELETE";
+    auto channel = [&path](std::size_t prefix) -> uint64_t {
+        char *end;
+        unsigned long c = std::strtoul(path.c_str()+prefix, &end, 10);
+        return end!=path.c_str()+prefix && c<64 ? uint64_t(1)<<c : 0;
+    };
+    if(path.compare(0, 10, "/v1/debug/")==0) ok = p.admin;
+    else if(!write) ok = p.read || p.admin;
+    else if(path.compare(0, 11, "/v1/switch/")==0) ok = p.admin || (p.switches & channel(11));
+    else if(path.compare(0, 8, "/v1/pwm/")==0) ok = p.admin || (p.pwms & channel(8));
+    else if(path.compare(0, 19, "/v1/arbiter/switch/")==0) ok = p.admin || (p.switches & channel(19));
+    else if(path.compare(0, 16, "/v1/arbiter/pwm/")==0) ok = p.admin || (p.pwms & channel(16));
+    else if(path=="/v1/auto") ok = p.admin || p.automode;
+    else if(path.compare(0, 10, "/v1/scene/")==0 || path.compare(0, 10, "/v1/group/")==0) ok = p.admin || p.scenes;
+    else ok = p.admin;
+    if(ok) return ALLOWED;
+    if(credentials) {
+        forbidden++;
+        return FORBIDDEN;
+    }
+    unauthenticated++;
+    return UNAUTHENTICATED;
+}
+
+bool Auth::verify_certificate(bool preverified, X509_STORE_CTX *ctx) {
+    if(!preverified) {
+        certs_refused++;
+        return false;
+    }
+    // only the client's own certificate, the chain above it was checked
+    if(X509_STORE_CTX_get_error_depth(ctx)>0 || fingerprints.empty()) return true;
+    X509 *x = X509_STORE_CTX_get_current_cert(ctx);
+    unsigned char md[EVP_MAX_MD_SIZE];
+    unsigned int len = 0;
+    if(!X509_digest(x, EVP_sha256(), md, &len)) return false;
+    std::string fp;
+    char hex[3];
+    for(unsigned i=0; i<len; i++) {
+        snprintf(hex, sizeof(hex), "%02x", md[i]);
+        fp += hex;
+    }
+    time_t now = std::time(nullptr);
+    permissions p;
+    bool valid = false;
+    if(lookup(certs, fp, now, p, valid)) hits++;
+    else {
+        misses++;
+        valid = fingerprints.count(fp)>0;
+        store(certs, fp, cert, now+3600, valid);
+    }
+    if(!valid) {
+        syslog(LOG_NOTICE, "refusing client certificate with fingerprint %s", fp.c_str());
+        certs_refused++;
+    }
+    return valid;
+}
+
+int Auth::issue(json11::Json::object claims, time_t ttl, std::string &token, std::string &err) const {
+    if(secret.empty()) {
+        err = "no auth-secret-file configured";
+        return 1;
+    }
+    if(!claims.count("exp")) claims["exp"] = (double)(std::time(nullptr)+ttl);
+    std::string payload = base64url_encode(json11::Json(claims).dump());
+    token = payload + "." + base64url_encode(sign(payload));
+    return 0;
+}
+
+json11::Json Auth::to_json() const {
+    return json11::Json::object {
+        { "enabled", on },
+        { "tokens", !secret.empty() },
+        { "client_certs", mtls },
+        { "anonymous", anonymous.to_json() },
+        { "cache_hits", (double)hits.load() },
+        { "cache_misses", (double)misses.load() },
+        { "unauthenticated", (double)unauthenticated.load() },
+        { "forbidden", (double)forbidden.load() },
+        { "certs_refused", (double)certs_refused.load() }
+    };
+}
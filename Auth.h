@@ -0,0 +1,82 @@
+#ifndef LIGHTSRV_AUTH_H
+#define LIGHTSRV_AUTH_H
+
+#include <atomic>
+#include <cstdint>
+#include <ctime>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <boost/noncopyable.hpp>
+#include <openssl/x509.h>
+
+#include "json11.git/json11.hpp"
+
+// who may do what. a request gets the union of the anonymous permissions,
+// the client certificate permissions if the connection presented a valid
+// one (mutual TLS), and those of its bearer token.
+//
+// tokens are base64url(claims).base64url(HMAC-SHA256(secret, first part)),
+// claims like
+//     {"sub": "kitchen", "exp": 1893456000, "read": true, "switch": [0, 1], "pwm": "*", "auto": false, "scenes": true, "admin": false}
+// see issue(). verified tokens and certificate fingerprints are kept in a
+// fixed size direct mapped cache until they expire, so the HMAC is only
+// computed once per token and not for every request on a connection.
+
+class Auth : boost::noncopyable {
+public:
+    struct permissions {
+        bool read;
+        bool automode;
+        bool scenes;
+        bool admin;
+        uint64_t switches;      // bit n for channel n
+        uint64_t pwms;
+        static permissions parse(const json11::Json &j);
+        permissions &operator|=(const permissions &o);
+        json11::Json to_json() const;
+    };
+    enum verdict { ALLOWED, UNAUTHENTICATED, FORBIDDEN };
+    Auth(unsigned cache_size);
+    // an empty secret_file disables tokens
+    int configure(const std::string &secret_file, const json11::Json &anonymous, std::string &err);
+    // mutual TLS: every connection already presented a certificate signed by
+    // the client CA, and one of fingerprints if that is not empty
+    void set_client_certs(const json11::Json &cert_permissions, const std::vector<std::string> &fingerprints);
+    bool enabled() const { return on; }
+    verdict check(const std::string &method, const std::string &path, const std::string &authorization);
+    // verify callback of the TLS context, after OpenSSL checked the chain
+    bool verify_certificate(bool preverified, X509_STORE_CTX *ctx);
+    // signed token for claims, exp defaults to ttl seconds from now
+    int issue(json11::Json::object claims, time_t ttl, std::string &token, std::string &err) const;
+    json11::Json to_json() const;
+private:
+    struct entry {
+        std::string key;    // SHA-256 of the token or certificate fingerprint
+        permissions p;
+        time_t exp;
+        bool valid;
+    };
+    bool lookup(std::vector<entry> &cache, const std::string &key, time_t now, permissions &p, bool &valid);
+    void store(std::vector<entry> &cache, const std::string &key, const permissions &p, time_t exp, bool valid);
+    bool verify_token(const std::string &token, permissions &p, time_t &exp) const;
+    std::string sign(const std::string &data) const;
+    bool on;
+    bool mtls;
+    std::string secret;
+    permissions anonymous;
+    permissions cert;
+    std::set<std::string> fingerprints;
+    std::mutex mtx;
+    std::vector<entry> tokens;
+    std::vector<entry> certs;
+    std::atomic<unsigned long> hits;
+    std::atomic<unsigned long> misses;
+    std::atomic<unsigned long> unauthenticated;
+    std::atomic<unsigned long> forbidden;
+    std::atomic<unsigned long> certs_refused;
+};
+
+#endif
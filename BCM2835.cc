@@ -1,5 +1,6 @@
 #include <syslog.h>
 
+#include <algorithm>
 #include <cmath>
 
 #include <boost/algorithm/string.hpp>
@@ -15,6 +16,8 @@
 #endif
 
 #include "BCM2835.h"
+#include "Arbiter.h"
+#include "PCA9685.h"
 
 int BCM2835::o_trsf(int arg) {
     return !arg;
@@ -28,42 +31,99 @@ int BCM2835::pwm_trsf(int arg) {
     return arg*1024/100.0;
 }
 
+unsigned BCM2835::expander_trsf(unsigned arg) {
+    return std::min(arg, 100u)*PCA9685::full/100;
+}
+
+unsigned BCM2835::expander_percent(unsigned duty) {
+    return (std::min(duty, PCA9685::full)*100+PCA9685::full/2)/PCA9685::full;
+}
+
 int BCM2835::init() {
+    std::lock_guard<std::recursive_mutex> lock(mtx);
     syslog(LOG_DEBUG, "bcm2835_init()");
+    bool ok = true;
     #ifdef bcm2385_found
-    if (!bcm2835_init()) {
-        //syslog(LOG_ERR, "FATAL: bcm2835_init() failed.\n");
-        return 1;
-    }
+    if(!mockup) ok = bcm2835_init();
     #endif
-    return 0;
+    // once per outage, init() runs for every transaction
+    if(!ok && gpio_ok) syslog(LOG_ERR, "bcm2835_init() failed, gpio writes are dropped");
+    if(ok && !gpio_ok) syslog(LOG_NOTICE, "bcm2835_init() works again");
+    if(!ok) failures++;
+    gpio_ok = ok;
+    return !ok;
 }
 
 void BCM2835::close() {
+    std::lock_guard<std::recursive_mutex> lock(mtx);
     syslog(LOG_DEBUG, "bcm2835_close()");
     #ifdef bcm2385_found
-    bcm2835_close();
+    if(!mockup && gpio_ok) bcm2835_close();
     #else
     #endif
+    flush_expander();
+}
+
+void BCM2835::flush_expander() {
+    if(!expander || !expander_dirty) return;
+    std::string err;
+    bool ok = !expander->flush(err);
+    // once per outage, not on every fade step
+    if(!ok && expander_ok) syslog(LOG_ERR, "pca9685: %s", err.c_str());
+    if(ok && !expander_ok) syslog(LOG_NOTICE, "pca9685: writing again");
+    if(ok) last_write = std::time(nullptr);
+    else failures++;
+    expander_ok = ok;
+    expander_dirty = !ok;
 }
 
 BCM2835::BCM2835(std::initializer_list<unsigned> c, std::initializer_list<unsigned> p, bool has_automode, bool inverted, bool debug):
-    inverted(inverted), debug(debug), using_auto(has_automode), has_automode(has_automode), channels(c), channel_values(c.size(), inverted), pwms(p), pwm_values(p.size(), 50)
+    inverted(inverted), debug(debug), using_auto(has_automode), has_automode(has_automode), channels(c), channel_values(c.size(), inverted), pwms(p), pwm_values(p.size(), 50), auto_skip_switch(c.size(), false), auto_skip_pwm(p.size(), false), version(1), mockup(false), arbiter(nullptr), expander(nullptr), expander_dirty(false), expander_ok(true), gpio_ok(true), last_write(0), failures(0), reinits(0), clock([](){ return std::time(nullptr); }), seg_start(0), seg_dot(0)
 {
     autocommit.push_back(true);
+    sources.push_back(API);
+    default_schedule();
 }
 
 BCM2835::BCM2835(const std::vector<unsigned> &c, const std::vector<unsigned> &p, bool has_automode, bool inverted, bool debug):
-    inverted(inverted), debug(debug), using_auto(has_automode), has_automode(has_automode), channels(c), channel_values(c.size(), inverted), pwms(p), pwm_values(p.size(), 50)
+    inverted(inverted), debug(debug), using_auto(has_automode), has_automode(has_automode), channels(c), channel_values(c.size(), inverted), pwms(p), pwm_values(p.size(), 50), auto_skip_switch(c.size(), false), auto_skip_pwm(p.size(), false), version(1), mockup(false), arbiter(nullptr), expander(nullptr), expander_dirty(false), expander_ok(true), gpio_ok(true), last_write(0), failures(0), reinits(0), clock([](){ return std::time(nullptr); }), seg_start(0), seg_dot(0)
 {
     autocommit.push_back(true);
+    sources.push_back(API);
+    default_schedule();
 }
 
 void BCM2835::set_debug(bool d) { debug=d; }
 
+void BCM2835::set_mockup(bool m) { mockup=m; }
+
+void BCM2835::set_clock(clock_fn c) {
+    std::lock_guard<std::recursive_mutex> lock(mtx);
+    clock=c;
+    seg_start=seg_dot=0;
+}
+
+void BCM2835::set_arbiter(Arbiter *a) {
+    std::lock_guard<std::recursive_mutex> lock(mtx);
+    arbiter=a;
+}
+
+void BCM2835::set_expander(PCA9685 *e) {
+    std::lock_guard<std::recursive_mutex> lock(mtx);
+    expander=e;
+    pwm_values.resize(pwms.size()+e->size(), 50);
+    expander_duty.assign(e->size(), expander_trsf(50));
+    auto_skip_pwm.resize(pwms.size()+e->size(), false);
+}
+
 void BCM2835::set_inverted(bool d) { inverted=d; }
 
-void BCM2835::set_auto(bool a) { using_auto=a; }
+void BCM2835::set_auto(bool a) {
+    std::lock_guard<std::recursive_mutex> lock(mtx);
+    if(a==using_auto) return;
+    using_auto=a;
+    changed(change::AUTO, 0, a);
+}
 
 bool BCM2835::get_auto() const { return using_auto; }
 
@@ -72,57 +132,120 @@ bool BCM2835::get_auto() const { return using_auto; }
 //#define PWM_CHANNEL 0
 
 void BCM2835::setup() {
+    std::lock_guard<std::recursive_mutex> lock(mtx);
+    // without the gpio the pins stay as they are, reinit() tries again
     init();
     #ifdef bcm2385_found
-    // Set the pins to be output pins
-    for(auto channel: channels) {
-        syslog(LOG_DEBUG, "bcm2835_gpio_fsel(%d, %d)", channel, BCM2835_GPIO_FSEL_OUTP);
-        bcm2835_gpio_fsel(channel, BCM2835_GPIO_FSEL_OUTP);
+    if(!mockup && gpio_ok) {
+        // Set the pins to be output pins
+        for(auto channel: channels) {
+            syslog(LOG_DEBUG, "bcm2835_gpio_fsel(%d, %d)", channel, BCM2835_GPIO_FSEL_OUTP);
+            bcm2835_gpio_fsel(channel, BCM2835_GPIO_FSEL_OUTP);
+        }
+
+        // the clock is shared by both pwm channels, set it once
+        if(!pwms.empty()) {
+            syslog(LOG_DEBUG, "bcm2835_pwm_set_clock(%d)", BCM2835_PWM_CLOCK_DIVIDER_16);
+            bcm2835_pwm_set_clock(BCM2835_PWM_CLOCK_DIVIDER_16);
+        }
+        //for(auto pwm: pwms) {
+        for(unsigned pwm_channel=0; pwm_channel<pwms.size(); pwm_channel++) {
+            // Set the pwm pin to Alt Fun 5, to allow PWM channel 0 to be output there
+            syslog(LOG_DEBUG, "bcm2835_gpio_fsel(%d, %d)", pwms[pwm_channel], BCM2835_GPIO_FSEL_ALT5);
+            bcm2835_gpio_fsel(pwms[pwm_channel], BCM2835_GPIO_FSEL_ALT5);
+            syslog(LOG_DEBUG, "bcm2835_pwm_set_mode(%d, %d, %d)", pwm_channel, 1, 1);
+            bcm2835_pwm_set_mode(pwm_channel, 1, 1);
+            syslog(LOG_DEBUG, "bcm2835_pwm_set_range(%d, %d)", pwm_channel, 1024);
+            bcm2835_pwm_set_range(pwm_channel, 1024);
+            // init to pwm 50%, or what it was before a reinit()
+            syslog(LOG_DEBUG, "bcm2835_pwm_set_data(%d, %d)", pwm_channel, pwm_trsf(pwm_values[pwm_channel]));
+            bcm2835_pwm_set_data(pwm_channel, pwm_trsf(pwm_values[pwm_channel]));
+        }
+    }
+    #else
+    #endif
+    if(expander) {
+        std::string err;
+        if(expander->init(err)) {
+            syslog(LOG_ERR, "pca9685: %s", err.c_str());
+            expander_ok = false;
+            failures++;
+        }
+        else {
+            for(unsigned i=0; i<expander_duty.size(); i++) expander->set(i, expander_duty[i]);
+            expander_dirty = true;
+        }
     }
 
-    //for(auto pwm: pwms) {
-    for(unsigned pwm_channel=0; pwm_channel<pwms.size(); pwm_channel++) {
-        // Set the pwm pin to Alt Fun 5, to allow PWM channel 0 to be output there
-        syslog(LOG_DEBUG, "bcm2835_gpio_fsel(%d, %d)", pwms[pwm_channel], BCM2835_GPIO_FSEL_ALT5);
-        bcm2835_gpio_fsel(pwms[pwm_channel], BCM2835_GPIO_FSEL_ALT5);
-        syslog(LOG_DEBUG, "bcm2835_pwm_set_clock(%d)", BCM2835_PWM_CLOCK_DIVIDER_16);
-        bcm2835_pwm_set_clock(BCM2835_PWM_CLOCK_DIVIDER_16);
-        syslog(LOG_DEBUG, "bcm2835_pwm_set_mode(%d, %d, %d)", pwm_channel, 1, 1);
-        bcm2835_pwm_set_mode(pwm_channel, 1, 1);
-        syslog(LOG_DEBUG, "bcm2835_pwm_set_range(%d, %d)", pwm_channel, 1024);
-        bcm2835_pwm_set_range(pwm_channel, 1024);
-        // init to pwm 50%
-        syslog(LOG_DEBUG, "bcm2835_pwm_set_data(%d, %d)", pwm_channel, 512);
-        bcm2835_pwm_set_data(pwm_channel, 512);
+    close();
+}
+
+int BCM2835::reinit() {
+    std::lock_guard<std::recursive_mutex> lock(mtx);
+    reinits++;
+    syslog(LOG_NOTICE, "re-initializing the backend");
+    setup();
+    #ifdef bcm2385_found
+    if(!mockup && gpio_ok && init()==0) {
+        // the switches as they were last written
+        for(unsigned channel=0; channel<channels.size(); channel++) bcm2835_gpio_write(channels[channel], channel_values[channel]);
+        close();
     }
-    #else
     #endif
+    return gpio_ok && expander_ok ? 0 : 1;
+}
 
+int BCM2835::probe() {
+    push_autocommit(false);
+    int ret = init();
+    if(!ret && !channels.empty()) get_channel(0);
     close();
+    pop_autocommit();
+    return ret || !expander_ok;
+}
+
+BCM2835::health_t BCM2835::health() const {
+    return health_t { gpio_ok, expander_ok, expander!=nullptr, last_write, failures, reinits };
+}
+
+bool BCM2835::available(change::kind_t kind, unsigned channel) const {
+    if(kind==change::PWM && channel>=pwms.size()) return expander_ok;
+    return gpio_ok;
 }
 
 int BCM2835::switch_channel(unsigned channel, int value) {
-    if(channel>channels.size())
+    if(channel>=channels.size())
         return -1;
+    std::lock_guard<std::recursive_mutex> lock(mtx);
+    if(arbiter && !arbiter->admit(change::SWITCH, channel, sources.back(), clock())) return -2;
+    int requested = value;
     if(inverted) value = o_trsf(value);
     if(autocommit.back()) init();
+    if(!gpio_ok) {
+        if(autocommit.back()) close();
+        return -3;
+    }
     #ifdef bcm2385_found
-    bcm2835_gpio_write(channels[channel], value);
-    #else
-    channel_values[channel]=value;
+    if(!mockup) bcm2835_gpio_write(channels[channel], value);
     #endif
+    last_write = std::time(nullptr);
+    // with the real backend this is only a write cache for change detection
+    bool differs = channel_values[channel]!=(unsigned)value;
+    channel_values[channel]=value;
     if(autocommit.back()) close();
+    if(differs) changed(change::SWITCH, channel, requested);
     return 0;
 }
 
 int BCM2835::get_channel(unsigned channel) {
-    if(channel>channels.size())
+    if(channel>=channels.size())
         return -1;
+    std::lock_guard<std::recursive_mutex> lock(mtx);
     if(autocommit.back()) init();
-    #ifdef bcm2385_found
-    int value = bcm2835_gpio_lev(channels[channel]);
-    #else
+    // the last value written if the gpio is gone
     int value = channel_values[channel];
+    #ifdef bcm2385_found
+    if(!mockup && gpio_ok) value = bcm2835_gpio_lev(channels[channel]);
     #endif
     if(autocommit.back()) close();
     if(inverted) value=i_trsf(value);
@@ -134,28 +257,149 @@ unsigned BCM2835::size() const {
 }
 
 unsigned BCM2835::get_pwm(unsigned channel) {
+    std::lock_guard<std::recursive_mutex> lock(mtx);
     return pwm_values[channel];
 }
 
 unsigned BCM2835::set_pwm(unsigned channel, unsigned p) {
+    std::lock_guard<std::recursive_mutex> lock(mtx);
+    if(arbiter && channel<pwm_values.size() && !arbiter->admit(change::PWM, channel, sources.back(), clock())) return pwm_values[channel];
     if(autocommit.back()) init();
     // TODO more rigid error handling
-    if(channel>=pwms.size()) {
-        syslog(LOG_ERR, "pwm channel index %d too large (pwms.size(): %d)", channel, (int)pwms.size());
+    if(channel>=pwm_values.size()) {
+        syslog(LOG_ERR, "pwm channel index %d too large (pwm_size(): %d)", channel, (int)pwm_values.size());
         return 0;
     }
-    //syslog(LOG_DEBUG, "bcm2835_pwm_set_data(%d, %d)", channel, pwm_trsf(p));
-    #ifdef bcm2385_found
-    bcm2835_pwm_set_data(channel, pwm_trsf(p));
-    #else
-    #endif
+    if(channel>=pwms.size()) {
+        // the expander has its own mockup bus
+        expander_duty[channel-pwms.size()] = expander_trsf(p);
+        expander->set(channel-pwms.size(), expander_trsf(p));
+        expander_dirty = true;
+    }
+    else if(!gpio_ok) {
+        if(autocommit.back()) close();
+        return pwm_values[channel];
+    }
+    else {
+        //syslog(LOG_DEBUG, "bcm2835_pwm_set_data(%d, %d)", channel, pwm_trsf(p));
+        #ifdef bcm2385_found
+        if(!mockup) bcm2835_pwm_set_data(channel, pwm_trsf(p));
+        #else
+        #endif
+        last_write = std::time(nullptr);
+    }
+    bool differs = pwm_values[channel]!=p;
     pwm_values[channel]=p;
     if(autocommit.back()) close();
+    if(differs) changed(change::PWM, channel, p);
     return p;
 }
 
+bool BCM2835::has_raw(unsigned channel) const {
+    return channel>=pwms.size() && channel<pwm_values.size();
+}
+
+unsigned BCM2835::get_pwm_raw(unsigned channel) {
+    std::lock_guard<std::recursive_mutex> lock(mtx);
+    return has_raw(channel) ? expander_duty[channel-pwms.size()] : 0;
+}
+
+unsigned BCM2835::set_pwm_raw(unsigned channel, unsigned duty) {
+    std::lock_guard<std::recursive_mutex> lock(mtx);
+    if(!has_raw(channel)) {
+        syslog(LOG_ERR, "pwm channel %u has no raw duty cycle", channel);
+        return 0;
+    }
+    unsigned &d = expander_duty[channel-pwms.size()];
+    if(arbiter && !arbiter->admit(change::PWM, channel, sources.back(), clock())) return d;
+    if(autocommit.back()) init();
+    duty = std::min(duty, PCA9685::full);
+    expander->set(channel-pwms.size(), duty);
+    expander_dirty = true;
+    bool differs = d!=duty;
+    d = duty;
+    pwm_values[channel] = expander_percent(duty);
+    if(autocommit.back()) close();
+    if(differs) changed(change::PWM, channel, pwm_values[channel]);
+    return duty;
+}
+
 unsigned BCM2835::pwm_size() const {
-    return pwms.size();
+    return pwm_values.size();
+}
+
+BCM2835::transition BCM2835::compile(uint64_t mask, uint64_t values, const std::vector<std::pair<unsigned, unsigned>> &p) const {
+    transition t { 0, 0, 0, 0, 0, {} };
+    for(unsigned channel=0; channel<channels.size() && channel<64; channel++) {
+        uint64_t bit = uint64_t(1)<<channel;
+        if(!(mask&bit)) continue;
+        bool value = values&bit;
+        t.mask |= bit;
+        if(value) t.values |= bit;
+        if(channels[channel]>=32) {
+            t.slow_mask |= bit;
+            continue;
+        }
+        t.pin_mask |= uint32_t(1)<<channels[channel];
+        if(inverted ? !value : value) t.pin_values |= uint32_t(1)<<channels[channel];
+    }
+    if(mask&~t.mask) syslog(LOG_ERR, "transition touches unknown switch channels (mask 0x%llx)", (unsigned long long)(mask&~t.mask));
+    for(auto &pwm: p) {
+        if(pwm.first>=pwm_values.size()) {
+            syslog(LOG_ERR, "transition: pwm channel index %d too large (pwm_size(): %d)", pwm.first, (int)pwm_values.size());
+            continue;
+        }
+        t.pwms.push_back(pwm);
+    }
+    return t;
+}
+
+int BCM2835::apply(const transition &t) {
+    std::lock_guard<std::recursive_mutex> lock(mtx);
+    uint64_t mask = t.mask;
+    uint32_t pin_mask = t.pin_mask;
+    if(arbiter) {
+        // channels claimed by a higher priority are left out
+        mask = arbiter->admit_mask(t.mask, sources.back(), clock());
+        for(uint64_t m=t.mask&~mask; m; m&=m-1) {
+            unsigned channel = __builtin_ctzll(m);
+            if(channels[channel]<32) pin_mask &= ~(uint32_t(1)<<channels[channel]);
+        }
+    }
+    if(autocommit.back()) init();
+    // the switches are dropped without the gpio, the pwms may be on the expander
+    int ret = 0;
+    if(!gpio_ok) {
+        mask = pin_mask = 0;
+        ret = -3;
+    }
+    else if(mask) last_write = std::time(nullptr);
+    #ifdef bcm2385_found
+    if(!mockup && pin_mask) {
+        syslog(LOG_DEBUG, "bcm2835_gpio_write_mask(0x%x, 0x%x)", t.pin_values&pin_mask, pin_mask);
+        bcm2835_gpio_write_mask(t.pin_values&pin_mask, pin_mask);
+    }
+    #endif
+    uint64_t changed_mask = 0;
+    for(uint64_t m=mask; m; m&=m-1) {
+        unsigned channel = __builtin_ctzll(m);
+        unsigned value = (t.values>>channel)&1;
+        if(inverted) value = o_trsf(value);
+        #ifdef bcm2385_found
+        if(!mockup && t.slow_mask&(uint64_t(1)<<channel)) bcm2835_gpio_write(channels[channel], value);
+        #endif
+        if(channel_values[channel]!=value) changed_mask |= uint64_t(1)<<channel;
+        channel_values[channel]=value;
+    }
+    autocommit.push_back(false);
+    for(auto &pwm: t.pwms) set_pwm(pwm.first, pwm.second);
+    autocommit.pop_back();
+    if(autocommit.back()) close();
+    for(uint64_t m=changed_mask; m; m&=m-1) {
+        unsigned channel = __builtin_ctzll(m);
+        changed(change::SWITCH, channel, (t.values>>channel)&1);
+    }
+    return ret;
 }
 
 #include <ctime>
@@ -166,77 +410,106 @@ bool BCM2835::has_autom() {
 }
 
 bool BCM2835::autom() {
+    std::lock_guard<std::recursive_mutex> lock(mtx);
     if(!using_auto) {
         syslog(LOG_INFO, "not using_auto: skipping automatic stuff");
         return true;
     }
-    #if 1
-    time_t rawtime;
-    struct tm * timeinfo;
-    time ( &rawtime );
-    timeinfo = localtime ( &rawtime );
-    syslog(LOG_DEBUG, "reference: %s", asctime(timeinfo));
-    #endif
+    if(debug) {
+        time_t rawtime = clock();
+        tm timeinfo;
+        char buf[32];
+        syslog(LOG_DEBUG, "reference: %s", asctime_r(localtime_r(&rawtime, &timeinfo), buf));
+    }
+
+    // claims that ran out give their channels back to the schedule below
+    if(arbiter) arbiter->tick(clock());
 
     autocommit.push_back(false);
+    sources.push_back(AUTO);
     init();
 
     dot dotNow = dotFromNow();
 
-    syslog(LOG_DEBUG, "dotNow=%d==%s", dotNow, formatDot(dotNow).c_str());
-
-    std::vector<interval> on_times_light;
-    on_times_light.push_back(interval(dotFromString("12:00:00"), dotFromString("16:00:00")));
-    on_times_light.push_back(interval(dotFromString("18:00:00"), dotFromString("22:00:00")));
+    if(debug) syslog(LOG_DEBUG, "dotNow=%d==%s", dotNow, formatDot(dotNow).c_str());
 
-    std::vector<interval> on_times_co2;
-    on_times_co2.push_back(interval(dotFromString("10:00:00"), dotFromString("14:00:00")));
-    on_times_co2.push_back(interval(dotFromString("16:00:00"), dotFromString("20:00:00")));
+    // solar times etc. are resolved once a day, not on every tick
+    if(!schedule.compiled_for(seg_tm)) schedule.compile(seg_tm);
 
-    bool lightsOn=isOn(on_times_light, dotNow);
-    bool co2On=isOn(on_times_co2, dotNow);
     double rel=envelope(dotNow)*noon(dotNow);
     unsigned abs=rel*(768-100)+100;
 
-    syslog(LOG_INFO, "time %s: lightsOn: %d, co2On: %d, rel: %f, abs: %d", formatDot(dotNow).c_str(), lightsOn, co2On, rel, abs);
-    syslog(LOG_DEBUG, "rel: %f=%f*%f", rel, envelope(dotNow), noon(dotNow));
+    // formatDot() is not for free, skip it if nobody would see the line
+    if(setlogmask(0)&LOG_MASK(LOG_INFO)) {
+        syslog(LOG_INFO, "time %s: rel: %f, abs: %d", formatDot(dotNow).c_str(), rel, abs);
+    }
+    if(debug) syslog(LOG_DEBUG, "rel: %f=%f*%f", rel, envelope(dotNow), noon(dotNow));
+
+    auto pwm = [this](unsigned channel, unsigned value) {
+        if(channel<pwm_values.size() && !auto_skip_pwm[channel]) set_pwm(channel, value);
+    };
+    auto sw = [this](unsigned channel, int value) {
+        if(channel<channels.size() && !auto_skip_switch[channel]) switch_channel(channel, value);
+    };
+    pwm(0, rel*100);
+    for(auto channel: schedule.channels()) {
+        sw(channel, isOn(schedule.intervals(channel), dotNow));
+    }
+    sources.pop_back();
+    autocommit.pop_back();
+    close();
+    return true;
+}
+
+void BCM2835::exclude_from_auto(change::kind_t kind, unsigned channel) {
+    std::lock_guard<std::recursive_mutex> lock(mtx);
+    if(kind==change::SWITCH && channel<auto_skip_switch.size()) auto_skip_switch[channel] = true;
+    if(kind==change::PWM && channel<auto_skip_pwm.size()) auto_skip_pwm[channel] = true;
+}
 
-    set_pwm(0, rel*100);
+// my fishtank, if nothing else is configured
+void BCM2835::default_schedule() {
+    std::string err;
     // lights
-    switch_channel(0, lightsOn);
-    switch_channel(1, lightsOn);
+    for(unsigned channel: { 0, 1 }) {
+        schedule.add_rule(channel, "12:00:00", "16:00:00", "", "", err);
+        schedule.add_rule(channel, "18:00:00", "22:00:00", "", "", err);
+    }
     // filter/heating
-    switch_channel(2, true);
+    schedule.add_rule(2, "00:00:00", "24:00:00", "", "", err);
     // co2
-    switch_channel(3, co2On);
-    autocommit.pop_back();
-    close();
-    return true;
+    schedule.add_rule(3, "10:00:00", "14:00:00", "", "", err);
+    schedule.add_rule(3, "16:00:00", "20:00:00", "", "", err);
+}
+
+void BCM2835::set_schedule(const Schedule &s) {
+    std::lock_guard<std::recursive_mutex> lock(mtx);
+    schedule = s;
 }
 
 double BCM2835::envelope(unsigned t) const {
-    int t0=t-dotFromString("12:00:00");
-    unsigned T=dotFromString("22:00:00")-dotFromString("12:00:00");
+    int t0=t-hms(12, 0, 0);
+    unsigned T=hms(22, 0, 0)-hms(12, 0, 0);
     double env=std::sin(t0*M_PI/T);
     syslog(LOG_DEBUG, "envelope: t0=%d, T=%d, phi=%f, env=%f", t0, T, t0*M_PI/T, env);
     return env;
 }
 
 double BCM2835::noon(unsigned t) const {
-    if(t<dotFromString("15:30:00"))
+    if(t<hms(15, 30, 0))
         return 1;
-    if(t<dotFromString("16:00:00")) {
+    if(t<hms(16, 0, 0)) {
         // somehow ramp down to 0
-        unsigned t0=t-dotFromString("15:30:00");
-        return 1-double(t0)/dotFromString("00:30:00");
+        unsigned t0=t-hms(15, 30, 0);
+        return 1-double(t0)/hms(0, 30, 0);
     }
-    if(t<dotFromString("18:00:00")) {
+    if(t<hms(18, 0, 0)) {
         return 0;
     }
-    if(t<dotFromString("18:30:00")) {
+    if(t<hms(18, 30, 0)) {
         // somehow ramp up to 1
-        unsigned t0=t-dotFromString("18:00:00");
-        return double(t0)/dotFromString("00:30:00");
+        unsigned t0=t-hms(18, 0, 0);
+        return double(t0)/hms(0, 30, 0);
     }
     return 1;
 }
@@ -246,10 +519,13 @@ unsigned BCM2835::dotFromTm(const tm &t) const {
 }
 
 unsigned BCM2835::dotFromNow() const {
-    std::chrono::system_clock::time_point now = std::chrono::system_clock::now();
-    time_t tt = std::chrono::system_clock::to_time_t(now);
-    tm local_tm = *localtime(&tt);
-    return dotFromTm(local_tm);
+    time_t now = clock();
+    if(now<seg_start || now>=seg_start+900) {
+        seg_start = now-now%900;
+        localtime_r(&seg_start, &seg_tm);
+        seg_dot = dotFromTm(seg_tm);
+    }
+    return seg_dot+(now-seg_start);
 }
 unsigned BCM2835::dotFromString(const std::string &s) const {
     std::vector<std::string> tokens;
@@ -280,10 +556,28 @@ std::string BCM2835::formatDot(dot t) const {
 }
 
 
-void BCM2835::push_autocommit(bool a) {
+uint64_t BCM2835::get_version() const {
+    return version;
+}
+
+void BCM2835::on_change(change_fn f) {
+    listeners.push_back(f);
+}
+
+void BCM2835::changed(change::kind_t kind, unsigned channel, unsigned value) {
+    change c { kind, channel, value, ++version, sources.back() };
+    syslog(LOG_DEBUG, "state version %llu: kind %d, channel %d, value %d", (unsigned long long)c.version, kind, channel, value);
+    for(auto &l: listeners) l(c);
+}
+
+void BCM2835::push_autocommit(bool a, source_t s) {
+    mtx.lock();
     autocommit.push_back(a);
+    sources.push_back(s);
 }
 
 void BCM2835::pop_autocommit() {
+    sources.pop_back();
     autocommit.pop_back();
+    mtx.unlock();
 }
@@ -1,9 +1,19 @@
 #ifndef LIGHTSRV_BCM2835_H
 #define LIGHTSRV_BCM2835_H
 
+#include <atomic>
+#include <cstdint>
+#include <ctime>
+#include <functional>
+#include <mutex>
 #include <string>
 #include <vector>
 
+#include "Schedule.h"
+
+class Arbiter;
+class PCA9685;
+
 // use:
 //     BCM backend { 17, 27 };
 //     backend.setup();
@@ -22,32 +32,144 @@ class BCM2835 {
     // this is actually also used if we have the real backend because the
     // real backend does not offer reading pwm values
     std::vector<unsigned> pwm_values;
+    // switch / pwm channels driven by something else, autom() leaves them alone
+    std::vector<bool> auto_skip_switch;
+    std::vector<bool> auto_skip_pwm;
+    // all public methods lock this, push_autocommit() until the matching
+    // pop_autocommit(), so a transaction is not interleaved with other threads
+    std::recursive_mutex mtx;
+    // bumped on every actual state change, see get_version()
+    std::atomic<uint64_t> version;
+public:
+    // who asked for a change, see push_autocommit()
+    enum source_t { API, AUTO, SCENE, INPUT, CONTROL, MQTT };
+    struct change {
+        enum kind_t { SWITCH, PWM, AUTO };
+        kind_t kind;
+        unsigned channel;
+        unsigned value;
+        uint64_t version;
+        source_t source;
+    };
+    typedef std::function<void(const change &)> change_fn;
+    // precompiled multi channel update, see compile() and apply()
+    struct transition {
+        uint64_t mask;          // switch channels touched, bit n for channel n
+        uint64_t values;        // their requested values
+        uint32_t pin_mask;      // same as gpio pin mask, for one register write
+        uint32_t pin_values;    // already inverted if needed
+        uint64_t slow_mask;     // channels on pins >=32, written one by one
+        std::vector<std::pair<unsigned, unsigned>> pwms; // channel, value
+    };
+private:
+    std::vector<change_fn> listeners;
+    std::vector<source_t> sources;
+    bool mockup;
+    Arbiter *arbiter;
+    // pwm channels from pwms.size() on are outputs of this one, staged by
+    // set_pwm() and written out by close()
+    PCA9685 *expander;
+    // duty cycles of its channels, 0..PCA9685::full, finer than the percent
+    // in pwm_values
+    std::vector<unsigned> expander_duty;
+    bool expander_dirty;
+    std::atomic<bool> expander_ok;
+    // hardware state for health(), read without the lock
+    std::atomic<bool> gpio_ok;
+    std::atomic<time_t> last_write;
+    std::atomic<unsigned long> failures;
+    std::atomic<unsigned long> reinits;
+    void flush_expander();
+public:
+    typedef std::function<time_t()> clock_fn;
+private:
+    clock_fn clock;
+    // dotFromNow() cache: local time is only looked up once per quarter of
+    // an hour, all time zone offsets and transitions are aligned to those
+    mutable time_t seg_start;
+    mutable unsigned seg_dot;
+    mutable tm seg_tm;
+    void changed(change::kind_t kind, unsigned channel, unsigned value);
     int o_trsf(int arg);
     int i_trsf(int arg);
     int pwm_trsf(int arg);
 public:
     typedef unsigned dot;
     typedef std::pair<dot, dot> interval;
+    static constexpr dot hms(unsigned h, unsigned m, unsigned s) { return h*3600+m*60+s; }
     BCM2835(std::initializer_list<unsigned> c, std::initializer_list<unsigned> p, bool has_automode=false, bool inverted=false, bool debug=false);
     BCM2835(const std::vector<unsigned> &c, const std::vector<unsigned> &p, bool has_automode=false, bool inverted=false, bool debug=false);
     void set_debug(bool d);
+    // never touch the hardware, even if built with libbcm2835
+    void set_mockup(bool m);
+    // time source for autom(), std::time() by default
+    void set_clock(clock_fn c);
+    // what that clock says, the arbiter's claims expire by it
+    time_t now() const { return clock(); }
+    // writes a channel's claim holder outranks are dropped, switch_channel()
+    // returns -2 for them
+    void set_arbiter(Arbiter *a);
+    // adds the expander's outputs as pwm channels after the gpio ones,
+    // before setup()
+    void set_expander(PCA9685 *e);
     void set_inverted(bool d);
     void set_auto(bool a);
     bool get_auto() const;
     void setup();
+    // setup() again after a failure, the switches get their last written
+    // values back; 0 once the hardware answers
+    int reinit();
+    // one read through the whole hardware path, for latency probes
+    int probe();
+    struct health_t {
+        bool gpio;              // the last bcm2835_init() worked
+        bool expander;          // the last expander write worked
+        bool has_expander;
+        time_t last_write;      // of a hardware write that went through, 0 never
+        unsigned long failures;
+        unsigned long reinits;
+    };
+    health_t health() const;
+    // whether a write to the channel would reach the hardware
+    bool available(change::kind_t kind, unsigned channel) const;
+    // -3 if the gpio is not available
     int switch_channel(unsigned channel, int value);
+    // the last written value if the gpio is not available
     int get_channel(unsigned channel);
     unsigned size() const;
     unsigned get_pwm(unsigned channel);
     unsigned set_pwm(unsigned channel, unsigned p);
+    // whether channel is an expander one, with a raw duty cycle
+    bool has_raw(unsigned channel) const;
+    // raw duty cycle 0..PCA9685::full of an expander channel, its percent
+    // value follows rounded. 0 for other channels
+    unsigned get_pwm_raw(unsigned channel);
+    unsigned set_pwm_raw(unsigned channel, unsigned duty);
+    // percent to raw duty cycle and back
+    static unsigned expander_trsf(unsigned arg);
+    static unsigned expander_percent(unsigned duty);
     unsigned pwm_size() const;
+    transition compile(uint64_t mask, uint64_t values, const std::vector<std::pair<unsigned, unsigned>> &pwms) const;
+    // all switches in one gpio register write, then the pwms; -3 if the
+    // switches were dropped since the gpio is not available
+    int apply(const transition &t);
     bool has_autom();
     bool autom();
-    void push_autocommit(bool);
+    void exclude_from_auto(change::kind_t kind, unsigned channel);
+    // replaces the built in switch schedule of autom()
+    void set_schedule(const Schedule &s);
+    uint64_t get_version() const;
+    // listeners are called synchronously from whatever thread did the change
+    void on_change(change_fn f);
+    // begins a transaction, locks the backend for this thread; changes
+    // until the matching pop_autocommit() are reported with source s
+    void push_autocommit(bool, source_t s=API);
     void pop_autocommit();
     int init();
     void close();
 private:
+    Schedule schedule;
+    void default_schedule();
     double envelope(unsigned t) const;
     double noon(unsigned t) const;
     unsigned dotFromTm(const tm &t) const ;
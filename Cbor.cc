@@ -0,0 +1,357 @@
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+#include "Cbor.h"
+
+// append only: the index is the key on the wire
+static const char *keys[] = {
+    "error", "code", "category", "message", "response", "request",
+    "switches", "pwms", "auto", "available", "value", "on"
+};
+static const unsigned nkeys = sizeof(keys)/sizeof(keys[0]);
+
+// the arrays packed by field name: switch states 0/1 as bits, pwm values
+// as uint16
+static const char bits_key[] = "switches";
+static const char uint16_key[] = "pwms";
+
+enum { UINT = 0, NINT = 1, BYTES = 2, TEXT = 3, ARRAY = 4, MAP = 5, TAG = 6, SIMPLE = 7 };
+static const unsigned TAG_UINT16_LE = 69;
+static const unsigned max_depth = 32;
+
+static void put_head(std::string &out, unsigned major, uint64_t v) {
+    char m = major<<5;
+    if(v<24) out += (char)(m|v);
+    else if(v<=0xff) {
+        out += (char)(m|24);
+        out += (char)v;
+    }
+    else if(v<=0xffff) {
+        out += (char)(m|25);
+        for(int s=8; s>=0; s-=8) out += (char)(v>>s);
+    }
+    else if(v<=0xffffffff) {
+        out += (char)(m|26);
+        for(int s=24; s>=0; s-=8) out += (char)(v>>s);
+    }
+    else {
+        out += (char)(m|27);
+        for(int s=56; s>=0; s-=8) out += (char)(v>>s);
+    }
+}
+
+static std::size_t head_size(uint64_t v) {
+    return v<24 ? 1 : v<=0xff ? 2 : v<=0xffff ? 3 : v<=0xffffffff ? 5 : 9;
+}
+
+static bool integral(double d) {
+    return d==std::floor(d) && std::fabs(d)<=9007199254740992.0;
+}
+
+static void put_number(std::string &out, double d) {
+    if(integral(d)) {
+        if(d>=0) put_head(out, UINT, (uint64_t)d);
+        else put_head(out, NINT, (uint64_t)(-1-d));
+        return;
+    }
+    float f = (float)d;
+    if((double)f==d || std::isnan(d)) {
+        uint32_t u;
+        std::memcpy(&u, &f, 4);
+        out += (char)0xfa;
+        for(int s=24; s>=0; s-=8) out += (char)(u>>s);
+        return;
+    }
+    uint64_t u;
+    std::memcpy(&u, &d, 8);
+    out += (char)0xfb;
+    for(int s=56; s>=0; s-=8) out += (char)(u>>s);
+}
+
+static void put(std::string &out, const json11::Json &j, const std::string &field);
+
+// the packings of the schema, where they beat the plain array
+static bool put_packed(std::string &out, const json11::Json::array &a, const std::string &field) {
+    bool bits = field==bits_key;
+    if(a.empty() || (!bits && field!=uint16_key)) return false;
+    std::size_t plain = head_size(a.size());
+    for(auto &v: a) {
+        double d = v.number_value();
+        if(!v.is_number() || !integral(d) || d<0 || d>(bits ? 1 : 0xffff)) return false;
+        plain += head_size((uint64_t)d);
+    }
+    if(bits) {
+        std::size_t n = (a.size()+7)/8;
+        if(head_size(n+1)+n+1>=plain) return false;
+        std::string packed(n+1, '\0');
+        packed[0] = n*8-a.size();
+        for(std::size_t i=0; i<a.size(); i++) if(a[i].number_value()) packed[1+i/8] |= 1<<(i%8);
+        put_head(out, BYTES, packed.size());
+        out += packed;
+        return true;
+    }
+    if(head_size(TAG_UINT16_LE)+head_size(2*a.size())+2*a.size()>=plain) return false;
+    put_head(out, TAG, TAG_UINT16_LE);
+    put_head(out, BYTES, 2*a.size());
+    for(auto &v: a) {
+        unsigned u = v.number_value();
+        out += (char)(u&0xff);
+        out += (char)(u>>8);
+    }
+    return true;
+}
+
+static void put(std::string &out, const json11::Json &j, const std::string &field) {
+    switch(j.type()) {
+    case json11::Json::NUL:
+        out += (char)0xf6;
+        break;
+    case json11::Json::BOOL:
+        out += (char)(j.bool_value() ? 0xf5 : 0xf4);
+        break;
+    case json11::Json::NUMBER:
+        put_number(out, j.number_value());
+        break;
+    case json11::Json::STRING:
+        put_head(out, TEXT, j.string_value().size());
+        out += j.string_value();
+        break;
+    case json11::Json::ARRAY:
+        if(put_packed(out, j.array_items(), field)) break;
+        put_head(out, ARRAY, j.array_items().size());
+        for(auto &v: j.array_items()) put(out, v, "");
+        break;
+    case json11::Json::OBJECT:
+        put_head(out, MAP, j.object_items().size());
+        for(auto &kv: j.object_items()) {
+            unsigned k = 0;
+            while(k<nkeys && kv.first!=keys[k]) k++;
+            if(k<nkeys) put_head(out, UINT, k);
+            else {
+                put_head(out, TEXT, kv.first.size());
+                out += kv.first;
+            }
+            put(out, kv.second, kv.first);
+        }
+        break;
+    }
+}
+
+std::string Cbor::encode(const json11::Json &j) {
+    std::string out;
+    put(out, j, "");
+    return out;
+}
+
+namespace {
+
+class reader {
+public:
+    reader(const std::string &in): in(in), pos(0) {}
+    // field: the key the value is under, for the packings
+    json11::Json value(unsigned depth, const std::string &field, std::string &err);
+    bool at_end() const { return pos==in.size(); }
+private:
+    bool head(unsigned &major, unsigned &info, uint64_t &v, std::string &err);
+    bool bytes(unsigned major, unsigned info, uint64_t len, std::string &s, std::string &err);
+    json11::Json key(unsigned depth, std::string &err);
+    const std::string &in;
+    std::size_t pos;
+};
+
+bool reader::head(unsigned &major, unsigned &info, uint64_t &v, std::string &err) {
+    if(pos>=in.size()) {
+        err = "truncated cbor";
+        return false;
+    }
+    unsigned char c = in[pos++];
+    major = c>>5;
+    info = c&0x1f;
+    v = info;
+    if(info<24 || info==31) return true;
+    if(info>27) {
+        err = "invalid cbor additional info";
+        return false;
+    }
+    unsigned n = 1u<<(info-24);
+    if(in.size()-pos<n) {
+        err = "truncated cbor";
+        return false;
+    }
+    v = 0;
+    for(unsigned i=0; i<n; i++) v = v<<8 | (unsigned char)in[pos++];
+    return true;
+}
+
+// a definite or indefinite byte or text string
+bool reader::bytes(unsigned major, unsigned info, uint64_t len, std::string &s, std::string &err) {
+    if(info!=31) {
+        if(len>in.size()-pos) {
+            err = "truncated cbor";
+            return false;
+        }
+        s.assign(in, pos, len);
+        pos += len;
+        return true;
+    }
+    s.clear();
+    while(true) {
+        if(pos<in.size() && (unsigned char)in[pos]==0xff) {
+            pos++;
+            return true;
+        }
+        unsigned m, i;
+        uint64_t l;
+        std::string chunk;
+        if(!head(m, i, l, err)) return false;
+        if(m!=major || i==31) {
+            err = "invalid cbor string chunk";
+            return false;
+        }
+        if(!bytes(m, i, l, chunk, err)) return false;
+        s += chunk;
+    }
+}
+
+json11::Json reader::key(unsigned depth, std::string &err) {
+    std::size_t start = pos;
+    unsigned major, info;
+    uint64_t v;
+    if(!head(major, info, v, err)) return nullptr;
+    if(major==UINT) return v<nkeys ? std::string(keys[v]) : std::to_string(v);
+    pos = start;
+    json11::Json k = value(depth, "", err);
+    if(!err.empty()) return nullptr;
+    return k.is_string() ? k : json11::Json(k.dump());
+}
+
+json11::Json reader::value(unsigned depth, const std::string &field, std::string &err) {
+    if(depth>max_depth) {
+        err = "cbor nested too deep";
+        return nullptr;
+    }
+    unsigned major, info;
+    uint64_t v;
+    if(!head(major, info, v, err)) return nullptr;
+    if(info==31 && (major==UINT || major==NINT || major==TAG)) {
+        err = "invalid cbor indefinite length";
+        return nullptr;
+    }
+    switch(major) {
+    case UINT:
+        return (double)v;
+    case NINT:
+        return -1-(double)v;
+    case BYTES: {
+        // JSON has no byte strings, only the schema's bit array is one
+        std::string s;
+        if(!bytes(major, info, v, s, err)) return nullptr;
+        if(field!=bits_key) {
+            err = "unexpected cbor byte string";
+            return nullptr;
+        }
+        json11::Json::array a;
+        if(s.empty()) return a;
+        unsigned unused = (unsigned char)s[0];
+        if(unused>7 || (s.size()==1 && unused)) {
+            err = "invalid cbor bit array";
+            return nullptr;
+        }
+        std::size_t n = (s.size()-1)*8-unused;
+        for(std::size_t i=0; i<n; i++) a.push_back((unsigned char)s[1+i/8]>>(i%8)&1);
+        return a;
+    }
+    case TEXT: {
+        std::string s;
+        if(!bytes(major, info, v, s, err)) return nullptr;
+        return s;
+    }
+    case ARRAY: {
+        json11::Json::array a;
+        for(uint64_t i=0; info==31 || i<v; i++) {
+            if(info==31 && pos<in.size() && (unsigned char)in[pos]==0xff) {
+                pos++;
+                break;
+            }
+            if(info!=31 && v-i>in.size()-pos) {
+                err = "truncated cbor";
+                return nullptr;
+            }
+            a.push_back(value(depth+1, "", err));
+            if(!err.empty()) return nullptr;
+        }
+        return a;
+    }
+    case MAP: {
+        json11::Json::object o;
+        for(uint64_t i=0; info==31 || i<v; i++) {
+            if(info==31 && pos<in.size() && (unsigned char)in[pos]==0xff) {
+                pos++;
+                break;
+            }
+            if(info!=31 && v-i>in.size()-pos) {
+                err = "truncated cbor";
+                return nullptr;
+            }
+            json11::Json k = key(depth+1, err);
+            if(!err.empty()) return nullptr;
+            json11::Json val = value(depth+1, k.string_value(), err);
+            if(!err.empty()) return nullptr;
+            o[k.string_value()] = val;
+        }
+        return o;
+    }
+    case TAG: {
+        // the typed array describes itself, it is taken anywhere
+        if(v!=TAG_UINT16_LE) return value(depth+1, field, err);
+        unsigned m, i;
+        uint64_t len;
+        std::string s;
+        if(!head(m, i, len, err)) return nullptr;
+        if(m!=BYTES || !bytes(m, i, len, s, err) || s.size()%2) {
+            if(err.empty()) err = "invalid cbor uint16 array";
+            return nullptr;
+        }
+        json11::Json::array a;
+        for(std::size_t k=0; k<s.size(); k+=2) a.push_back((int)((unsigned char)s[k] | (unsigned char)s[k+1]<<8));
+        return a;
+    }
+    default:
+        switch(info) {
+        case 20: return false;
+        case 21: return true;
+        case 22: case 23: return nullptr;
+        case 25: {
+            // half float
+            unsigned h = v, e = (h>>10)&0x1f, m = h&0x3ff;
+            double d = e==0 ? std::ldexp(m, -24) : e==31 ? (m ? NAN : INFINITY) : std::ldexp(m+1024, e-25);
+            return h&0x8000 ? -d : d;
+        }
+        case 26: {
+            uint32_t u = v;
+            float f;
+            std::memcpy(&f, &u, 4);
+            return (double)f;
+        }
+        case 27: {
+            double d;
+            std::memcpy(&d, &v, 8);
+            return d;
+        }
+        default:
+            err = "unsupported cbor simple value";
+            return nullptr;
+        }
+    }
+}
+
+}
+
+json11::Json Cbor::decode(const std::string &in, std::string &err) {
+    err.clear();
+    reader r(in);
+    json11::Json j = r.value(0, "", err);
+    if(err.empty() && !r.at_end()) err = "trailing data after cbor";
+    return err.empty() ? j : json11::Json();
+}
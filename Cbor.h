@@ -0,0 +1,31 @@
+#ifndef LIGHTSRV_CBOR_H
+#define LIGHTSRV_CBOR_H
+
+#include <string>
+
+#include "json11.git/json11.hpp"
+
+// CBOR (RFC 8949) for clients that would rather not parse JSON. it carries
+// the same documents as the JSON API, one schema drives both directions,
+// so a document comes back from CBOR as the JSON it was:
+//
+//  - keys of the API envelope and state ("error", "response", "switches",
+//    ...) are small integers, see keys in Cbor.cc; others stay strings
+//  - the "switches" array of 0/1 may be a byte string: a count of unused
+//    bits in the last byte, then bit n is element n, least significant
+//    bit first. JSON has no byte strings, so no other field takes one
+//  - the "pwms" array of integers 0..65535 may be an RFC 8746 typed
+//    array, tag 69: uint16, little endian; read under any key
+//  - integral numbers are integers, others float32 if exact, float64
+//
+// either packing is only used where it is the smaller one; the decoder
+// takes both forms and plain CBOR from any encoder.
+
+class Cbor {
+public:
+    static std::string encode(const json11::Json &j);
+    // err is set on malformed input, then the result is null
+    static json11::Json decode(const std::string &in, std::string &err);
+};
+
+#endif
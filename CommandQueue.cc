@@ -0,0 +1,178 @@
+#include <syslog.h>
+
+#include "CommandQueue.h"
+
+CommandQueue::CommandQueue(BCM2835 &backend, double max_rate):
+    backend(backend), max_rate(max_rate),
+    min_interval(std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(max_rate>0 ? 1/max_rate : 0))),
+    dirty(false), stop(false), switches(backend.size(), slot { false, 0, false, false, 0, false, 0, 0, 0 }),
+    pwms(backend.pwm_size(), slot { false, 0, false, false, 0, false, 0, 0, 0 }), batches(0)
+{
+}
+
+CommandQueue::~CommandQueue() {
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        stop = true;
+    }
+    cv.notify_one();
+    if(thread.joinable()) thread.join();
+}
+
+void CommandQueue::start() {
+    if(!enabled()) return;
+    thread = std::thread([this](){ run(); });
+}
+
+int CommandQueue::enqueue(std::vector<slot> &slots, unsigned channel, unsigned value, bool raw) {
+    if(channel>=slots.size()) return -1;
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        slot &s = slots[channel];
+        if(s.pending) s.superseded++;
+        s.pending = true;
+        s.value = value;
+        s.raw = raw;
+        s.enqueued++;
+        dirty = true;
+    }
+    cv.notify_one();
+    return 0;
+}
+
+int CommandQueue::switch_channel(unsigned channel, bool value) {
+    return enqueue(switches, channel, value, false);
+}
+
+int CommandQueue::set_pwm(unsigned channel, unsigned value) {
+    return enqueue(pwms, channel, value, false);
+}
+
+int CommandQueue::set_pwm_raw(unsigned channel, unsigned duty) {
+    if(!backend.has_raw(channel)) return -1;
+    return enqueue(pwms, channel, duty, true);
+}
+
+int CommandQueue::get_channel(unsigned channel) {
+    if(channel<switches.size()) {
+        std::lock_guard<std::mutex> lock(mtx);
+        const slot &s = switches[channel];
+        if(s.pending) return s.value;
+        if(s.applying) return s.applying_value;
+    }
+    return backend.get_channel(channel);
+}
+
+bool CommandQueue::pending_pwm(unsigned channel, unsigned &value, bool &raw) const {
+    if(channel>=pwms.size()) return false;
+    std::lock_guard<std::mutex> lock(mtx);
+    const slot &s = pwms[channel];
+    if(s.pending) {
+        value = s.value;
+        raw = s.raw;
+        return true;
+    }
+    if(s.applying) {
+        value = s.applying_value;
+        raw = s.applying_raw;
+        return true;
+    }
+    return false;
+}
+
+unsigned CommandQueue::get_pwm(unsigned channel) {
+    unsigned value;
+    bool raw;
+    if(pending_pwm(channel, value, raw)) return raw ? BCM2835::expander_percent(value) : value;
+    return backend.get_pwm(channel);
+}
+
+unsigned CommandQueue::get_pwm_raw(unsigned channel) {
+    unsigned value;
+    bool raw;
+    if(backend.has_raw(channel) && pending_pwm(channel, value, raw)) return raw ? value : BCM2835::expander_trsf(value);
+    return backend.get_pwm_raw(channel);
+}
+
+void CommandQueue::run() {
+    auto next = std::chrono::steady_clock::now();
+    std::unique_lock<std::mutex> lock(mtx);
+    for(;;) {
+        cv.wait(lock, [this](){ return dirty || stop; });
+        // what comes in until the next update is due overwrites the pending values
+        cv.wait_until(lock, next, [this](){ return stop; });
+        if(stop) return;
+
+        std::vector<std::pair<unsigned, unsigned>> sw, pw, raw;
+        for(auto t: { std::make_pair(&switches, &sw), std::make_pair(&pwms, &pw) }) {
+            for(unsigned i=0; i<t.first->size(); i++) {
+                slot &s = (*t.first)[i];
+                if(!s.pending) continue;
+                s.pending = false;
+                s.applying = true;
+                s.applying_value = s.value;
+                s.applying_raw = s.raw;
+                (s.raw ? raw : *t.second).push_back({ i, s.value });
+            }
+        }
+        dirty = false;
+        lock.unlock();
+
+        backend.push_autocommit(false);
+        backend.init();
+        for(auto &c: sw) backend.switch_channel(c.first, c.second);
+        for(auto &c: pw) backend.set_pwm(c.first, c.second);
+        for(auto &c: raw) backend.set_pwm_raw(c.first, c.second);
+        backend.close();
+        backend.pop_autocommit();
+
+        lock.lock();
+        for(auto &c: sw) {
+            switches[c.first].applying = false;
+            switches[c.first].applied++;
+        }
+        for(auto v: { &pw, &raw }) {
+            for(auto &c: *v) {
+                pwms[c.first].applying = false;
+                pwms[c.first].applied++;
+            }
+        }
+        batches++;
+        next = std::chrono::steady_clock::now()+min_interval;
+    }
+}
+
+json11::Json CommandQueue::slots_json(const std::vector<slot> &slots) {
+    json11::Json::array a;
+    for(auto &s: slots) {
+        a.push_back(json11::Json::object {
+            { "enqueued", (double)s.enqueued },
+            { "superseded", (double)s.superseded },
+            { "applied", (double)s.applied },
+            { "ratio", s.applied ? (double)s.enqueued/s.applied : 0.0 }
+        });
+    }
+    return a;
+}
+
+json11::Json CommandQueue::to_json() const {
+    std::lock_guard<std::mutex> lock(mtx);
+    unsigned long enqueued = 0, applied = 0;
+    for(auto v: { &switches, &pwms }) {
+        for(auto &s: *v) {
+            enqueued += s.enqueued;
+            applied += s.applied;
+        }
+    }
+    return json11::Json::object {
+        { "enabled", enabled() },
+        { "max_rate", max_rate },
+        { "enqueued", (double)enqueued },
+        { "applied", (double)applied },
+        { "batches", (double)batches },
+        // commands per hardware write
+        { "ratio", applied ? (double)enqueued/applied : 0.0 },
+        { "switches", slots_json(switches) },
+        { "pwms", slots_json(pwms) }
+    };
+}
@@ -0,0 +1,71 @@
+#ifndef LIGHTSRV_COMMANDQUEUE_H
+#define LIGHTSRV_COMMANDQUEUE_H
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <boost/noncopyable.hpp>
+
+#include "json11.git/json11.hpp"
+#include "BCM2835.h"
+
+// switch and pwm commands from the API are not written to the hardware
+// right away but go into one slot per channel, the latest value wins. a
+// writer thread applies whatever is pending in one backend transaction, at
+// most max_rate times a second, so dragging a slider costs a few hardware
+// updates instead of one per input event. values superseded before they
+// were applied never touch the hardware.
+//
+// reads go through the queue too, so a client reads back what it set even
+// if it was not applied yet.
+
+class CommandQueue : boost::noncopyable {
+public:
+    // max_rate in updates per second, 0 disables the queue
+    CommandQueue(BCM2835 &backend, double max_rate);
+    ~CommandQueue();
+    bool enabled() const { return max_rate>0; }
+    void start();
+    int switch_channel(unsigned channel, bool value);
+    int set_pwm(unsigned channel, unsigned value);
+    // an expander channel's raw duty cycle, shares the channel's slot
+    int set_pwm_raw(unsigned channel, unsigned duty);
+    // pending value if there is one, the backend's otherwise
+    int get_channel(unsigned channel);
+    unsigned get_pwm(unsigned channel);
+    unsigned get_pwm_raw(unsigned channel);
+    json11::Json to_json() const;
+private:
+    struct slot {
+        bool pending;
+        unsigned value;
+        bool raw;               // value is a raw duty cycle
+        bool applying;          // taken by the writer, not written yet
+        unsigned applying_value;
+        bool applying_raw;
+        unsigned long enqueued;
+        unsigned long superseded;
+        unsigned long applied;
+    };
+    void run();
+    int enqueue(std::vector<slot> &slots, unsigned channel, unsigned value, bool raw);
+    // a pending pwm value, false if none
+    bool pending_pwm(unsigned channel, unsigned &value, bool &raw) const;
+    static json11::Json slots_json(const std::vector<slot> &slots);
+    BCM2835 &backend;
+    double max_rate;
+    std::chrono::steady_clock::duration min_interval;
+    mutable std::mutex mtx;
+    std::condition_variable cv;
+    bool dirty;
+    bool stop;
+    std::vector<slot> switches;
+    std::vector<slot> pwms;
+    unsigned long batches;
+    std::thread thread;
+};
+
+#endif
@@ -0,0 +1,207 @@
+#include <syslog.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <ctime>
+
+#include "ControlLoops.h"
+
+PlantModel::PlantModel(BCM2835 &backend, BCM2835::change::kind_t kind, unsigned channel, double ambient, double gain, double loss, double speed):
+    backend(backend), kind(kind), channel(channel), ambient(ambient), gain(gain), loss(loss), speed(speed),
+    temperature(ambient), last(std::chrono::steady_clock::now())
+{
+}
+
+int PlantModel::read(double &value) {
+    std::lock_guard<std::mutex> lock(mtx);
+    auto now = std::chrono::steady_clock::now();
+    double dt = std::chrono::duration<double>(now-last).count()*speed;
+    last = now;
+    double u = kind==BCM2835::change::SWITCH ? (backend.get_channel(channel)==1 ? 1 : 0) : backend.get_pwm(channel)/100.0;
+    // dT/dt = gain*u - loss*(T-ambient), exact for constant u over dt
+    double eq = ambient+gain*u/loss;
+    temperature = eq+(temperature-eq)*std::exp(-loss*dt);
+    value = temperature;
+    return 0;
+}
+
+ControlLoops::loop::loop():
+    series(nullptr), type(HYSTERESIS), channel(0), cooling(false), setpoint(0), band(0),
+    kp(0), ki(0), kd(0), out_min(0), out_max(100), integral(0), prev_error(0), has_prev(false),
+    output(-1), period_ms(1000), max_age(300),
+    ticks(0), writes(0), stale(0), jitter_max_ns(0), jitter_sum_ns(0), input(NAN)
+{
+}
+
+ControlLoops::ControlLoops(BCM2835 &backend, Sensors &sensors):
+    backend(backend), sensors(sensors), work(new boost::asio::io_service::work(io))
+{
+}
+
+ControlLoops::~ControlLoops() {
+    work.reset();
+    io.stop();
+    if(thread.joinable()) thread.join();
+}
+
+int ControlLoops::configure(const json11::Json &config, std::string &err) {
+    if(!config.is_array()) {
+        err = "control loops must be an array of loop objects";
+        return 1;
+    }
+    for(auto &c: config.array_items()) {
+        std::unique_ptr<loop> l(new loop());
+        l->name = c["name"].is_string() ? c["name"].string_value() : "loop" + std::to_string(loops.size());
+        l->sensor = c["sensor"].string_value();
+        std::string type = c["type"].string_value();
+        BCM2835::change::kind_t kind;
+        if(type=="hysteresis" && c["switch"].is_number() && (unsigned)c["switch"].int_value()<backend.size()) {
+            l->type = HYSTERESIS;
+            kind = BCM2835::change::SWITCH;
+            l->channel = c["switch"].int_value();
+        }
+        else if(type=="pid" && c["pwm"].is_number() && (unsigned)c["pwm"].int_value()<backend.pwm_size()) {
+            l->type = PID;
+            kind = BCM2835::change::PWM;
+            l->channel = c["pwm"].int_value();
+        }
+        else {
+            err = "loop " + l->name + ": needs type hysteresis with a valid switch or type pid with a valid pwm";
+            return 1;
+        }
+        l->cooling = c["cooling"].bool_value();
+        l->setpoint = c["setpoint"].number_value();
+        l->band = c["band"].is_number() ? c["band"].number_value() : 1;
+        l->kp = c["kp"].number_value();
+        l->ki = c["ki"].number_value();
+        l->kd = c["kd"].number_value();
+        if(c["min"].is_number()) l->out_min = c["min"].number_value();
+        if(c["max"].is_number()) l->out_max = c["max"].number_value();
+        if(c["period"].is_number() && c["period"].int_value()>0) l->period_ms = c["period"].int_value();
+        if(c["max_age"].is_number()) l->max_age = c["max_age"].int_value();
+
+        if(c["plant"].is_object()) {
+            auto &p = c["plant"];
+            if(l->sensor=="") l->sensor = l->name + "-plant";
+            sensors.add(l->sensor, std::unique_ptr<SensorSource>(new PlantModel(backend, kind,  l->channel,
+                p["ambient"].is_number() ? p["ambient"].number_value() : 20,
+                p["gain"].is_number() ? p["gain"].number_value() : 0.02,
+                p["loss"].is_number() ? p["loss"].number_value() : 0.001,
+                p["speed"].is_number() ? p["speed"].number_value() : 1)),
+                std::max(1u, l->period_ms/1000));
+        }
+        l->series = sensors.series(l->sensor);
+        if(!l->series) {
+            err = "loop " + l->name + ": unknown sensor " + l->sensor;
+            return 1;
+        }
+        backend.exclude_from_auto(kind, l->channel);
+        syslog(LOG_INFO, "control loop %s: %s from sensor %s to channel %d every %d ms", l->name.c_str(), type.c_str(), l->sensor.c_str(), l->channel, l->period_ms);
+        loops.push_back(std::move(l));
+    }
+    return 0;
+}
+
+void ControlLoops::start() {
+    if(loops.empty()) return;
+    for(auto &l: loops) {
+        l->timer.reset(new boost::asio::steady_timer(io));
+        l->deadline = std::chrono::steady_clock::now();
+        schedule(*l);
+    }
+    thread = std::thread([this]() {
+        // real-time-ish: a fifo priority above the server, if we are allowed to
+        sched_param param;
+        param.sched_priority = 10;
+        int e = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+        if(e) syslog(LOG_INFO, "control loops: no SCHED_FIFO (%s), running with normal priority", strerror(e));
+        io.run();
+    });
+}
+
+void ControlLoops::schedule(loop &l) {
+    // absolute deadlines, so the period does not drift with the tick duration
+    l.deadline += std::chrono::milliseconds(l.period_ms);
+    l.timer->expires_at(l.deadline);
+    l.timer->async_wait([this, &l](const boost::system::error_code &e) {
+        if(e) return;
+        long long jitter = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now()-l.deadline).count();
+        l.jitter_sum_ns += jitter;
+        if(jitter>l.jitter_max_ns) l.jitter_max_ns = jitter;
+        tick(l);
+        // skip missed periods instead of running them back to back
+        auto now = std::chrono::steady_clock::now();
+        while(l.deadline+std::chrono::milliseconds(l.period_ms)<now) l.deadline += std::chrono::milliseconds(l.period_ms);
+        schedule(l);
+    });
+}
+
+void ControlLoops::tick(loop &l) {
+    l.ticks++;
+    TimeSeries::point p;
+    if(!l.series->latest(p) || std::time(nullptr)-p.t>(int64_t)l.max_age) {
+        // no current input: fail safe
+        l.stale++;
+        l.has_prev = false;
+        actuate(l, l.type==HYSTERESIS ? 0 : (int)l.out_min);
+        return;
+    }
+    double value = p.avg;
+    l.input = value;
+    if(l.type==HYSTERESIS) {
+        int output = l.output<0 ? 0 : l.output.load();
+        double low = l.setpoint-l.band/2, high = l.setpoint+l.band/2;
+        if(value<low) output = !l.cooling;
+        else if(value>high) output = l.cooling;
+        actuate(l, output);
+        return;
+    }
+    double dt = l.period_ms/1000.0;
+    double error = l.setpoint-value;
+    double derivative = l.has_prev ? (error-l.prev_error)/dt : 0;
+    l.prev_error = error;
+    l.has_prev = true;
+    double integral = l.integral+error*dt;
+    double out = l.kp*error+l.ki*integral+l.kd*derivative;
+    // anti windup: only integrate while the output is not saturated
+    if(out>l.out_max) out = l.out_max;
+    else if(out<l.out_min) out = l.out_min;
+    else l.integral = integral;
+    actuate(l, (int)std::lround(out));
+}
+
+void ControlLoops::actuate(loop &l, int output) {
+    if(output==l.output) return;
+    l.output = output;
+    l.writes++;
+    syslog(LOG_DEBUG, "control loop %s: input %f, output %d", l.name.c_str(), l.input.load(), output);
+    backend.push_autocommit(true, BCM2835::CONTROL);
+    if(l.type==HYSTERESIS) backend.switch_channel(l.channel, output);
+    else backend.set_pwm(l.channel, output);
+    backend.pop_autocommit();
+}
+
+json11::Json ControlLoops::to_json() const {
+    json11::Json::object o;
+    for(auto &l: loops) {
+        unsigned long ticks = l->ticks;
+        o[l->name] = json11::Json::object {
+            { "type", l->type==HYSTERESIS ? "hysteresis" : "pid" },
+            { "sensor", l->sensor },
+            { "channel", (int)l->channel },
+            { "setpoint", l->setpoint },
+            { "input", std::isnan(l->input.load()) ? json11::Json() : json11::Json(l->input.load()) },
+            { "output", l->output.load() },
+            { "period_ms", (int)l->period_ms },
+            { "ticks", (double)ticks },
+            { "writes", (double)l->writes },
+            { "stale", (double)l->stale },
+            { "jitter_avg_us", ticks ? l->jitter_sum_ns/1e3/ticks : 0 },
+            { "jitter_max_us", l->jitter_max_ns/1e3 }
+        };
+    }
+    return o;
+}
@@ -0,0 +1,94 @@
+#ifndef LIGHTSRV_CONTROLLOOPS_H
+#define LIGHTSRV_CONTROLLOOPS_H
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <boost/asio/io_service.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/noncopyable.hpp>
+
+#include "json11.git/json11.hpp"
+
+#include "BCM2835.h"
+#include "Sensors.h"
+
+// simulated plant for testing loops without hardware: a first order
+// thermal model heated by a switch or pwm channel of the backend.
+// every read integrates the time since the previous one, times speed.
+class PlantModel : public SensorSource {
+public:
+    PlantModel(BCM2835 &backend, BCM2835::change::kind_t kind, unsigned channel, double ambient, double gain, double loss, double speed);
+    int read(double &value) override;
+private:
+    BCM2835 &backend;
+    BCM2835::change::kind_t kind;
+    unsigned channel;
+    double ambient, gain, loss, speed;
+    double temperature;
+    std::chrono::steady_clock::time_point last;
+    std::mutex mtx;
+};
+
+// closed loops from a sensor to a switch (hysteresis) or a pwm (pid). the
+// loops run on their own thread and io_service with a raised scheduling
+// priority if we may, each on its own period with absolute deadlines.
+//
+// config: [{"name": "heating", "sensor": "water", "type": "hysteresis", "switch": 2,
+//           "setpoint": 25, "band": 0.5, "period": 5000},
+//          {"name": "light", "sensor": "lux", "type": "pid", "pwm": 0,
+//           "setpoint": 300, "kp": 0.1, "ki": 0.01, "kd": 0, "period": 1000}]
+// optional: "cooling": true (hysteresis switches on above the band),
+//           "max_age": seconds a sample may be old before the actuator is
+//           switched off / set to min, "min"/"max" pwm output range,
+//           "plant": {"ambient": 20, "gain": 0.02, "loss": 0.001, "speed": 1}
+//           registers a PlantModel as the loop's sensor.
+
+class ControlLoops : boost::noncopyable {
+public:
+    ControlLoops(BCM2835 &backend, Sensors &sensors);
+    ~ControlLoops();
+    int configure(const json11::Json &config, std::string &err);
+    void start();
+    json11::Json to_json() const;
+private:
+    enum type_t { HYSTERESIS, PID };
+    struct loop {
+        std::string name;
+        std::string sensor;
+        const TimeSeries *series;
+        type_t type;
+        unsigned channel;
+        bool cooling;
+        double setpoint, band;
+        double kp, ki, kd, out_min, out_max;
+        double integral, prev_error;
+        bool has_prev;
+        std::atomic<int> output;
+        unsigned period_ms;
+        unsigned max_age;
+        std::unique_ptr<boost::asio::steady_timer> timer;
+        std::chrono::steady_clock::time_point deadline;
+        // exported
+        std::atomic<unsigned long> ticks, writes, stale;
+        std::atomic<long long> jitter_max_ns, jitter_sum_ns;
+        std::atomic<double> input;
+        loop();
+    };
+    void schedule(loop &l);
+    void tick(loop &l);
+    void actuate(loop &l, int output);
+    BCM2835 &backend;
+    Sensors &sensors;
+    boost::asio::io_service io;
+    std::unique_ptr<boost::asio::io_service::work> work;
+    std::thread thread;
+    std::vector<std::unique_ptr<loop>> loops;
+};
+
+#endif
@@ -0,0 +1,207 @@
+#include <syslog.h>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+
+#include "History.h"
+
+static const char history_magic[8] = { 'L', 'S', 'H', 'I', 'S', 'T', '1', '\0' };
+
+History::History(BCM2835 &backend, const std::string &file, unsigned event_capacity, unsigned day_capacity):
+    backend(backend), n_switches(backend.size()), n_channels(backend.size()+backend.pwm_size()),
+    row_size(sizeof(int32_t)+n_channels*sizeof(float)), map(nullptr), hdr(nullptr), ring(nullptr), days(nullptr)
+{
+    if(!event_capacity) event_capacity = 1;
+    if(!day_capacity) day_capacity = 1;
+    size = sizeof(header)+event_capacity*sizeof(event)+day_capacity*row_size;
+
+    int fd = ::open(file.c_str(), O_RDWR|O_CREAT|O_CLOEXEC, 0644);
+    if(fd<0) {
+        syslog(LOG_ERR, "history: cannot open %s: %s", file.c_str(), strerror(errno));
+        return;
+    }
+    struct stat st;
+    bool fresh = fstat(fd, &st) || (std::size_t)st.st_size!=size;
+    if(fresh && ftruncate(fd, size)) {
+        syslog(LOG_ERR, "history: cannot resize %s: %s", file.c_str(), strerror(errno));
+        ::close(fd);
+        return;
+    }
+    map = mmap(nullptr, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if(map==MAP_FAILED) {
+        syslog(LOG_ERR, "history: cannot mmap %s: %s", file.c_str(), strerror(errno));
+        map = nullptr;
+        return;
+    }
+    hdr = (header *)map;
+    ring = (event *)((char *)map+sizeof(header));
+    days = (char *)(ring+event_capacity);
+    if(fresh || memcmp(hdr->magic, history_magic, sizeof(history_magic)) || hdr->n_channels!=n_channels
+            || hdr->event_capacity!=event_capacity || hdr->day_capacity!=day_capacity) {
+        // different layout (channels or capacities changed): start over
+        syslog(LOG_WARNING, "history: initializing %s (%d bytes)", file.c_str(), (int)size);
+        memset(map, 0, size);
+        memcpy(hdr->magic, history_magic, sizeof(history_magic));
+        hdr->n_channels = n_channels;
+        hdr->event_capacity = event_capacity;
+        hdr->day_capacity = day_capacity;
+        for(unsigned d=0; d<day_capacity; d++) *(int32_t *)(days+d*row_size) = -1;
+    }
+    syslog(LOG_INFO, "history: %s, %llu events recorded", file.c_str(), (unsigned long long)hdr->event_count);
+
+    time_t now = std::time(nullptr);
+    backend.push_autocommit(false);
+    backend.init();
+    for(unsigned i=0; i<n_switches; i++) weight.push_back(backend.get_channel(i)==1 ? 1 : 0);
+    for(unsigned i=0; i<backend.pwm_size(); i++) weight.push_back(backend.get_pwm(i)/100.0);
+    backend.close();
+    backend.pop_autocommit();
+    since.assign(n_channels, now);
+
+    backend.on_change([this](const BCM2835::change &c){ changed(c); });
+}
+
+History::~History() {
+    if(!map) return;
+    std::lock_guard<std::mutex> lock(mtx);
+    time_t now = std::time(nullptr);
+    for(unsigned i=0; i<n_channels; i++) account(i, now);
+    msync(map, size, MS_SYNC);
+    munmap(map, size);
+}
+
+bool History::ok() const {
+    return map!=nullptr;
+}
+
+unsigned History::index(BCM2835::change::kind_t kind, unsigned channel) const {
+    // out of range channels map to n_channels
+    if(kind==BCM2835::change::SWITCH) return channel<n_switches ? channel : n_channels;
+    return channel<n_channels-n_switches ? n_switches+channel : n_channels;
+}
+
+int32_t History::local_day(time_t t, time_t &day_end) {
+    tm local_tm;
+    localtime_r(&t, &local_tm);
+    local_tm.tm_hour = local_tm.tm_min = local_tm.tm_sec = 0;
+    local_tm.tm_mday++;
+    local_tm.tm_isdst = -1;
+    day_end = mktime(&local_tm);
+    // the date as if it was utc, so days are consecutive numbers
+    local_tm.tm_mday--;
+    return timegm(&local_tm)/86400;
+}
+
+void History::day_bounds(int32_t day, time_t &start, time_t &end) {
+    time_t t = time_t(day)*86400;
+    tm local_tm;
+    gmtime_r(&t, &local_tm);
+    local_tm.tm_isdst = -1;
+    start = mktime(&local_tm);
+    local_tm.tm_mday++;
+    local_tm.tm_isdst = -1;
+    end = mktime(&local_tm);
+}
+
+float *History::day_row(int32_t day, bool create) const {
+    char *row = days+(day%hdr->day_capacity)*row_size;
+    int32_t *tag = (int32_t *)row;
+    if(*tag!=day) {
+        if(!create) return nullptr;
+        // reuse the slot of a day which is out of retention
+        *tag = day;
+        memset(row+sizeof(int32_t), 0, row_size-sizeof(int32_t));
+    }
+    return (float *)(row+sizeof(int32_t));
+}
+
+void History::account(unsigned i, time_t now) {
+    time_t t = since[i];
+    since[i] = now;
+    if(weight[i]<=0) return;
+    while(t<now) {
+        time_t day_end;
+        int32_t day = local_day(t, day_end);
+        time_t end = std::min(now, day_end);
+        day_row(day, true)[i] += (end-t)*weight[i];
+        t = end;
+    }
+}
+
+void History::changed(const BCM2835::change &c) {
+    if(!map) return;
+    int64_t now_ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+    std::lock_guard<std::mutex> lock(mtx);
+    ring[hdr->event_count++%hdr->event_capacity] = event { now_ms, (uint8_t)c.kind, (uint8_t)c.source, (uint16_t)c.channel, c.value };
+    if(c.kind==BCM2835::change::AUTO) return;
+    unsigned i = index(c.kind, c.channel);
+    if(i>=n_channels) return;
+    account(i, now_ms/1000);
+    weight[i] = c.kind==BCM2835::change::SWITCH ? (c.value ? 1 : 0) : c.value/100.0;
+}
+
+std::vector<History::event> History::events(int64_t from_ms, int64_t to_ms, unsigned limit) const {
+    std::vector<event> result;
+    if(!map) return result;
+    std::lock_guard<std::mutex> lock(mtx);
+    uint64_t count = std::min<uint64_t>(hdr->event_count, hdr->event_capacity);
+    uint64_t first = hdr->event_count-count;
+    auto at = [this](uint64_t n) -> const event & { return ring[n%hdr->event_capacity]; };
+    // events are in time order, binary search for the first after t
+    auto after = [&](int64_t t) {
+        uint64_t lo = first, hi = hdr->event_count;
+        while(lo<hi) {
+            uint64_t mid = lo+(hi-lo)/2;
+            if(at(mid).t_ms<=t) lo = mid+1;
+            else hi = mid;
+        }
+        return lo;
+    };
+    uint64_t begin = after(from_ms-1), end = after(to_ms);
+    // the newest limit of them
+    if(end>begin+limit) begin = end-limit;
+    for(uint64_t n=begin; n<end; n++) result.push_back(at(n));
+    return result;
+}
+
+std::vector<History::usage> History::usage_of(BCM2835::change::kind_t kind, unsigned channel, time_t from, time_t to) const {
+    std::vector<usage> result;
+    unsigned i = index(kind, channel);
+    if(!map || i>=n_channels) return result;
+    std::lock_guard<std::mutex> lock(mtx);
+    time_t day_end;
+    int32_t first = local_day(from, day_end);
+    int32_t last = local_day(to, day_end);
+    if(last-first>=(int32_t)hdr->day_capacity) first = last-hdr->day_capacity+1;
+    time_t now = std::time(nullptr);
+    for(int32_t d=first; d<=last; d++) {
+        float *row = day_row(d, false);
+        double seconds = row ? row[i] : 0;
+        // the running interval since the last change is not in the rows yet
+        time_t start, end;
+        day_bounds(d, start, end);
+        start = std::max(start, since[i]);
+        end = std::min(end, now);
+        if(weight[i]>0 && end>start) seconds += (end-start)*weight[i];
+        if(row || seconds>0) result.push_back(usage { d, seconds });
+    }
+    return result;
+}
+
+const char *History::kind_name(unsigned k) {
+    static const char *names[] = { "switch", "pwm", "auto" };
+    return k<3 ? names[k] : "unknown";
+}
+
+const char *History::source_name(unsigned s) {
+    static const char *names[] = { "api", "auto", "scene", "input", "control", "mqtt" };
+    return s<sizeof(names)/sizeof(names[0]) ? names[s] : "unknown";
+}
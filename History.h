@@ -0,0 +1,81 @@
+#ifndef LIGHTSRV_HISTORY_H
+#define LIGHTSRV_HISTORY_H
+
+#include <cstdint>
+#include <ctime>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <boost/noncopyable.hpp>
+
+#include "BCM2835.h"
+
+// persistent record of every state change plus per day usage rollups, in
+// one mmap'ed file of fixed size:
+//
+//   header
+//   events[event_capacity]     ring, appended in time order
+//   days[day_capacity]         per local day: on seconds of each switch and
+//                              duty weighted on seconds of each pwm, slot
+//                              day % day_capacity
+//
+// when the event ring is full the oldest events are overwritten, the day
+// rows keep the usage of older days; a day slot is reused after
+// day_capacity days. so the file never grows.
+
+class History : boost::noncopyable {
+public:
+    struct event {
+        int64_t t_ms;
+        uint8_t kind;       // BCM2835::change::kind_t
+        uint8_t source;     // BCM2835::source_t
+        uint16_t channel;
+        uint32_t value;
+    };
+    struct usage {
+        int32_t day;        // days since 1970-01-01 of the local date
+        double seconds;     // on seconds, duty weighted for pwms
+    };
+    History(BCM2835 &backend, const std::string &file, unsigned event_capacity, unsigned day_capacity);
+    ~History();
+    bool ok() const;
+    // the newest limit events between from and to, oldest first
+    std::vector<event> events(int64_t from_ms, int64_t to_ms, unsigned limit) const;
+    // per day usage of a channel between from and to (unix seconds),
+    // including the running on time of today
+    std::vector<usage> usage_of(BCM2835::change::kind_t kind, unsigned channel, time_t from, time_t to) const;
+    static const char *kind_name(unsigned k);
+    static const char *source_name(unsigned s);
+private:
+    struct header {
+        char magic[8];
+        uint32_t n_channels;
+        uint32_t event_capacity;
+        uint32_t day_capacity;
+        uint32_t reserved;
+        uint64_t event_count;
+    };
+    void changed(const BCM2835::change &c);
+    // credit the time since the last change of channel i to its day rows
+    void account(unsigned i, time_t now);
+    static int32_t local_day(time_t t, time_t &day_end);
+    static void day_bounds(int32_t day, time_t &start, time_t &end);
+    float *day_row(int32_t day, bool create) const;
+    unsigned index(BCM2835::change::kind_t kind, unsigned channel) const;
+    BCM2835 &backend;
+    unsigned n_switches;
+    unsigned n_channels;
+    std::size_t row_size;
+    std::size_t size;
+    void *map;
+    header *hdr;
+    event *ring;
+    char *days;
+    mutable std::mutex mtx;
+    // current value and since when, per channel
+    std::vector<double> weight;
+    std::vector<time_t> since;
+};
+
+#endif
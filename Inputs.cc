@@ -0,0 +1,245 @@
+#include <syslog.h>
+
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <limits>
+
+#include <boost/algorithm/string.hpp>
+
+#include "Inputs.h"
+
+Inputs::Inputs(boost::asio::io_service &io, BCM2835 &backend, Scenes &scenes, const std::string &chip):
+    io(io), backend(backend), scenes(scenes), chip(chip), chip_fd(-1), n_records(0),
+    latency_min(std::numeric_limits<uint64_t>::max()), latency_max(0), latency_sum(0), latency_count(0)
+{
+}
+
+Inputs::~Inputs() {
+    if(chip_fd>=0) ::close(chip_fd);
+}
+
+uint64_t Inputs::monotonic_ns() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return uint64_t(ts.tv_sec)*1000000000+ts.tv_nsec;
+}
+
+int Inputs::configure(const json11::Json &config, std::string &err) {
+    if(!config.is_array()) {
+        err = "inputs must be an array of input objects";
+        return 1;
+    }
+    for(auto &c: config.array_items()) {
+        std::unique_ptr<input> in(new input());
+        in->name = c["name"].string_value();
+        if(in->name=="") in->name = "input" + std::to_string(inputs.size());
+        if(!c["pin"].is_number()) {
+            err = "input " + in->name + ": pin missing";
+            return 1;
+        }
+        in->pin = c["pin"].int_value();
+
+        std::string edge = c["edge"].is_string() ? c["edge"].string_value() : "falling";
+        if(edge=="rising") in->eventflags = GPIOEVENT_REQUEST_RISING_EDGE;
+        else if(edge=="falling") in->eventflags = GPIOEVENT_REQUEST_FALLING_EDGE;
+        else if(edge=="both") in->eventflags = GPIOEVENT_REQUEST_BOTH_EDGES;
+        else {
+            err = "input " + in->name + ": invalid edge " + edge;
+            return 1;
+        }
+
+        std::string bias = c["bias"].string_value();
+        in->handleflags = GPIOHANDLE_REQUEST_INPUT;
+        if(bias=="pull-up") in->handleflags |= GPIOHANDLE_REQUEST_BIAS_PULL_UP;
+        else if(bias=="pull-down") in->handleflags |= GPIOHANDLE_REQUEST_BIAS_PULL_DOWN;
+        else if(bias=="disable") in->handleflags |= GPIOHANDLE_REQUEST_BIAS_DISABLE;
+
+        in->debounce_ns = uint64_t(c["debounce"].is_number() ? c["debounce"].int_value() : 30)*1000000;
+
+        in->action_str = c["action"].string_value();
+        std::vector<std::string> tokens;
+        boost::split(tokens, in->action_str, boost::is_any_of(":"));
+        std::string arg = tokens.size()>1 ? tokens[1] : "";
+        if(tokens[0]=="scene") {
+            in->action = SCENE;
+            in->scene = arg;
+        }
+        else if(tokens[0]=="auto") {
+            if(arg=="on") in->action = AUTO_ON;
+            else if(arg=="off") in->action = AUTO_OFF;
+            else in->action = AUTO_TOGGLE;
+        }
+        else if(tokens[0]=="toggle" || tokens[0]=="on" || tokens[0]=="off") {
+            in->action = tokens[0]=="toggle" ? TOGGLE : tokens[0]=="on" ? ON : OFF;
+            char *end;
+            in->channel = std::strtoul(arg.c_str(), &end, 10);
+            if(arg=="" || *end!='\0' || in->channel>=backend.size()) {
+                err = "input " + in->name + ": invalid switch channel in action " + in->action_str;
+                return 1;
+            }
+        }
+        else {
+            err = "input " + in->name + ": invalid action " + in->action_str;
+            return 1;
+        }
+        in->last_ns = 0;
+        in->events = 0;
+        in->debounced = 0;
+
+        if(open_line(*in, err)) {
+            // keep it anyway, it can still be triggered by inject()
+            syslog(LOG_ERR, "input %s: %s", in->name.c_str(), err.c_str());
+            err.clear();
+        }
+        inputs.push_back(std::move(in));
+        if(inputs.back()->fd) start_read(inputs.size()-1);
+        syslog(LOG_INFO, "input %s on pin %d, action %s", inputs.back()->name.c_str(), inputs.back()->pin, inputs.back()->action_str.c_str());
+    }
+    return 0;
+}
+
+int Inputs::open_line(input &in, std::string &err) {
+    if(chip_fd<0) {
+        chip_fd = ::open(chip.c_str(), O_RDONLY|O_CLOEXEC);
+        if(chip_fd<0) {
+            err = "cannot open " + chip + ": " + strerror(errno);
+            return 1;
+        }
+    }
+    gpioevent_request req;
+    memset(&req, 0, sizeof(req));
+    req.lineoffset = in.pin;
+    req.handleflags = in.handleflags;
+    req.eventflags = in.eventflags;
+    strncpy(req.consumer_label, "lightsrv", sizeof(req.consumer_label)-1);
+    if(ioctl(chip_fd, GPIO_GET_LINEEVENT_IOCTL, &req)<0) {
+        err = "GPIO_GET_LINEEVENT_IOCTL for pin " + std::to_string(in.pin) + " failed: " + strerror(errno);
+        return 1;
+    }
+    in.fd.reset(new boost::asio::posix::stream_descriptor(io, req.fd));
+    return 0;
+}
+
+void Inputs::start_read(unsigned i) {
+    input &in = *inputs[i];
+    in.fd->async_read_some(boost::asio::buffer(in.buf), [this, i](const boost::system::error_code &e, std::size_t len) {
+        if(e) {
+            if(e!=boost::asio::error::operation_aborted) syslog(LOG_ERR, "input %s: read failed: %s", inputs[i]->name.c_str(), e.message().c_str());
+            return;
+        }
+        // the kernel only hands out complete records
+        for(std::size_t n=0; n<len/sizeof(gpioevent_data); n++) {
+            handle_event(i, inputs[i]->buf[n].timestamp, inputs[i]->buf[n].id==GPIOEVENT_EVENT_RISING_EDGE);
+        }
+        start_read(i);
+    });
+}
+
+int Inputs::inject(const std::string &name, bool rising) {
+    for(unsigned i=0; i<inputs.size(); i++) {
+        if(inputs[i]->name!=name) continue;
+        handle_event(i, monotonic_ns(), rising);
+        return 0;
+    }
+    return 1;
+}
+
+void Inputs::handle_event(unsigned i, uint64_t timestamp_ns, bool rising) {
+    input &in = *inputs[i];
+    in.events++;
+    record &r = records[n_records++%records.size()];
+    r.input = i;
+    r.rising = rising;
+    r.timestamp_ns = timestamp_ns;
+    r.latency_ns = 0;
+    // contact bounce: drop everything within debounce after an accepted edge
+    r.debounced = in.last_ns && timestamp_ns-in.last_ns<in.debounce_ns;
+    if(r.debounced) {
+        in.debounced++;
+        syslog(LOG_DEBUG, "input %s: %s edge debounced", in.name.c_str(), rising ? "rising" : "falling");
+        return;
+    }
+    in.last_ns = timestamp_ns;
+
+    run_action(in);
+
+    uint64_t now = monotonic_ns();
+    r.latency_ns = now>timestamp_ns ? now-timestamp_ns : 0;
+    latency_min = std::min(latency_min, r.latency_ns);
+    latency_max = std::max(latency_max, r.latency_ns);
+    latency_sum += r.latency_ns;
+    latency_count++;
+    syslog(LOG_INFO, "input %s: %s edge, action %s, latency %llu us", in.name.c_str(), rising ? "rising" : "falling", in.action_str.c_str(), (unsigned long long)r.latency_ns/1000);
+}
+
+void Inputs::run_action(input &in) {
+    std::string err;
+    switch(in.action) {
+    case TOGGLE:
+    case ON:
+    case OFF:
+        backend.push_autocommit(false, BCM2835::INPUT);
+        backend.init();
+        backend.switch_channel(in.channel, in.action==TOGGLE ? !backend.get_channel(in.channel) : in.action==ON);
+        backend.close();
+        backend.pop_autocommit();
+        break;
+    case SCENE:
+        if(scenes.activate(in.scene, -1, err)) syslog(LOG_ERR, "input %s: %s", in.name.c_str(), err.c_str());
+        break;
+    case AUTO_ON:
+    case AUTO_OFF:
+    case AUTO_TOGGLE:
+        backend.push_autocommit(true, BCM2835::INPUT);
+        backend.set_auto(in.action==AUTO_TOGGLE ? !backend.get_auto() : in.action==AUTO_ON);
+        backend.pop_autocommit();
+        break;
+    }
+}
+
+json11::Json Inputs::to_json() const {
+    json11::Json::array ins;
+    for(auto &in: inputs) {
+        ins.push_back(json11::Json::object {
+            { "name", in->name },
+            { "pin", (int)in->pin },
+            { "action", in->action_str },
+            { "connected", (bool)in->fd },
+            { "events", (double)in->events },
+            { "debounced", (double)in->debounced }
+        });
+    }
+    // monotonic to wall clock for the records
+    timespec rt;
+    clock_gettime(CLOCK_REALTIME, &rt);
+    double offset = rt.tv_sec+rt.tv_nsec/1e9-monotonic_ns()/1e9;
+    json11::Json::array evs;
+    unsigned long first = n_records>records.size() ? n_records-records.size() : 0;
+    for(unsigned long n=first; n<n_records; n++) {
+        const record &r = records[n%records.size()];
+        evs.push_back(json11::Json::object {
+            { "input", inputs[r.input]->name },
+            { "edge", r.rising ? "rising" : "falling" },
+            { "time", offset+r.timestamp_ns/1e9 },
+            { "debounced", r.debounced },
+            { "latency_us", r.latency_ns/1e3 }
+        });
+    }
+    return json11::Json::object {
+        { "inputs", ins },
+        { "events", evs },
+        {
+            "latency_us", json11::Json::object {
+                { "count", (double)latency_count },
+                { "min", latency_count ? latency_min/1e3 : 0 },
+                { "avg", latency_count ? latency_sum/1e3/latency_count : 0 },
+                { "max", latency_max/1e3 }
+            }
+        }
+    };
+}
@@ -0,0 +1,81 @@
+#ifndef LIGHTSRV_INPUTS_H
+#define LIGHTSRV_INPUTS_H
+
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <linux/gpio.h>
+
+#include <boost/asio/io_service.hpp>
+#include <boost/asio/posix/stream_descriptor.hpp>
+#include <boost/noncopyable.hpp>
+
+#include "json11.git/json11.hpp"
+
+#include "BCM2835.h"
+#include "Scenes.h"
+
+// gpio input channels (buttons, door contacts) via the gpio chardev: each
+// line gets an event fd from the kernel which is read asynchronously on the
+// io_service, so there is no polling at all.
+//
+// config: [{"name": "door", "pin": 5, "edge": "falling", "bias": "pull-up",
+//           "debounce": 30, "action": "toggle:0"}]
+// actions: toggle:N, on:N, off:N, scene:NAME, auto:on, auto:off, auto:toggle
+
+class Inputs : boost::noncopyable {
+public:
+    Inputs(boost::asio::io_service &io, BCM2835 &backend, Scenes &scenes, const std::string &chip);
+    ~Inputs();
+    int configure(const json11::Json &config, std::string &err);
+    // feed an event as if the kernel had reported it, e.g. for testing
+    // without the hardware; the timestamp is taken as now
+    int inject(const std::string &name, bool rising);
+    json11::Json to_json() const;
+private:
+    enum action_t { TOGGLE, ON, OFF, SCENE, AUTO_ON, AUTO_OFF, AUTO_TOGGLE };
+    struct input {
+        std::string name;
+        unsigned pin;
+        uint32_t eventflags;
+        uint32_t handleflags;
+        uint64_t debounce_ns;
+        action_t action;
+        unsigned channel;
+        std::string scene;
+        std::string action_str;
+        std::unique_ptr<boost::asio::posix::stream_descriptor> fd;
+        std::array<gpioevent_data, 16> buf;
+        uint64_t last_ns;
+        unsigned long events;
+        unsigned long debounced;
+    };
+    struct record {
+        unsigned input;
+        bool rising;
+        bool debounced;
+        uint64_t timestamp_ns;  // CLOCK_MONOTONIC, like the kernel events
+        uint64_t latency_ns;    // event to backend write done
+    };
+    int open_line(input &in, std::string &err);
+    void start_read(unsigned i);
+    void handle_event(unsigned i, uint64_t timestamp_ns, bool rising);
+    void run_action(input &in);
+    static uint64_t monotonic_ns();
+    boost::asio::io_service &io;
+    BCM2835 &backend;
+    Scenes &scenes;
+    std::string chip;
+    int chip_fd;
+    std::vector<std::unique_ptr<input>> inputs;
+    // last events, ring buffer
+    std::array<record, 64> records;
+    unsigned long n_records;
+    uint64_t latency_min, latency_max, latency_sum;
+    unsigned long latency_count;
+};
+
+#endif
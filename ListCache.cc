@@ -0,0 +1,50 @@
+#include <syslog.h>
+
+#include <vector>
+
+#include "ListCache.h"
+
+ListCache::ListCache(BCM2835 &backend, build_fn build):
+    backend(backend), build(build), body_version(0), next_waiter(1)
+{
+    backend.on_change([this](const BCM2835::change &c){ changed(c); });
+}
+
+std::shared_ptr<const std::string> ListCache::get(uint64_t &version) {
+    std::lock_guard<std::mutex> lock(mtx);
+    uint64_t current = backend.get_version();
+    if(!body || body_version!=current) {
+        syslog(LOG_DEBUG, "list cache: building body for version %llu", (unsigned long long)current);
+        body = std::make_shared<const std::string>(build());
+        body_version = current;
+    }
+    version = body_version;
+    return body;
+}
+
+uint64_t ListCache::version() const {
+    return backend.get_version();
+}
+
+unsigned long ListCache::park(uint64_t since, waiter_fn w) {
+    std::lock_guard<std::mutex> lock(waiters_mtx);
+    if(backend.get_version()>since) return 0;
+    unsigned long id = next_waiter++;
+    waiters[id] = w;
+    syslog(LOG_DEBUG, "list cache: parked waiter %lu for version > %llu (%d waiting)", id, (unsigned long long)since, (int)waiters.size());
+    return id;
+}
+
+void ListCache::unpark(unsigned long id) {
+    std::lock_guard<std::mutex> lock(waiters_mtx);
+    waiters.erase(id);
+}
+
+void ListCache::changed(const BCM2835::change &c) {
+    std::map<unsigned long, waiter_fn> woken;
+    {
+        std::lock_guard<std::mutex> lock(waiters_mtx);
+        woken.swap(waiters);
+    }
+    for(auto &w: woken) w.second(c.version);
+}
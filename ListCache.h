@@ -0,0 +1,47 @@
+#ifndef LIGHTSRV_LISTCACHE_H
+#define LIGHTSRV_LISTCACHE_H
+
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include "BCM2835.h"
+
+// keeps the serialized /v1/list body for the current backend state version,
+// so polls between two changes neither touch the backend nor json11.
+//
+// use:
+//     ListCache cache { backend, [&backend](){ return build_the_body(backend); } };
+//     uint64_t version;
+//     auto body = cache.get(version);
+
+class ListCache {
+public:
+    typedef std::function<std::string()> build_fn;
+    typedef std::function<void(uint64_t version)> waiter_fn;
+    ListCache(BCM2835 &backend, build_fn build);
+    // body of the current version, built at most once per version even
+    // if several threads ask at the same time
+    std::shared_ptr<const std::string> get(uint64_t &version);
+    uint64_t version() const;
+    // long poll: w gets called (from the thread which changed the backend)
+    // once the version moved past since. returns 0 if it already has, in
+    // that case w is not stored at all, or an id for unpark() otherwise.
+    unsigned long park(uint64_t since, waiter_fn w);
+    void unpark(unsigned long id);
+private:
+    void changed(const BCM2835::change &c);
+    BCM2835 &backend;
+    build_fn build;
+    std::mutex mtx;
+    uint64_t body_version;
+    std::shared_ptr<const std::string> body;
+    std::mutex waiters_mtx;
+    unsigned long next_waiter;
+    std::map<unsigned long, waiter_fn> waiters;
+};
+
+#endif
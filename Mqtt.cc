@@ -0,0 +1,355 @@
+#include <syslog.h>
+
+#include <algorithm>
+#include <cctype>
+#include <ctime>
+
+#include <boost/asio/connect.hpp>
+#include <boost/asio/write.hpp>
+
+#include "Mqtt.h"
+
+// packet types, high nibble of the fixed header
+enum { CONNECT=1, CONNACK=2, PUBLISH=3, PUBACK=4, SUBSCRIBE=8, SUBACK=9, PINGREQ=12, PINGRESP=13, DISCONNECT=14 };
+
+static std::string mqtt_string(const std::string &s) {
+    std::string r;
+    r += (char)(s.size()>>8);
+    r += (char)(s.size()&0xff);
+    return r + s;
+}
+
+static std::string mqtt_packet(uint8_t header, const std::string &body) {
+    std::string r(1, (char)header);
+    std::size_t len = body.size();
+    do {
+        uint8_t b = len%128;
+        len /= 128;
+        if(len) b |= 0x80;
+        r += (char)b;
+    } while(len);
+    return r + body;
+}
+
+static std::string upper(std::string s) {
+    std::transform(s.begin(), s.end(), s.begin(), [](unsigned char c){ return std::toupper(c); });
+    return s;
+}
+
+Mqtt::Mqtt(boost::asio::io_service &io, BCM2835 &backend, const std::string &prefix, unsigned keepalive, unsigned batch_ms):
+    io(io), backend(backend), prefix(prefix), keepalive(keepalive), batch_ms(batch_ms), resolver(io), socket(io),
+    retry_timer(io), ping_timer(io), batch_timer(io), connected(false), generation(0), backoff(1), last_rx(0),
+    packet_id(0), writing(false), flush_scheduled(false)
+{
+}
+
+int Mqtt::configure(const std::string &broker, const std::string &client_id, const std::string &user, const std::string &password, std::string &err) {
+    auto colon = broker.rfind(':');
+    host = broker.substr(0, colon);
+    port = colon==std::string::npos ? "1883" : broker.substr(colon+1);
+    if(host=="" || port=="") {
+        err = "broker must be host[:port]: " + broker;
+        return 1;
+    }
+    if(client_id.size()>23) syslog(LOG_WARNING, "mqtt client id %s is longer than 23 characters, some brokers refuse it", client_id.c_str());
+    this->client_id = client_id;
+    this->user = user;
+    this->password = password;
+    return 0;
+}
+
+void Mqtt::start() {
+    if(host=="") return;
+    backend.on_change([this](const BCM2835::change &c){ changed(c); });
+    io.post([this](){ connect(); });
+}
+
+void Mqtt::connect() {
+    unsigned gen = ++generation;
+    resolver.async_resolve(boost::asio::ip::tcp::resolver::query(host, port), [this, gen](const boost::system::error_code &ec, boost::asio::ip::tcp::resolver::iterator it) {
+        if(gen!=generation) return;
+        if(ec) {
+            disconnected("resolve: " + ec.message());
+            return;
+        }
+        boost::asio::async_connect(socket, it, [this, gen](const boost::system::error_code &ec, boost::asio::ip::tcp::resolver::iterator it) {
+            (void)it;
+            if(gen!=generation) return;
+            if(ec) {
+                disconnected("connect: " + ec.message());
+                return;
+            }
+            std::string will_topic = prefix + "/status";
+            // clean session, last will QoS 1 retained, keepalive
+            uint8_t flags = 0x02 | 0x04 | 0x08 | 0x20;
+            if(user!="") flags |= 0x80;
+            if(password!="") flags |= 0x40;
+            std::string body = mqtt_string("MQTT");
+            body += (char)4;
+            body += (char)flags;
+            body += (char)(keepalive>>8);
+            body += (char)(keepalive&0xff);
+            body += mqtt_string(client_id) + mqtt_string(will_topic) + mqtt_string("offline");
+            if(user!="") body += mqtt_string(user);
+            if(password!="") body += mqtt_string(password);
+            rx.clear();
+            last_rx = std::time(nullptr);
+            send(mqtt_packet(CONNECT<<4, body));
+            socket.async_read_some(boost::asio::buffer(rx_buf), [this, gen](const boost::system::error_code &ec, std::size_t len) {
+                if(gen==generation) on_read(ec, len);
+            });
+            ping();
+        });
+    });
+}
+
+void Mqtt::disconnected(const std::string &why) {
+    syslog(LOG_WARNING, "mqtt broker %s:%s: %s, reconnecting in %u seconds", host.c_str(), port.c_str(), why.c_str(), backoff);
+    generation++;
+    connected = false;
+    boost::system::error_code ignored;
+    socket.close(ignored);
+    ping_timer.cancel();
+    // a write still pending owns its buffer, see write_next()
+    tx.clear();
+    writing = false;
+    inflight.clear();
+    retry_timer.expires_from_now(boost::posix_time::seconds(backoff));
+    retry_timer.async_wait([this](const boost::system::error_code &ec) {
+        if(!ec) connect();
+    });
+    backoff = std::min(2*backoff, 60u);
+}
+
+void Mqtt::on_read(const boost::system::error_code &ec, std::size_t len) {
+    if(ec) {
+        disconnected("read: " + ec.message());
+        return;
+    }
+    last_rx = std::time(nullptr);
+    rx.append(rx_buf, len);
+    unsigned gen = generation;
+    // fixed header, remaining length (1..4 bytes), body
+    while(rx.size()>=2 && gen==generation) {
+        std::size_t body_len = 0, pos = 1;
+        unsigned shift = 0;
+        bool complete = false;
+        while(pos<rx.size() && pos<5) {
+            uint8_t b = rx[pos++];
+            body_len |= std::size_t(b&0x7f)<<shift;
+            shift += 7;
+            if(!(b&0x80)) {
+                complete = true;
+                break;
+            }
+        }
+        if(!complete) {
+            if(pos>=5) disconnected("malformed packet length");
+            break;
+        }
+        if(rx.size()<pos+body_len) break;
+        uint8_t header = rx[0];
+        std::string body = rx.substr(pos, body_len);
+        rx.erase(0, pos+body_len);
+        handle(header>>4, header&0x0f, body);
+    }
+    if(gen!=generation) return;
+    socket.async_read_some(boost::asio::buffer(rx_buf), [this, gen](const boost::system::error_code &ec, std::size_t len) {
+        if(gen==generation) on_read(ec, len);
+    });
+}
+
+void Mqtt::handle(uint8_t type, uint8_t flags, const std::string &body) {
+    switch(type) {
+    case CONNACK:
+        if(body.size()<2 || body[1]!=0) {
+            disconnected("connection refused, return code " + std::to_string(body.size()<2 ? -1 : (int)(uint8_t)body[1]));
+            return;
+        }
+        syslog(LOG_INFO, "connected to mqtt broker %s:%s", host.c_str(), port.c_str());
+        connected = true;
+        backoff = 1;
+        {
+            uint16_t id = next_id();
+            std::string sub { (char)(id>>8), (char)(id&0xff) };
+            for(auto f: { "/switch/+/set", "/pwm/+/set", "/auto/set" }) sub += mqtt_string(prefix + f) + (char)1;
+            send(mqtt_packet(SUBSCRIBE<<4 | 0x02, sub));
+        }
+        publish_all();
+        break;
+    case PUBLISH: {
+        if(body.size()<2) return;
+        std::size_t topic_len = (uint8_t)body[0]<<8 | (uint8_t)body[1];
+        std::size_t pos = 2+topic_len;
+        unsigned qos = (flags>>1)&3;
+        if(pos+(qos ? 2 : 0)>body.size()) return;
+        std::string topic = body.substr(2, topic_len);
+        if(qos) {
+            // we subscribe with QoS 1, so the broker never sends QoS 2
+            send(mqtt_packet(PUBACK<<4, body.substr(pos, 2)));
+            pos += 2;
+        }
+        // a retained command would be replayed on every reconnect
+        if(flags&0x01) {
+            syslog(LOG_WARNING, "ignoring retained mqtt command %s", topic.c_str());
+            break;
+        }
+        command(topic, body.substr(pos));
+        break;
+    }
+    case PUBACK:
+        if(body.size()>=2) inflight.erase((uint8_t)body[0]<<8 | (uint8_t)body[1]);
+        break;
+    case SUBACK:
+        if(body.find('\x80', 2)!=std::string::npos) syslog(LOG_ERR, "mqtt broker refused a command subscription");
+        break;
+    case PINGRESP:
+        break;
+    default:
+        syslog(LOG_DEBUG, "ignoring mqtt packet type %u", type);
+    }
+}
+
+void Mqtt::command(const std::string &topic, const std::string &payload) {
+    syslog(LOG_INFO, "mqtt command %s: %s", topic.c_str(), payload.c_str());
+    if(topic.compare(0, prefix.size(), prefix)) return;
+    std::string t = topic.substr(prefix.size());
+    std::string p = upper(payload);
+    bool on = p=="ON" || p=="1" || p=="TRUE";
+    bool off = p=="OFF" || p=="0" || p=="FALSE";
+    // /switch/<n>/set, /pwm/<n>/set
+    auto digits = t.find_first_of("0123456789");
+    unsigned channel = digits==std::string::npos ? ~0u : std::strtoul(t.c_str()+digits, nullptr, 10);
+
+    if(t=="/auto/set" && (on || off)) {
+        backend.push_autocommit(true, BCM2835::MQTT);
+        backend.set_auto(on);
+        backend.pop_autocommit();
+    }
+    else if(t.compare(0, 8, "/switch/")==0 && channel<backend.size() && (on || off || p=="TOGGLE")) {
+        backend.push_autocommit(false, BCM2835::MQTT);
+        backend.init();
+        backend.switch_channel(channel, p=="TOGGLE" ? !backend.get_channel(channel) : on);
+        backend.close();
+        backend.pop_autocommit();
+    }
+    else if(t.compare(0, 5, "/pwm/")==0 && channel<backend.pwm_size() && payload.find_first_not_of("0123456789")==std::string::npos && payload!="") {
+        backend.push_autocommit(false, BCM2835::MQTT);
+        backend.init();
+        backend.set_pwm(channel, std::min(std::strtoul(payload.c_str(), nullptr, 10), 100ul));
+        backend.close();
+        backend.pop_autocommit();
+    }
+    else {
+        syslog(LOG_WARNING, "ignoring invalid mqtt command %s: %s", topic.c_str(), payload.c_str());
+    }
+}
+
+// called from the thread which changed the backend
+void Mqtt::changed(const BCM2835::change &c) {
+    std::string topic, payload;
+    switch(c.kind) {
+    case BCM2835::change::SWITCH:
+        topic = prefix + "/switch/" + std::to_string(c.channel);
+        payload = c.value ? "ON" : "OFF";
+        break;
+    case BCM2835::change::PWM:
+        topic = prefix + "/pwm/" + std::to_string(c.channel);
+        payload = std::to_string(c.value);
+        break;
+    case BCM2835::change::AUTO:
+        topic = prefix + "/auto";
+        payload = c.value ? "ON" : "OFF";
+        break;
+    }
+    std::lock_guard<std::mutex> lock(pending_mtx);
+    pending[topic] = payload;
+    if(flush_scheduled) return;
+    flush_scheduled = true;
+    io.post([this]() {
+        batch_timer.expires_from_now(boost::posix_time::milliseconds(batch_ms));
+        batch_timer.async_wait([this](const boost::system::error_code &ec) {
+            if(!ec) flush();
+        });
+    });
+}
+
+void Mqtt::flush() {
+    std::map<std::string, std::string> batch;
+    {
+        std::lock_guard<std::mutex> lock(pending_mtx);
+        batch.swap(pending);
+        flush_scheduled = false;
+    }
+    // while disconnected, publish_all() on the next CONNACK covers it
+    if(!connected) return;
+    std::string packets;
+    for(auto &kv: batch) packets += publish_packet(kv.first, kv.second);
+    send(packets);
+}
+
+void Mqtt::publish_all() {
+    std::string packets = publish_packet(prefix + "/status", "online");
+    backend.push_autocommit(false);
+    backend.init();
+    for(unsigned i=0; i<backend.size(); i++) packets += publish_packet(prefix + "/switch/" + std::to_string(i), backend.get_channel(i) ? "ON" : "OFF");
+    for(unsigned i=0; i<backend.pwm_size(); i++) packets += publish_packet(prefix + "/pwm/" + std::to_string(i), std::to_string(backend.get_pwm(i)));
+    packets += publish_packet(prefix + "/auto", backend.get_auto() ? "ON" : "OFF");
+    backend.close();
+    backend.pop_autocommit();
+    send(packets);
+}
+
+std::string Mqtt::publish_packet(const std::string &topic, const std::string &payload) {
+    uint16_t id = next_id();
+    inflight[id] = topic;
+    // QoS 1, retained
+    return mqtt_packet(PUBLISH<<4 | 0x02 | 0x01, mqtt_string(topic) + (char)(id>>8) + (char)(id&0xff) + payload);
+}
+
+uint16_t Mqtt::next_id() {
+    if(++packet_id==0) packet_id = 1;
+    return packet_id;
+}
+
+void Mqtt::ping() {
+    // keepalive 0 turns it off on both sides: no pings, and a quiet
+    // broker is no reason to reconnect
+    if(!keepalive) return;
+    ping_timer.expires_from_now(boost::posix_time::seconds(std::max(keepalive/2, 1u)));
+    ping_timer.async_wait([this](const boost::system::error_code &ec) {
+        if(ec) return;
+        if(std::time(nullptr)-last_rx > (time_t)(keepalive*3/2)) {
+            disconnected("broker silent for too long");
+            return;
+        }
+        if(inflight.size()>1000) syslog(LOG_WARNING, "mqtt broker did not acknowledge %zu publishes", inflight.size());
+        send(mqtt_packet(PINGREQ<<4, ""));
+        ping();
+    });
+}
+
+void Mqtt::send(const std::string &packet) {
+    tx.push_back(std::make_shared<std::string>(packet));
+    if(!writing) write_next();
+}
+
+void Mqtt::write_next() {
+    if(tx.empty()) {
+        writing = false;
+        return;
+    }
+    writing = true;
+    unsigned gen = generation;
+    auto buf = tx.front();
+    boost::asio::async_write(socket, boost::asio::buffer(*buf), [this, gen, buf](const boost::system::error_code &ec, std::size_t len) {
+        (void)len;
+        if(gen!=generation) return;
+        if(ec) {
+            disconnected("write: " + ec.message());
+            return;
+        }
+        tx.pop_front();
+        write_next();
+    });
+}
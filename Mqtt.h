@@ -0,0 +1,82 @@
+#ifndef LIGHTSRV_MQTT_H
+#define LIGHTSRV_MQTT_H
+
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include <boost/asio/deadline_timer.hpp>
+#include <boost/asio/io_service.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/noncopyable.hpp>
+
+#include "BCM2835.h"
+
+// MQTT 3.1.1 bridge on the server's io_service, plain TCP to a (local)
+// broker. every state change is published retained with QoS 1:
+//
+//   <prefix>/switch/<n>    ON|OFF
+//   <prefix>/pwm/<n>       0..100
+//   <prefix>/auto          ON|OFF
+//   <prefix>/status        online|offline (last will)
+//
+// and the same topics with /set appended are commands, switches also take
+// TOGGLE. changes within batch_ms are coalesced, only the latest value of a
+// topic is sent, all in one write. after a reconnect the whole state is
+// published again, so unacknowledged publishes are not kept.
+
+class Mqtt : boost::noncopyable {
+public:
+    Mqtt(boost::asio::io_service &io, BCM2835 &backend, const std::string &prefix, unsigned keepalive, unsigned batch_ms);
+    // broker as host[:port]
+    int configure(const std::string &broker, const std::string &client_id, const std::string &user, const std::string &password, std::string &err);
+    void start();
+private:
+    void connect();
+    void disconnected(const std::string &why);
+    void on_read(const boost::system::error_code &ec, std::size_t len);
+    void handle(uint8_t type, uint8_t flags, const std::string &body);
+    void command(const std::string &topic, const std::string &payload);
+    void changed(const BCM2835::change &c);
+    void publish_all();
+    void flush();
+    void ping();
+    void send(const std::string &packet);
+    void write_next();
+    std::string publish_packet(const std::string &topic, const std::string &payload);
+    uint16_t next_id();
+    boost::asio::io_service &io;
+    BCM2835 &backend;
+    std::string prefix;
+    unsigned keepalive;
+    unsigned batch_ms;
+    std::string host;
+    std::string port;
+    std::string client_id;
+    std::string user;
+    std::string password;
+    boost::asio::ip::tcp::resolver resolver;
+    boost::asio::ip::tcp::socket socket;
+    boost::asio::deadline_timer retry_timer;
+    boost::asio::deadline_timer ping_timer;
+    boost::asio::deadline_timer batch_timer;
+    bool connected;     // CONNACK received
+    unsigned generation;
+    unsigned backoff;
+    time_t last_rx;
+    uint16_t packet_id;
+    std::map<uint16_t, std::string> inflight;   // packet id, topic
+    char rx_buf[4096];
+    std::string rx;
+    std::deque<std::shared_ptr<std::string>> tx;
+    bool writing;
+    // topic, payload; filled from any thread changing the backend
+    std::mutex pending_mtx;
+    std::map<std::string, std::string> pending;
+    bool flush_scheduled;
+};
+
+#endif
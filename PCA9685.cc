@@ -0,0 +1,191 @@
+#include <syslog.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#include <linux/i2c.h>
+#include <linux/i2c-dev.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+
+#include "PCA9685.h"
+
+enum {
+    MODE1 = 0x00, MODE2 = 0x01, LED0_ON_L = 0x06, PRE_SCALE = 0xfe
+};
+enum {
+    MODE1_AI = 0x20, MODE1_SLEEP = 0x10, MODE2_OUTDRV = 0x04, LED_FULL = 0x10
+};
+static const double oscillator_hz = 25e6;
+
+const unsigned PCA9685::max_channels;
+const unsigned PCA9685::full;
+
+namespace {
+
+class i2c_dev_bus : public PCA9685::bus {
+public:
+    i2c_dev_bus(int fd, bool plain_i2c): fd(fd), plain_i2c(plain_i2c) {}
+    ~i2c_dev_bus() { ::close(fd); }
+    int write(uint8_t reg, const uint8_t *data, std::size_t len, std::string &err) override;
+private:
+    int fd;
+    bool plain_i2c;
+};
+
+int i2c_dev_bus::write(uint8_t reg, const uint8_t *data, std::size_t len, std::string &err) {
+    if(plain_i2c) {
+        uint8_t buf[1+4*PCA9685::max_channels];
+        if(len>=sizeof(buf)) {
+            err = "i2c write too long";
+            return 1;
+        }
+        buf[0] = reg;
+        std::memcpy(buf+1, data, len);
+        if(::write(fd, buf, len+1)!=(ssize_t)(len+1)) {
+            err = std::string("i2c write failed: ") + strerror(errno);
+            return 1;
+        }
+        return 0;
+    }
+    // smbus only: the chip auto-increments, the chunks land back to back
+    for(std::size_t done=0; done<len; done+=I2C_SMBUS_BLOCK_MAX) {
+        i2c_smbus_data block;
+        std::size_t n = std::min<std::size_t>(len-done, I2C_SMBUS_BLOCK_MAX);
+        block.block[0] = n;
+        std::memcpy(block.block+1, data+done, n);
+        i2c_smbus_ioctl_data args { I2C_SMBUS_WRITE, (uint8_t)(reg+done), I2C_SMBUS_I2C_BLOCK_DATA, &block };
+        if(ioctl(fd, I2C_SMBUS, &args)<0) {
+            err = std::string("i2c block write failed: ") + strerror(errno);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+class mock_bus : public PCA9685::bus {
+public:
+    mock_bus() { std::fill(std::begin(regs), std::end(regs), 0); }
+    int write(uint8_t reg, const uint8_t *data, std::size_t len, std::string &) override {
+        for(std::size_t i=0; i<len; i++) regs[(reg+i)&0xff] = data[i];
+        return 0;
+    }
+private:
+    uint8_t regs[256];
+};
+
+}
+
+std::unique_ptr<PCA9685::bus> PCA9685::i2c_dev(const std::string &device, unsigned address, std::string &err) {
+    int fd = ::open(device.c_str(), O_RDWR|O_CLOEXEC);
+    if(fd<0) {
+        err = "cannot open " + device + ": " + strerror(errno);
+        return nullptr;
+    }
+    unsigned long funcs = 0;
+    if(ioctl(fd, I2C_FUNCS, &funcs)<0 || ioctl(fd, I2C_SLAVE, (unsigned long)address)<0) {
+        char addr[8];
+        snprintf(addr, sizeof(addr), "0x%02x", address);
+        err = "cannot address " + std::string(addr) + " on " + device + ": " + strerror(errno);
+        ::close(fd);
+        return nullptr;
+    }
+    bool plain_i2c = funcs&I2C_FUNC_I2C;
+    if(!plain_i2c && !(funcs&I2C_FUNC_SMBUS_WRITE_I2C_BLOCK)) {
+        err = device + " supports neither plain i2c nor i2c block writes";
+        ::close(fd);
+        return nullptr;
+    }
+    if(!plain_i2c) syslog(LOG_INFO, "%s only speaks smbus, pwm updates go out in 32 byte blocks", device.c_str());
+    return std::unique_ptr<bus>(new i2c_dev_bus(fd, plain_i2c));
+}
+
+std::unique_ptr<PCA9685::bus> PCA9685::mock() {
+    return std::unique_ptr<bus>(new mock_bus());
+}
+
+PCA9685::PCA9685(std::unique_ptr<bus> b, unsigned channels, unsigned frequency):
+    b(std::move(b)), channels(std::min(channels, max_channels)), frequency(frequency), synced(false), transactions(0), bytes(0), skipped(0), errors(0)
+{
+    staged.fill(0);
+    shadow.fill(0);
+    for(unsigned c=0; c<max_channels; c++) set(c, 0);
+}
+
+int PCA9685::init(std::string &err) {
+    double f = std::max(24u, std::min(frequency, 1526u));
+    uint8_t prescale = std::max(3l, std::min(std::lround(oscillator_hz/(4096*f))-1, 255l));
+    // the prescaler only takes writes while the oscillator sleeps
+    const uint8_t sleep = MODE1_SLEEP|MODE1_AI, wake = MODE1_AI, mode2 = MODE2_OUTDRV;
+    synced = false;
+    if(b->write(MODE1, &sleep, 1, err) || b->write(PRE_SCALE, &prescale, 1, err) || b->write(MODE2, &mode2, 1, err) || b->write(MODE1, &wake, 1, err)) {
+        errors++;
+        return 1;
+    }
+    transactions += 4;
+    bytes += 8;
+    // oscillator start up
+    usleep(500);
+    syslog(LOG_INFO, "pca9685: %u channels at %.0f Hz (prescale %u)", channels, oscillator_hz/(4096*(prescale+1)), prescale);
+    return 0;
+}
+
+void PCA9685::set(unsigned channel, unsigned duty) {
+    if(channel>=max_channels) return;
+    uint16_t on = 0, off = duty;
+    if(duty>=full) {
+        on = LED_FULL<<8;
+        off = 0;
+    }
+    else if(duty==0) off = LED_FULL<<8;
+    uint8_t *r = &staged[4*channel];
+    r[0] = on&0xff;
+    r[1] = on>>8;
+    r[2] = off&0xff;
+    r[3] = off>>8;
+}
+
+unsigned PCA9685::get(unsigned channel) const {
+    if(channel>=max_channels) return 0;
+    const uint8_t *r = &staged[4*channel];
+    if(r[1]&LED_FULL) return full;
+    if(r[3]&LED_FULL) return 0;
+    return (r[3]&0x0f)<<8 | r[2];
+}
+
+int PCA9685::flush(std::string &err) {
+    std::size_t first = 0, last = 4*channels;
+    if(synced) {
+        while(first<last && staged[first]==shadow[first]) first++;
+        while(last>first && staged[last-1]==shadow[last-1]) last--;
+    }
+    if(first==last) {
+        skipped++;
+        return 0;
+    }
+    if(b->write(LED0_ON_L+first, &staged[first], last-first, err)) {
+        // the shadow stays, the next flush tries again
+        errors++;
+        return 1;
+    }
+    std::copy(staged.begin()+first, staged.begin()+last, shadow.begin()+first);
+    synced = true;
+    transactions++;
+    bytes += 1+last-first;
+    return 0;
+}
+
+json11::Json PCA9685::to_json() const {
+    return json11::Json::object {
+        { "channels", (int)channels },
+        { "frequency", (int)frequency },
+        { "transactions", (double)transactions.load() },
+        { "bytes", (double)bytes.load() },
+        { "skipped", (double)skipped.load() },
+        { "errors", (double)errors.load() }
+    };
+}
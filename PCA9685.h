@@ -0,0 +1,65 @@
+#ifndef LIGHTSRV_PCA9685_H
+#define LIGHTSRV_PCA9685_H
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include <boost/noncopyable.hpp>
+
+#include "json11.git/json11.hpp"
+
+// NXP PCA9685, 16 channel 12 bit pwm expander on i2c, for more dimmable
+// channels than the SoC's two.
+//
+// set() only stages a duty cycle in a copy of the led registers, flush()
+// compares that to a shadow of what the chip has and writes the span
+// between the first and the last changed register in one auto-increment
+// burst, or nothing if nothing changed. the backend flushes when a
+// transaction ends, so a crossfade step or a scene costs one bus
+// transaction however many channels it touches. MODE2 has the outputs
+// change on the STOP of that transaction, so they all change together.
+//
+// not thread safe, the backend calls it under its lock.
+
+class PCA9685 : boost::noncopyable {
+public:
+    // the transport: one write transaction is the register, then the data
+    // for it and the ones following
+    class bus {
+    public:
+        virtual ~bus() {}
+        virtual int write(uint8_t reg, const uint8_t *data, std::size_t len, std::string &err) = 0;
+    };
+    // /dev/i2c-N via i2c-dev. adapters that only speak SMBus, like the
+    // i2c-stub module, get the burst in 32 byte i2c block writes
+    static std::unique_ptr<bus> i2c_dev(const std::string &device, unsigned address, std::string &err);
+    // keeps a register image instead, for --mockup
+    static std::unique_ptr<bus> mock();
+    static const unsigned max_channels = 16;
+    static const unsigned full = 4096;      // duty cycles are 0..full
+    PCA9685(std::unique_ptr<bus> b, unsigned channels, unsigned frequency);
+    // oscillator, prescaler and output mode; the outputs stay off
+    int init(std::string &err);
+    unsigned size() const { return channels; }
+    void set(unsigned channel, unsigned duty);
+    unsigned get(unsigned channel) const;
+    int flush(std::string &err);
+    json11::Json to_json() const;
+private:
+    typedef std::array<uint8_t, 4*max_channels> registers;
+    std::unique_ptr<bus> b;
+    unsigned channels;
+    unsigned frequency;
+    registers staged;
+    registers shadow;
+    bool synced;            // shadow is what the chip has
+    std::atomic<unsigned long> transactions;
+    std::atomic<unsigned long> bytes;
+    std::atomic<unsigned long> skipped;
+    std::atomic<unsigned long> errors;
+};
+
+#endif
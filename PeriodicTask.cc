@@ -24,6 +24,9 @@ PeriodicTask::PeriodicTask(boost::asio::io_service& ioService
     , name(name)
     , interval(interval)
     , start_imm(start_imm)
+    , last_run_at(0)
+    , last_lateness_us(0)
+    , worst_lateness_us(0)
 
 {
     syslog(LOG_INFO, "Create PeriodicTask '%s'", name.c_str());
@@ -36,6 +39,10 @@ void PeriodicTask::execute(boost::system::error_code const& e)
     if (e != boost::asio::error::operation_aborted) {
         syslog(LOG_INFO, "Execute PeriodicTask '%s'", name.c_str());
 
+        int64_t late = (boost::asio::deadline_timer::traits_type::now() - timer.expires_at()).total_microseconds();
+        last_lateness_us = late;
+        if(late>worst_lateness_us) worst_lateness_us = late;
+        last_run_at = std::time(nullptr);
         task();
 
         timer.expires_at(timer.expires_at() + boost::posix_time::seconds(interval));
@@ -48,7 +55,10 @@ void PeriodicTask::start()
     syslog(LOG_INFO, "Start PeriodicTask '%s'", name.c_str());
 
     // Uncomment if you want to call the handler on startup (i.e. at time 0)
-    if(start_imm) task();
+    if(start_imm) {
+        last_run_at = std::time(nullptr);
+        task();
+    }
 
     #if 1
     boost::posix_time::ptime now = boost::posix_time::second_clock::local_time();
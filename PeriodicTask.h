@@ -1,6 +1,10 @@
 #ifndef LIGHTSRV_PERIODICTASK_H
 #define LIGHTSRV_PERIODICTASK_H
 
+#include <atomic>
+#include <cstdint>
+#include <ctime>
+
 #include <boost/noncopyable.hpp>
 
 void log_text(std::string const& text);
@@ -12,6 +16,12 @@ public:
     PeriodicTask(boost::asio::io_service& ioService, std::string const& name, int interval, handler_fn task, bool start_imm);
     void execute(boost::system::error_code const& e);
     void start();
+    int get_interval() const { return interval; }
+    // of the last run, 0 before the first
+    time_t last_run() const { return last_run_at; }
+    // how much later than scheduled the last run started, and the worst one
+    int64_t lateness_us() const { return last_lateness_us; }
+    int64_t max_lateness_us() const { return worst_lateness_us; }
 private:
     void start_wait();
 private:
@@ -21,6 +31,9 @@ private:
     std::string name;
     int interval;
     bool start_imm;
+    std::atomic<time_t> last_run_at;
+    std::atomic<int64_t> last_lateness_us;
+    std::atomic<int64_t> worst_lateness_us;
 };
 
 #endif
@@ -0,0 +1,146 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <functional>
+
+#include "RateLimiter.h"
+
+// probed slots per client, and how long a slot has to be unused before
+// another client may take it over
+static const unsigned probes = 8;
+static const uint32_t idle_ms = 60000;
+static const unsigned none = ~0u;
+
+RateLimiter::RateLimiter(unsigned slots, limits read, limits write, unsigned max_streams, unsigned client_streams):
+    on(read.rate>0 || write.rate>0 || max_streams>0 || client_streams>0), max_streams(max_streams), client_streams(client_streams),
+    streams(0), admitted(0), rate_limited(0), stream_limited(0), overflowed(0)
+{
+    unsigned n = 16;
+    while(n<slots) n *= 2;
+    mask = n-1;
+    lim[READ] = read;
+    lim[WRITE] = write;
+    for(auto &l: lim) l.burst = std::max(l.burst, 1.0);
+    table.reset(new entry[n+1]());
+    uint32_t now = now_ms();
+    for(unsigned i=0; i<=n; i++) {
+        table[i].key.store(0);
+        table[i].streams.store(0);
+        reset(table[i], now);
+    }
+}
+
+uint32_t RateLimiter::now_ms() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void RateLimiter::reset(entry &e, uint32_t now_ms) {
+    for(unsigned k=READ; k<=WRITE; k++) e.bucket[k].store(uint64_t(lim[k].burst*1000)<<32 | now_ms, std::memory_order_relaxed);
+    e.seen_ms.store(now_ms, std::memory_order_relaxed);
+}
+
+unsigned RateLimiter::find(uint64_t key, uint32_t now_ms) {
+    for(unsigned i=0; i<probes; i++) {
+        unsigned idx = (key+i)&mask;
+        uint64_t k = table[idx].key.load(std::memory_order_acquire);
+        if(k==key) return idx;
+        if(k==0) {
+            if(table[idx].key.compare_exchange_strong(k, key)) {
+                reset(table[idx], now_ms);
+                return idx;
+            }
+            if(k==key) return idx;
+        }
+    }
+    // all taken: the longest idle slot without streams goes to this client
+    unsigned victim = none;
+    uint32_t victim_idle = 0;
+    for(unsigned i=0; i<probes; i++) {
+        unsigned idx = (key+i)&mask;
+        uint32_t idle = now_ms-table[idx].seen_ms.load(std::memory_order_relaxed);
+        if(table[idx].streams.load(std::memory_order_relaxed)==0 && idle>=idle_ms && idle>=victim_idle) {
+            victim = idx;
+            victim_idle = idle;
+        }
+    }
+    if(victim!=none) {
+        uint64_t k = table[victim].key.load(std::memory_order_relaxed);
+        if(table[victim].key.compare_exchange_strong(k, key)) {
+            reset(table[victim], now_ms);
+            return victim;
+        }
+    }
+    overflowed++;
+    return mask+1;
+}
+
+bool RateLimiter::take(std::atomic<uint64_t> &bucket, const limits &l, uint32_t now_ms, unsigned &retry_after) {
+    if(l.rate<=0) return true;
+    uint64_t cap = uint64_t(l.burst*1000);
+    uint64_t old = bucket.load(std::memory_order_relaxed);
+    for(;;) {
+        uint32_t elapsed = now_ms-(uint32_t)old;
+        // another thread already refilled up to a later now
+        if(elapsed>0x80000000u) elapsed = 0;
+        // rate tokens per second are rate milli tokens per millisecond
+        uint64_t tokens = std::min(cap, (old>>32)+uint64_t(elapsed*l.rate));
+        if(tokens<1000) {
+            retry_after = std::max(1.0, std::ceil((1000-tokens)/l.rate/1000));
+            return false;
+        }
+        if(bucket.compare_exchange_weak(old, (tokens-1000)<<32 | now_ms, std::memory_order_relaxed)) return true;
+    }
+}
+
+RateLimiter::verdict RateLimiter::admit(const std::string &client, kind_t kind, unsigned &slot, unsigned &retry_after) {
+    slot = none;
+    if(!on) return OK;
+    uint32_t now = now_ms();
+    uint64_t key = std::hash<std::string>()(client);
+    if(key==0) key = 1;
+    unsigned idx = find(key, now);
+    entry &e = table[idx];
+    e.seen_ms.store(now, std::memory_order_relaxed);
+
+    // streams are checked first, they are given back, tokens are not
+    unsigned global_limit = kind==WRITE ? max_streams : max_streams-max_streams/4;
+    unsigned global = streams.fetch_add(1);
+    unsigned own = e.streams.fetch_add(1);
+    if((max_streams && global>=global_limit) || (client_streams && idx<=mask && own>=client_streams)) {
+        e.streams--;
+        streams--;
+        stream_limited++;
+        retry_after = 1;
+        return TOO_MANY_STREAMS;
+    }
+    if(!take(e.bucket[kind], lim[kind], now, retry_after)) {
+        e.streams--;
+        streams--;
+        rate_limited++;
+        return RATE_LIMITED;
+    }
+    admitted++;
+    slot = idx;
+    return OK;
+}
+
+void RateLimiter::release(unsigned slot) {
+    if(slot==none) return;
+    table[slot].streams--;
+    streams--;
+}
+
+json11::Json RateLimiter::to_json() const {
+    unsigned clients = 0;
+    for(unsigned i=0; i<=mask; i++) if(table[i].key.load(std::memory_order_relaxed)) clients++;
+    return json11::Json::object {
+        { "enabled", on },
+        { "slots", (int)(mask+1) },
+        { "clients", (int)clients },
+        { "streams", (int)streams.load() },
+        { "admitted", (double)admitted.load() },
+        { "rate_limited", (double)rate_limited.load() },
+        { "stream_limited", (double)stream_limited.load() },
+        { "overflowed", (double)overflowed.load() }
+    };
+}
@@ -0,0 +1,64 @@
+#ifndef LIGHTSRV_RATELIMITER_H
+#define LIGHTSRV_RATELIMITER_H
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include <boost/noncopyable.hpp>
+
+#include "json11.git/json11.hpp"
+
+// admission control in front of the handlers: per client token buckets,
+// separate for reads and writes so polling does not eat the write budget,
+// plus caps on the streams in flight, globally and per client. reads only
+// get 3/4 of the global streams, the rest is kept for writes.
+//
+// the clients live in a fixed table of slots, found by open addressing and
+// updated with atomics only, so admit() never takes a lock and the memory
+// does not grow with the number of clients. when all probed slots are busy,
+// the least recently seen idle one is taken over; with none idle the client
+// shares the overflow slot. clients are approximate in that sense, a lost
+// race costs at most a few tokens.
+
+class RateLimiter : boost::noncopyable {
+public:
+    enum kind_t { READ, WRITE };
+    enum verdict { OK, RATE_LIMITED, TOO_MANY_STREAMS };
+    struct limits {
+        double rate;    // requests per second, 0 is unlimited
+        double burst;
+    };
+    RateLimiter(unsigned slots, limits read, limits write, unsigned max_streams, unsigned client_streams);
+    bool enabled() const { return on; }
+    // on OK, release(slot) has to be called once the stream is closed.
+    // otherwise retry_after is the number of seconds to wait
+    verdict admit(const std::string &client, kind_t kind, unsigned &slot, unsigned &retry_after);
+    void release(unsigned slot);
+    json11::Json to_json() const;
+private:
+    struct entry {
+        std::atomic<uint64_t> key;          // hash of the client, 0 is free
+        std::atomic<uint64_t> bucket[2];    // per kind: milli tokens << 32 | refill time in ms
+        std::atomic<uint32_t> streams;
+        std::atomic<uint32_t> seen_ms;
+    };
+    unsigned find(uint64_t key, uint32_t now_ms);
+    void reset(entry &e, uint32_t now_ms);
+    bool take(std::atomic<uint64_t> &bucket, const limits &l, uint32_t now_ms, unsigned &retry_after);
+    static uint32_t now_ms();
+    bool on;
+    unsigned mask;
+    limits lim[2];
+    unsigned max_streams;
+    unsigned client_streams;
+    std::unique_ptr<entry[]> table;     // mask+1 slots and the overflow slot
+    std::atomic<unsigned> streams;
+    std::atomic<unsigned long> admitted;
+    std::atomic<unsigned long> rate_limited;
+    std::atomic<unsigned long> stream_limited;
+    std::atomic<unsigned long> overflowed;
+};
+
+#endif
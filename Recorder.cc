@@ -0,0 +1,203 @@
+#include <syslog.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <sstream>
+
+#include "Recorder.h"
+
+static const char magic[] = "LSRT";
+static const unsigned char version = 1;
+static const std::size_t buffer_max = 65536;
+static const std::chrono::seconds flush_interval(10);
+static const char *methods[] = { "GET", "PUT", "POST", "DELETE", "OPTIONS", "HEAD" };
+
+static void put_varint(std::string &out, uint64_t v) {
+    while(v>=0x80) {
+        out += (char)((v&0x7f) | 0x80);
+        v >>= 7;
+    }
+    out += (char)v;
+}
+
+static bool get_varint(const std::string &in, std::size_t &pos, uint64_t &v) {
+    v = 0;
+    for(unsigned shift=0; pos<in.size() && shift<64; shift+=7) {
+        unsigned char c = in[pos++];
+        v |= uint64_t(c&0x7f)<<shift;
+        if(!(c&0x80)) return true;
+    }
+    return false;
+}
+
+static void put_string(std::string &out, const std::string &s) {
+    put_varint(out, s.size());
+    out += s;
+}
+
+static bool get_string(const std::string &in, std::size_t &pos, std::string &s) {
+    uint64_t len;
+    if(!get_varint(in, pos, len) || len>in.size()-pos) return false;
+    s = in.substr(pos, len);
+    pos += len;
+    return true;
+}
+
+Recorder::Recorder(): fd(-1), max_bytes(0), stop(false), written(0), recorded(0), dropped(0) {
+}
+
+Recorder::~Recorder() {
+    if(fd<0) return;
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        stop = true;
+    }
+    cv.notify_one();
+    if(thread.joinable()) thread.join();
+    ::close(fd);
+}
+
+int Recorder::open(const std::string &file, uint64_t max_bytes, std::string &err) {
+    fd = ::open(file.c_str(), O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0600);
+    if(fd<0) {
+        err = "cannot open " + file + ": " + strerror(errno);
+        return 1;
+    }
+    this->max_bytes = max_bytes;
+    start = std::chrono::steady_clock::now();
+    std::string header(magic, 4);
+    header += (char)version;
+    put_varint(header, std::time(nullptr));
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        buf = header;
+    }
+    thread = std::thread([this](){ run(); });
+    syslog(LOG_INFO, "recording requests to %s", file.c_str());
+    return 0;
+}
+
+Recorder::ptr Recorder::begin(const std::string &method, const std::string &path) {
+    if(fd<0) return nullptr;
+    if(max_bytes && written>=max_bytes) {
+        dropped++;
+        return nullptr;
+    }
+    uint64_t offset = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now()-start).count();
+    return ptr(new entry { offset, method, path, "" }, [this](entry *e) {
+        write(*e);
+        delete e;
+    });
+}
+
+Recorder::ptr &Recorder::current() {
+    static thread_local ptr e;
+    return e;
+}
+
+void Recorder::write(const entry &e) {
+    std::string rec;
+    put_varint(rec, e.offset_us);
+    auto m = std::find(std::begin(methods), std::end(methods), e.method);
+    if(m!=std::end(methods)) rec += (char)(m-std::begin(methods));
+    else {
+        rec += (char)0xff;
+        put_string(rec, e.method);
+    }
+    put_string(rec, e.path);
+    put_string(rec, e.body);
+    bool full;
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        buf += rec;
+        full = buf.size()>=buffer_max;
+    }
+    recorded++;
+    if(full) cv.notify_one();
+}
+
+void Recorder::run() {
+    std::unique_lock<std::mutex> lock(mtx);
+    for(;;) {
+        cv.wait_for(lock, flush_interval, [this](){ return stop || buf.size()>=buffer_max; });
+        bool last = stop;
+        std::string out;
+        out.swap(buf);
+        lock.unlock();
+        write_out(out);
+        lock.lock();
+        // the requests that came in meanwhile are in buf, once more
+        if(last && buf.empty()) return;
+    }
+}
+
+void Recorder::write_out(const std::string &out) {
+    std::size_t done = 0;
+    while(done<out.size()) {
+        ssize_t n = ::write(fd, out.data()+done, out.size()-done);
+        if(n<0 && errno==EINTR) continue;
+        if(n<=0) {
+            syslog(LOG_ERR, "cannot write the request recording: %s", strerror(errno));
+            break;
+        }
+        done += n;
+    }
+    uint64_t total = written += done;
+    if(max_bytes && total>=max_bytes && total-done<max_bytes) syslog(LOG_NOTICE, "request recording reached %llu bytes, stopped", (unsigned long long)max_bytes);
+}
+
+json11::Json Recorder::to_json() const {
+    return json11::Json::object {
+        { "enabled", fd>=0 },
+        { "recorded", (double)recorded.load() },
+        { "dropped", (double)dropped.load() },
+        { "written_bytes", (double)written.load() },
+        { "max_bytes", (double)max_bytes }
+    };
+}
+
+int Recorder::load(const std::string &file, time_t &start, std::vector<entry> &entries, std::string &err) {
+    std::ifstream f(file, std::ios::binary);
+    if(!f) {
+        err = "cannot open " + file;
+        return 1;
+    }
+    std::stringstream ss;
+    ss << f.rdbuf();
+    std::string in = ss.str();
+    if(in.size()<5 || in.compare(0, 4, magic) || (unsigned char)in[4]!=version) {
+        err = file + " is no lightsrv request recording";
+        return 1;
+    }
+    std::size_t pos = 5;
+    uint64_t v;
+    if(!get_varint(in, pos, v)) {
+        err = file + " is truncated";
+        return 1;
+    }
+    start = v;
+    entries.clear();
+    while(pos<in.size()) {
+        entry e;
+        bool ok = get_varint(in, pos, e.offset_us) && pos<in.size();
+        if(ok) {
+            unsigned char m = in[pos++];
+            if(m<sizeof(methods)/sizeof(methods[0])) e.method = methods[m];
+            else ok = m==0xff && get_string(in, pos, e.method);
+        }
+        ok = ok && get_string(in, pos, e.path) && get_string(in, pos, e.body);
+        if(!ok) {
+            // a recording cut off by a crash, keep what is complete
+            syslog(LOG_WARNING, "%s is truncated after %zu requests", file.c_str(), entries.size());
+            break;
+        }
+        entries.push_back(std::move(e));
+    }
+    std::stable_sort(entries.begin(), entries.end(), [](const entry &a, const entry &b) { return a.offset_us<b.offset_us; });
+    return 0;
+}
@@ -0,0 +1,74 @@
+#ifndef LIGHTSRV_RECORDER_H
+#define LIGHTSRV_RECORDER_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <boost/noncopyable.hpp>
+
+#include "json11.git/json11.hpp"
+
+// captures the requests the server gets, method, path with query, body and
+// arrival time, into a compact file for lightsrv-replay. no headers, so no
+// credentials end up in it.
+//
+// a request is written once its entry is released, i.e. after its body
+// arrived; entries carry their arrival offset, so the file is only roughly
+// in order and the reader sorts it. requests go to a buffer under a short
+// lock, a writer thread of its own takes the buffer to disk when it got
+// large and every few seconds; no server thread touches the file.
+//
+// file: "LSRT", version byte, varint start (unix seconds), then per
+// request varint offset (us), method byte (0xff: varint length and name
+// follow), varint length and path, varint length and body.
+
+class Recorder : boost::noncopyable {
+public:
+    struct entry {
+        uint64_t offset_us;     // since the start of the recording
+        std::string method;
+        std::string path;
+        std::string body;
+    };
+    typedef std::shared_ptr<entry> ptr;
+    Recorder();
+    ~Recorder();
+    // stops recording after max_bytes, 0 is unlimited
+    int open(const std::string &file, uint64_t max_bytes, std::string &err);
+    bool enabled() const { return fd>=0; }
+    // nullptr unless enabled
+    ptr begin(const std::string &method, const std::string &path);
+    // the entry of the request the calling thread is in, set around the
+    // handler by the server so body readers can find it
+    static ptr &current();
+    static void body(const ptr &e, const std::string &b) {
+        if(e) e->body = b;
+    }
+    json11::Json to_json() const;
+    // the whole file, sorted by offset
+    static int load(const std::string &file, time_t &start, std::vector<entry> &entries, std::string &err);
+private:
+    void write(const entry &e);
+    void run();
+    void write_out(const std::string &out);
+    int fd;
+    uint64_t max_bytes;
+    std::chrono::steady_clock::time_point start;
+    std::mutex mtx;
+    std::string buf;
+    std::condition_variable cv;
+    bool stop;
+    std::thread thread;
+    std::atomic<uint64_t> written;
+    std::atomic<unsigned long> recorded;
+    std::atomic<unsigned long> dropped;
+};
+
+#endif
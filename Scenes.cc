@@ -0,0 +1,245 @@
+#include <syslog.h>
+
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+
+#include <boost/bind.hpp>
+#include <boost/asio/placeholders.hpp>
+
+#include "Scenes.h"
+
+Scenes::Scenes(boost::asio::io_service &io, BCM2835 &backend, unsigned fade_step_ms):
+    io(io), backend(backend), timer(io), fade_step_ms(fade_step_ms), fade_duration(0)
+{
+}
+
+int Scenes::set_groups(const json11::Json &g, std::string &err) {
+    if(!g.is_object()) {
+        err = "groups must be an object of channel arrays";
+        return 1;
+    }
+    std::map<std::string, group> parsed;
+    for(auto &kv: g.object_items()) {
+        group gr { {}, 0, {}, {} };
+        for(auto &c: kv.second.array_items()) {
+            if(!c.is_number() || c.int_value()<0 || (unsigned)c.int_value()>=backend.size() || c.int_value()>=64) {
+                err = "group " + kv.first + ": invalid switch channel " + c.dump();
+                return 1;
+            }
+            gr.channels.push_back(c.int_value());
+            gr.mask |= uint64_t(1)<<c.int_value();
+        }
+        gr.on = backend.compile(gr.mask, gr.mask, {});
+        gr.off = backend.compile(gr.mask, 0, {});
+        parsed[kv.first] = gr;
+    }
+    groups.swap(parsed);
+    // scenes may refer to the groups, so recompile them
+    for(auto &s: scenes) {
+        if(compile(s.second.def, s.second, err)) {
+            syslog(LOG_ERR, "scene %s does not compile with the new groups: %s", s.first.c_str(), err.c_str());
+        }
+    }
+    err.clear();
+    return 0;
+}
+
+int Scenes::compile(const json11::Json &def, scene_t &s, std::string &err) const {
+    if(!def.is_object()) {
+        err = "scene definition must be an object";
+        return 1;
+    }
+    uint64_t mask = 0, values = 0;
+    for(auto &kv: def["groups"].object_items()) {
+        auto g = groups.find(kv.first);
+        if(g==groups.end()) {
+            err = "unknown group " + kv.first;
+            return 1;
+        }
+        mask |= g->second.mask;
+        if(kv.second.bool_value()) values |= g->second.mask;
+        else values &= ~g->second.mask;
+    }
+    // single switches take precedence over groups
+    for(auto &kv: def["switches"].object_items()) {
+        char *end;
+        unsigned long channel = std::strtoul(kv.first.c_str(), &end, 10);
+        if(*end!='\0' || channel>=backend.size() || channel>=64) {
+            err = "invalid switch channel " + kv.first;
+            return 1;
+        }
+        uint64_t bit = uint64_t(1)<<channel;
+        mask |= bit;
+        if(kv.second.bool_value()) values |= bit;
+        else values &= ~bit;
+    }
+    std::vector<std::pair<unsigned, unsigned>> pwms;
+    for(auto &kv: def["pwms"].object_items()) {
+        char *end;
+        unsigned long channel = std::strtoul(kv.first.c_str(), &end, 10);
+        if(*end!='\0' || channel>=backend.pwm_size()) {
+            err = "invalid pwm channel " + kv.first;
+            return 1;
+        }
+        if(!kv.second.is_number() || kv.second.int_value()<0 || kv.second.int_value()>100) {
+            err = "invalid pwm value for channel " + kv.first;
+            return 1;
+        }
+        pwms.push_back(std::make_pair((unsigned)channel, (unsigned)kv.second.int_value()));
+    }
+    s.def = def;
+    s.fade = def["fade"].number_value();
+    s.all = backend.compile(mask, values, pwms);
+    s.switches = backend.compile(mask, values, {});
+    return 0;
+}
+
+int Scenes::define(const std::string &name, const json11::Json &def, std::string &err) {
+    scene_t s;
+    if(compile(def, s, err)) return 1;
+    scenes[name] = s;
+    syslog(LOG_INFO, "defined scene %s: %s", name.c_str(), def.dump().c_str());
+    return 0;
+}
+
+void Scenes::transaction(const BCM2835::transition &t) {
+    backend.push_autocommit(false, BCM2835::SCENE);
+    backend.init();
+    backend.apply(t);
+    backend.close();
+    backend.pop_autocommit();
+}
+
+int Scenes::activate(const std::string &name, double fade, std::string &err) {
+    auto s = scenes.find(name);
+    if(s==scenes.end()) {
+        err = "unknown scene " + name;
+        return 1;
+    }
+    if(fade<0) fade = s->second.fade;
+    syslog(LOG_INFO, "activating scene %s, fade %f s", name.c_str(), fade);
+    // a new activation supersedes a running fade
+    timer.cancel();
+    fade_to.clear();
+    if(fade>0 && !s->second.all.pwms.empty()) {
+        transaction(s->second.switches);
+        start_fade(s->second.all.pwms, fade);
+    }
+    else {
+        transaction(s->second.all);
+    }
+    return 0;
+}
+
+int Scenes::switch_group(const std::string &name, bool on, std::string &err) {
+    auto g = groups.find(name);
+    if(g==groups.end()) {
+        err = "unknown group " + name;
+        return 1;
+    }
+    syslog(LOG_INFO, "switching group %s %s", name.c_str(), on ? "on" : "off");
+    transaction(on ? g->second.on : g->second.off);
+    return 0;
+}
+
+bool Scenes::has_group(const std::string &name) const {
+    return groups.count(name)>0;
+}
+
+std::vector<int> Scenes::group_state(const std::string &name) {
+    std::vector<int> state;
+    auto g = groups.find(name);
+    if(g==groups.end()) return state;
+    backend.push_autocommit(false);
+    backend.init();
+    for(auto c: g->second.channels) state.push_back(backend.get_channel(c));
+    backend.close();
+    backend.pop_autocommit();
+    return state;
+}
+
+bool Scenes::has_scene(const std::string &name) const {
+    return scenes.count(name)>0;
+}
+
+json11::Json Scenes::scene(const std::string &name) const {
+    auto s = scenes.find(name);
+    if(s==scenes.end()) return json11::Json();
+    return s->second.def;
+}
+
+json11::Json Scenes::to_json() const {
+    json11::Json::object g;
+    for(auto &kv: groups) {
+        json11::Json::array channels;
+        for(auto c: kv.second.channels) channels.push_back((int)c);
+        g[kv.first] = channels;
+    }
+    json11::Json::object s;
+    for(auto &kv: scenes) s[kv.first] = kv.second.def;
+    return json11::Json::object {
+        { "groups", g },
+        { "scenes", s }
+    };
+}
+
+int Scenes::load(const std::string &file, std::string &err) {
+    std::ifstream t(file);
+    if(!t.good()) {
+        syslog(LOG_INFO, "scene file %s not readable, starting without", file.c_str());
+        return 0;
+    }
+    std::stringstream str;
+    str << t.rdbuf();
+    json11::Json stored = json11::Json::parse(str.str(), err);
+    if(!err.empty()) return 1;
+    if(stored["groups"].is_object() && set_groups(stored["groups"], err)) return 1;
+    for(auto &kv: stored["scenes"].object_items()) {
+        if(define(kv.first, kv.second, err)) return 1;
+    }
+    return 0;
+}
+
+int Scenes::save(const std::string &file) const {
+    std::string tmp = file + ".tmp";
+    std::ofstream t(tmp);
+    t << to_json().dump() << std::endl;
+    t.close();
+    if(!t || std::rename(tmp.c_str(), file.c_str())) {
+        syslog(LOG_ERR, "cannot write scene file %s: %s", file.c_str(), strerror(errno));
+        return 1;
+    }
+    return 0;
+}
+
+void Scenes::start_fade(const std::vector<std::pair<unsigned, unsigned>> &targets, double duration) {
+    fade_from.clear();
+    for(auto &p: targets) fade_from.push_back(std::make_pair(p.first, backend.get_pwm(p.first)));
+    fade_to = targets;
+    fade_duration = duration;
+    fade_start = std::chrono::steady_clock::now();
+    timer.expires_from_now(boost::posix_time::milliseconds(fade_step_ms));
+    timer.async_wait(boost::bind(&Scenes::fade_step, this, boost::asio::placeholders::error));
+}
+
+void Scenes::fade_step(const boost::system::error_code &e) {
+    if(e==boost::asio::error::operation_aborted || fade_to.empty()) return;
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now()-fade_start).count();
+    double f = elapsed>=fade_duration ? 1 : elapsed/fade_duration;
+    std::vector<std::pair<unsigned, unsigned>> step;
+    for(unsigned i=0; i<fade_to.size(); i++) {
+        double from = fade_from[i].second, to = fade_to[i].second;
+        step.push_back(std::make_pair(fade_to[i].first, (unsigned)std::lround(from+(to-from)*f)));
+    }
+    transaction(backend.compile(0, 0, step));
+    if(f>=1) {
+        fade_to.clear();
+        return;
+    }
+    timer.expires_at(timer.expires_at()+boost::posix_time::milliseconds(fade_step_ms));
+    timer.async_wait(boost::bind(&Scenes::fade_step, this, boost::asio::placeholders::error));
+}
@@ -0,0 +1,69 @@
+#ifndef LIGHTSRV_SCENES_H
+#define LIGHTSRV_SCENES_H
+
+#include <chrono>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <boost/asio/io_service.hpp>
+#include <boost/asio/deadline_timer.hpp>
+#include <boost/noncopyable.hpp>
+
+#include "json11.git/json11.hpp"
+
+#include "BCM2835.h"
+
+// named channel groups and scenes, compiled into backend transitions when
+// they are defined so activating one is a single backend transaction.
+//
+// groups:  {"front": [0, 1], "back": [2]}
+// scene:   {"switches": {"3": true}, "groups": {"front": false}, "pwms": {"0": 40}, "fade": 2.5}
+//
+// with a fade, the switches are set at once and the pwms are ramped linearly
+// towards their targets on the io_service, one transaction per step.
+
+class Scenes : boost::noncopyable {
+public:
+    Scenes(boost::asio::io_service &io, BCM2835 &backend, unsigned fade_step_ms);
+    int set_groups(const json11::Json &groups, std::string &err);
+    int define(const std::string &name, const json11::Json &def, std::string &err);
+    // fade<0: use the fade time from the scene definition
+    int activate(const std::string &name, double fade, std::string &err);
+    int switch_group(const std::string &name, bool on, std::string &err);
+    bool has_group(const std::string &name) const;
+    std::vector<int> group_state(const std::string &name);
+    bool has_scene(const std::string &name) const;
+    json11::Json scene(const std::string &name) const;
+    json11::Json to_json() const;
+    int load(const std::string &file, std::string &err);
+    int save(const std::string &file) const;
+private:
+    struct group {
+        std::vector<unsigned> channels;
+        uint64_t mask;
+        BCM2835::transition on, off;
+    };
+    struct scene_t {
+        json11::Json def;
+        double fade;
+        BCM2835::transition all;        // applied as is if not fading
+        BCM2835::transition switches;   // same without the pwms
+    };
+    int compile(const json11::Json &def, scene_t &s, std::string &err) const;
+    void transaction(const BCM2835::transition &t);
+    void start_fade(const std::vector<std::pair<unsigned, unsigned>> &targets, double duration);
+    void fade_step(const boost::system::error_code &e);
+    boost::asio::io_service &io;
+    BCM2835 &backend;
+    boost::asio::deadline_timer timer;
+    unsigned fade_step_ms;
+    std::map<std::string, group> groups;
+    std::map<std::string, scene_t> scenes;
+    // running crossfade, channel -> value
+    std::vector<std::pair<unsigned, unsigned>> fade_from, fade_to;
+    std::chrono::steady_clock::time_point fade_start;
+    double fade_duration;
+};
+
+#endif
@@ -0,0 +1,215 @@
+#include <syslog.h>
+
+#include <algorithm>
+#include <cmath>
+
+#include <boost/algorithm/string.hpp>
+
+#include "Schedule.h"
+
+static const char *event_names[] = { "sunrise", "sunset", "dawn", "dusk", "nautical_dawn", "nautical_dusk", "astronomical_dawn", "astronomical_dusk", "noon" };
+static const char *day_names[] = { "sun", "mon", "tue", "wed", "thu", "fri", "sat" };
+
+Schedule::Schedule(): latitude(0), longitude(0), has_location(false), compiled_day(-1) {
+}
+
+void Schedule::set_location(double lat, double lon) {
+    latitude = lat;
+    longitude = lon;
+    has_location = true;
+    compiled_day = -1;
+}
+
+static int parse_hms(const std::string &s, int &seconds) {
+    std::vector<std::string> tokens;
+    boost::split(tokens, s, boost::is_any_of(":"));
+    if(tokens.size()<2 || tokens.size()>3) return 1;
+    int v[3] = { 0, 0, 0 };
+    for(unsigned i=0; i<tokens.size(); i++) {
+        char *end;
+        v[i] = std::strtol(tokens[i].c_str(), &end, 10);
+        if(tokens[i]=="" || *end!='\0' || v[i]<0) return 1;
+    }
+    seconds = v[0]*3600+v[1]*60+v[2];
+    return seconds>24*3600;
+}
+
+int Schedule::parse_point(const std::string &s, point &p, std::string &err) const {
+    auto sign = s.find_first_of("+-");
+    std::string name = s.substr(0, sign);
+    for(int e=0; e<N_EVENTS; e++) {
+        if(name!=event_names[e]) continue;
+        if(!has_location) {
+            err = "solar event " + name + " needs latitude and longitude";
+            return 1;
+        }
+        p.event = e;
+        p.offset = 0;
+        if(sign!=std::string::npos) {
+            if(parse_hms(s.substr(sign+1), p.offset)) {
+                err = "invalid offset in " + s;
+                return 1;
+            }
+            if(s[sign]=='-') p.offset = -p.offset;
+        }
+        return 0;
+    }
+    p.event = -1;
+    if(parse_hms(s, p.offset)) {
+        err = "invalid time " + s;
+        return 1;
+    }
+    return 0;
+}
+
+int Schedule::add_rule(unsigned channel, const std::string &on, const std::string &off, const std::string &days, const std::string &dates, std::string &err) {
+    rule r;
+    r.channel = channel;
+    if(parse_point(on, r.on, err) || parse_point(off, r.off, err)) return 1;
+
+    r.days = days=="" ? 0x7f : 0;
+    std::vector<std::string> tokens;
+    if(days!="") boost::split(tokens, days, boost::is_any_of(","));
+    for(auto &t: tokens) {
+        std::vector<std::string> range;
+        boost::split(range, t, boost::is_any_of("-"));
+        int d[2] = { -1, -1 };
+        for(unsigned i=0; i<range.size() && i<2; i++) {
+            for(int n=0; n<7; n++) if(boost::iequals(range[i], day_names[n])) d[i] = n;
+        }
+        if(range.size()==1) d[1] = d[0];
+        if(range.size()>2 || d[0]<0 || d[1]<0) {
+            err = "invalid days " + days;
+            return 1;
+        }
+        for(int n=d[0]; ; n=(n+1)%7) {
+            r.days |= 1<<n;
+            if(n==d[1]) break;
+        }
+    }
+
+    r.from_md = r.to_md = 0;
+    if(dates!="") {
+        int fm, fd, tm_, td;
+        if(sscanf(dates.c_str(), "%d-%d..%d-%d", &fm, &fd, &tm_, &td)!=4) {
+            err = "invalid dates " + dates + ", expecting MM-DD..MM-DD";
+            return 1;
+        }
+        r.from_md = fm*100+fd;
+        r.to_md = tm_*100+td;
+    }
+
+    rules.push_back(r);
+    compiled_day = -1;
+    return 0;
+}
+
+bool Schedule::empty() const {
+    return rules.empty();
+}
+
+bool Schedule::matches(const rule &r, const tm &day_tm) const {
+    if(!(r.days&(1<<day_tm.tm_wday))) return false;
+    if(!r.from_md) return true;
+    int md = (day_tm.tm_mon+1)*100+day_tm.tm_mday;
+    if(r.from_md<=r.to_md) return md>=r.from_md && md<=r.to_md;
+    return md>=r.from_md || md<=r.to_md;
+}
+
+// NOAA style sunrise equation, good to about a minute
+bool Schedule::solar_event(const tm &day_tm, event_t e, unsigned &dot) const {
+    static const double zeniths[] = { 90.833, 90.833, 96, 96, 102, 102, 108, 108, 0 };
+    const double rad = M_PI/180;
+    tm noon_tm = day_tm;
+    noon_tm.tm_hour = 12;
+    noon_tm.tm_min = noon_tm.tm_sec = 0;
+    time_t noon_utc = timegm(&noon_tm);
+    double n = std::round(noon_utc/86400.0+2440587.5-2451545.0+0.0008);
+    double jstar = n-longitude/360;
+    double m = std::fmod(357.5291+0.98560028*jstar, 360);
+    double c = 1.9148*std::sin(m*rad)+0.02*std::sin(2*m*rad)+0.0003*std::sin(3*m*rad);
+    double lambda = std::fmod(m+c+180+102.9372, 360);
+    double transit = 2451545+jstar+0.0053*std::sin(m*rad)-0.0069*std::sin(2*lambda*rad);
+    double j = transit;
+    if(e!=NOON) {
+        double sin_d = std::sin(lambda*rad)*std::sin(23.4397*rad);
+        double cos_d = std::cos(std::asin(sin_d));
+        double cos_w = (std::cos(zeniths[e]*rad)-std::sin(latitude*rad)*sin_d)/(std::cos(latitude*rad)*cos_d);
+        if(cos_w<-1 || cos_w>1) return false;
+        double w = std::acos(cos_w)/rad;
+        // even events are the morning ones
+        j += (e%2==0 ? -w : w)/360;
+    }
+    time_t t = std::llround((j-2440587.5)*86400);
+    tm local_tm;
+    localtime_r(&t, &local_tm);
+    dot = local_tm.tm_hour*3600+local_tm.tm_min*60+local_tm.tm_sec;
+    return true;
+}
+
+void Schedule::solar_events(const tm &day_tm, unsigned *events, bool *valid) const {
+    for(int e=0; e<N_EVENTS; e++) {
+        valid[e] = has_location && solar_event(day_tm, (event_t)e, events[e]);
+    }
+}
+
+bool Schedule::resolve(const point &p, const unsigned *events, const bool *valid, unsigned &dot) const {
+    if(p.event<0) {
+        dot = p.offset;
+        return true;
+    }
+    if(!valid[p.event]) return false;
+    dot = std::min(std::max((int)events[p.event]+p.offset, 0), 24*3600);
+    return true;
+}
+
+bool Schedule::compiled_for(const tm &day_tm) const {
+    return compiled_day==day_tm.tm_year*1000+day_tm.tm_yday;
+}
+
+void Schedule::compile(const tm &day_tm) {
+    compiled_day = day_tm.tm_year*1000+day_tm.tm_yday;
+    scheduled.clear();
+    for(auto &t: table) t.clear();
+
+    // rules of yesterday running over midnight reach into today
+    tm yesterday = day_tm;
+    yesterday.tm_mday--;
+    yesterday.tm_hour = 12;
+    yesterday.tm_isdst = -1;
+    mktime(&yesterday);
+
+    unsigned events[N_EVENTS], y_events[N_EVENTS];
+    bool valid[N_EVENTS], y_valid[N_EVENTS];
+    solar_events(day_tm, events, valid);
+    solar_events(yesterday, y_events, y_valid);
+
+    for(auto &r: rules) {
+        if(r.channel>=table.size()) table.resize(r.channel+1);
+        if(std::find(scheduled.begin(), scheduled.end(), r.channel)==scheduled.end()) scheduled.push_back(r.channel);
+        unsigned on, off;
+        if(matches(r, yesterday) && resolve(r.on, y_events, y_valid, on) && resolve(r.off, y_events, y_valid, off) && off<on) {
+            table[r.channel].push_back(interval(0, off));
+        }
+        if(!matches(r, day_tm)) continue;
+        if(!resolve(r.on, events, valid, on) || !resolve(r.off, events, valid, off)) {
+            syslog(LOG_INFO, "schedule: solar event of a rule for channel %d does not happen today", r.channel);
+            continue;
+        }
+        if(off>=on) table[r.channel].push_back(interval(on, off));
+        else table[r.channel].push_back(interval(on, 24*3600));
+    }
+
+    for(auto c: scheduled) {
+        for(auto &i: table[c]) syslog(LOG_INFO, "schedule for %04d-%02d-%02d: channel %d on %02d:%02d:%02d - %02d:%02d:%02d", day_tm.tm_year+1900, day_tm.tm_mon+1, day_tm.tm_mday, c,
+            i.first/3600, i.first/60%60, i.first%60, i.second/3600, i.second/60%60, i.second%60);
+    }
+}
+
+const std::vector<unsigned> &Schedule::channels() const {
+    return scheduled;
+}
+
+const std::vector<Schedule::interval> &Schedule::intervals(unsigned channel) const {
+    return table[channel];
+}
@@ -0,0 +1,62 @@
+#ifndef LIGHTSRV_SCHEDULE_H
+#define LIGHTSRV_SCHEDULE_H
+
+#include <cstdint>
+#include <ctime>
+#include <string>
+#include <utility>
+#include <vector>
+
+// switch schedule for the automatic mode. a rule switches one channel on
+// between two points of the day, each either a fixed local time
+// ("18:30:00", "18:30") or a solar event with an optional offset
+// ("sunset-00:30", "dawn+1:00"), optionally restricted to weekdays
+// ("mon-fri", "sat,sun") and a date range ("04-01..09-30", may wrap around
+// the new year). rules ending before they start run over midnight.
+//
+// solar events: sunrise, sunset, dawn/dusk (civil), nautical_dawn,
+// nautical_dusk, astronomical_dawn, astronomical_dusk, noon.
+//
+// compile() resolves all rules for one day into plain intervals, so a tick
+// only has to look at the intervals of the current day.
+
+class Schedule {
+public:
+    typedef std::pair<unsigned, unsigned> interval;
+    enum event_t { SUNRISE, SUNSET, DAWN, DUSK, NAUTICAL_DAWN, NAUTICAL_DUSK, ASTRONOMICAL_DAWN, ASTRONOMICAL_DUSK, NOON, N_EVENTS };
+    Schedule();
+    void set_location(double latitude, double longitude);
+    int add_rule(unsigned channel, const std::string &on, const std::string &off, const std::string &days, const std::string &dates, std::string &err);
+    bool empty() const;
+    // true if the table is for the day of day_tm
+    bool compiled_for(const tm &day_tm) const;
+    void compile(const tm &day_tm);
+    const std::vector<unsigned> &channels() const;
+    const std::vector<interval> &intervals(unsigned channel) const;
+    // local seconds since midnight of a solar event on day_tm's date,
+    // false if it does not happen that day (polar day / night)
+    bool solar_event(const tm &day_tm, event_t e, unsigned &dot) const;
+private:
+    struct point {
+        int event;      // -1 for a fixed time of day
+        int offset;     // seconds, relative to the event
+    };
+    struct rule {
+        unsigned channel;
+        point on, off;
+        uint8_t days;   // bit n: tm_wday n
+        int from_md, to_md; // month*100+day, 0 for all year
+    };
+    int parse_point(const std::string &s, point &p, std::string &err) const;
+    bool matches(const rule &r, const tm &day_tm) const;
+    bool resolve(const point &p, const unsigned *events, const bool *valid, unsigned &dot) const;
+    void solar_events(const tm &day_tm, unsigned *events, bool *valid) const;
+    double latitude, longitude;
+    bool has_location;
+    std::vector<rule> rules;
+    int compiled_day;
+    std::vector<unsigned> scheduled;
+    std::vector<std::vector<interval>> table;
+};
+
+#endif
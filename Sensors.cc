@@ -0,0 +1,147 @@
+#include <syslog.h>
+#include <glob.h>
+
+#include <ctime>
+#include <fstream>
+#include <sstream>
+
+#include <boost/asio/placeholders.hpp>
+
+#include "Sensors.h"
+
+W1Source::W1Source(const std::string &path): path(path) {
+}
+
+int W1Source::read(double &value) {
+    // 72 01 4b 46 7f ff 0e 10 57 : crc=57 YES
+    // 72 01 4b 46 7f ff 0e 10 57 t=23125
+    std::ifstream f(path);
+    std::string crc_line, data_line;
+    if(!std::getline(f, crc_line) || !std::getline(f, data_line)) return 1;
+    if(crc_line.size()<3 || crc_line.compare(crc_line.size()-3, 3, "YES")) {
+        syslog(LOG_DEBUG, "w1 %s: crc check failed: %s", path.c_str(), crc_line.c_str());
+        return 1;
+    }
+    auto pos = data_line.find("t=");
+    if(pos==std::string::npos) return 1;
+    char *end;
+    long t = std::strtol(data_line.c_str()+pos+2, &end, 10);
+    if(end==data_line.c_str()+pos+2) return 1;
+    value = t/1000.0;
+    return 0;
+}
+
+FileSource::FileSource(const std::string &path, double scale): path(path), scale(scale) {
+}
+
+int FileSource::read(double &value) {
+    std::ifstream f(path);
+    double v;
+    if(!(f >> v)) return 1;
+    value = v*scale;
+    return 0;
+}
+
+Sensors::sensor::sensor(const std::string &name, std::unique_ptr<SensorSource> source, unsigned interval, unsigned raw_capacity):
+    name(name), source(std::move(source)), series(raw_capacity), interval(interval), errors(0)
+{
+}
+
+Sensors::Sensors(): work(new boost::asio::io_service::work(io)) {
+}
+
+Sensors::~Sensors() {
+    work.reset();
+    io.stop();
+    if(thread.joinable()) thread.join();
+}
+
+int Sensors::configure(const json11::Json &config, std::string &err) {
+    if(!config.is_array()) {
+        err = "sensors must be an array of sensor objects";
+        return 1;
+    }
+    for(auto &c: config.array_items()) {
+        std::string name = c["name"].string_value();
+        std::string type = c["type"].string_value();
+        std::string path = c["path"].string_value();
+        if(name=="" || path=="") {
+            err = "sensor needs a name and a path: " + c.dump();
+            return 1;
+        }
+        // the 1-wire ids are different for every thermometer, allow 28-*
+        glob_t g;
+        if(glob(path.c_str(), 0, nullptr, &g)==0) {
+            if(g.gl_pathc>1) syslog(LOG_WARNING, "sensor %s: %s is ambiguous, using %s", name.c_str(), path.c_str(), g.gl_pathv[0]);
+            path = g.gl_pathv[0];
+        }
+        globfree(&g);
+        std::unique_ptr<SensorSource> source;
+        if(type=="w1") source.reset(new W1Source(path));
+        else if(type=="file") source.reset(new FileSource(path, c["scale"].is_number() ? c["scale"].number_value() : 1));
+        else {
+            err = "sensor " + name + ": unknown type " + type;
+            return 1;
+        }
+        unsigned interval = c["interval"].is_number() ? c["interval"].int_value() : 60;
+        unsigned raw = c["raw"].is_number() ? c["raw"].int_value() : 3600;
+        add(name, std::move(source), interval ? interval : 1, raw);
+    }
+    return 0;
+}
+
+void Sensors::add(const std::string &name, std::unique_ptr<SensorSource> source, unsigned interval, unsigned raw_capacity) {
+    std::unique_ptr<sensor> s(new sensor(name, std::move(source), interval, raw_capacity));
+    syslog(LOG_INFO, "sensor %s every %d s, %d bytes of series", name.c_str(), interval, (int)s->series.memory());
+    sensors[name] = std::move(s);
+}
+
+void Sensors::start() {
+    if(sensors.empty()) return;
+    for(auto &s: sensors) {
+        sensor *p = s.second.get();
+        p->task = std::make_shared<PeriodicTask>(io, "Sensor " + p->name, p->interval, [this, p](){ sample(*p); }, true);
+    }
+    thread = std::thread([this](){ io.run(); });
+}
+
+void Sensors::sample(sensor &s) {
+    double value;
+    if(s.source->read(value)) {
+        s.errors++;
+        syslog(LOG_ERR, "sensor %s: read failed (%lu errors)", s.name.c_str(), s.errors.load());
+        return;
+    }
+    syslog(LOG_DEBUG, "sensor %s: %f", s.name.c_str(), value);
+    s.series.add(std::time(nullptr), value);
+}
+
+const TimeSeries *Sensors::series(const std::string &name) const {
+    auto s = sensors.find(name);
+    if(s==sensors.end()) return nullptr;
+    return &s->second->series;
+}
+
+std::vector<std::string> Sensors::names() const {
+    std::vector<std::string> n;
+    for(auto &s: sensors) n.push_back(s.first);
+    return n;
+}
+
+json11::Json Sensors::to_json() const {
+    json11::Json::object o;
+    for(auto &s: sensors) {
+        json11::Json::object so {
+            { "interval", (int)s.second->interval },
+            { "errors", (double)s.second->errors },
+            { "memory", (double)s.second->series.memory() }
+        };
+        TimeSeries::point p;
+        if(s.second->series.latest(p)) {
+            so["t"] = (double)p.t;
+            so["value"] = p.avg;
+        }
+        o[s.first] = so;
+    }
+    return o;
+}
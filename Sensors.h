@@ -0,0 +1,80 @@
+#ifndef LIGHTSRV_SENSORS_H
+#define LIGHTSRV_SENSORS_H
+
+#include <atomic>
+#include <map>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <boost/asio/io_service.hpp>
+#include <boost/asio/deadline_timer.hpp>
+#include <boost/noncopyable.hpp>
+
+#include "json11.git/json11.hpp"
+
+#include "PeriodicTask.h"
+#include "TimeSeries.h"
+
+// a sensor value source, read() returns 0 on success
+class SensorSource {
+public:
+    virtual ~SensorSource() {}
+    virtual int read(double &value) = 0;
+};
+
+// 1-wire thermometer, /sys/bus/w1/devices/28-*/w1_slave
+class W1Source : public SensorSource {
+    std::string path;
+public:
+    W1Source(const std::string &path);
+    int read(double &value) override;
+};
+
+// first number in a file times scale, e.g. an iio sysfs attribute, or a
+// plain file written by a test script
+class FileSource : public SensorSource {
+    std::string path;
+    double scale;
+public:
+    FileSource(const std::string &path, double scale);
+    int read(double &value) override;
+};
+
+// samples the configured sensors on PeriodicTasks into their time series.
+// reading a 1-wire sensor takes most of a second, so the sampling runs on
+// its own io_service and thread instead of the server's.
+//
+// config: [{"name": "water", "type": "w1", "path": "/sys/bus/w1/devices/28-*/w1_slave", "interval": 10},
+//          {"name": "light", "type": "file", "path": "/tmp/light", "scale": 1, "interval": 60, "raw": 3600}]
+
+class Sensors : boost::noncopyable {
+public:
+    Sensors();
+    ~Sensors();
+    int configure(const json11::Json &config, std::string &err);
+    // register a source from code instead of the config
+    void add(const std::string &name, std::unique_ptr<SensorSource> source, unsigned interval, unsigned raw_capacity=3600);
+    void start();
+    const TimeSeries *series(const std::string &name) const;
+    std::vector<std::string> names() const;
+    json11::Json to_json() const;
+private:
+    struct sensor {
+        std::string name;
+        std::unique_ptr<SensorSource> source;
+        TimeSeries series;
+        unsigned interval;
+        std::atomic<unsigned long> errors;
+        std::shared_ptr<PeriodicTask> task;
+        sensor(const std::string &name, std::unique_ptr<SensorSource> source, unsigned interval, unsigned raw_capacity);
+    };
+    void sample(sensor &s);
+    boost::asio::io_service io;
+    std::unique_ptr<boost::asio::io_service::work> work;
+    std::thread thread;
+    std::map<std::string, std::unique_ptr<sensor>> sensors;
+};
+
+#endif
@@ -0,0 +1,53 @@
+#include <syslog.h>
+
+#include <chrono>
+#include <iostream>
+
+#include <boost/algorithm/string.hpp>
+
+#include "Simulation.h"
+
+time_t simulation_span(const std::string &s) {
+    if(s=="day") return 24*3600;
+    if(s=="week") return 7*24*3600;
+    if(s=="year") return 365*24*3600;
+    char *end;
+    long span = std::strtol(s.c_str(), &end, 10);
+    if(*end!='\0' || span<=0) return 0;
+    return span;
+}
+
+int simulate(BCM2835 &backend, time_t start, time_t end, unsigned step, const std::string &format, std::ostream &out) {
+    if(format!="csv" && format!="json") {
+        std::cerr << "unknown simulation output format " << format << std::endl;
+        return 1;
+    }
+    if(!step) step = 1;
+    time_t now = start;
+    backend.set_mockup(true);
+    backend.set_clock([&now](){ return now; });
+
+    bool csv = format=="csv";
+    if(csv) out << "time,kind,channel,value\n";
+    const char *kinds[] = { "switch", "pwm", "auto" };
+    unsigned long changes = 0;
+    backend.on_change([&](const BCM2835::change &c) {
+        changes++;
+        if(csv) out << now << ',' << kinds[c.kind] << ',' << c.channel << ',' << c.value << '\n';
+        else out << "{\"time\": " << now << ", \"kind\": \"" << kinds[c.kind] << "\", \"channel\": " << c.channel << ", \"value\": " << c.value << "}\n";
+    });
+
+    unsigned long ticks = 0;
+    auto t0 = std::chrono::steady_clock::now();
+    for(; now<end; now+=step) {
+        backend.autom();
+        ticks++;
+    }
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now()-t0).count();
+    out.flush();
+
+    std::cerr << "simulated " << ticks << " ticks every " << step << " s (" << (end-start)/3600.0 << " h) in " << elapsed << " s: "
+              << (elapsed>0 ? ticks/elapsed : 0) << " ticks/s, " << changes << " changes" << std::endl;
+    syslog(LOG_NOTICE, "simulated %lu ticks in %f s", ticks, elapsed);
+    return 0;
+}
@@ -0,0 +1,19 @@
+#ifndef LIGHTSRV_SIMULATION_H
+#define LIGHTSRV_SIMULATION_H
+
+#include <ctime>
+#include <ostream>
+#include <string>
+
+#include "BCM2835.h"
+
+// replays automode ticks from start to end against the mockup backend with
+// a simulated clock, as fast as possible, and writes every resulting
+// switch/pwm/auto change as csv or json lines to out. returns 0 on success.
+
+int simulate(BCM2835 &backend, time_t start, time_t end, unsigned step, const std::string &format, std::ostream &out);
+
+// "day", "week", "year" or a number of seconds, 0 if invalid
+time_t simulation_span(const std::string &s);
+
+#endif
@@ -0,0 +1,183 @@
+#include <syslog.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include <boost/algorithm/string.hpp>
+#include <openssl/evp.h>
+
+#include "StaticFiles.h"
+
+StaticFiles::mapping::~mapping() {
+    if(size) munmap((void *)data, size);
+}
+
+StaticFiles::StaticFiles(const std::string &docroot): docroot(docroot), mapped(0) {
+}
+
+const char *StaticFiles::mime_type(const std::string &name) {
+    // also the whitelist: files of other types are never served
+    static const std::map<std::string, const char *> types {
+        { "html", "text/html; charset=utf-8" },
+        { "css", "text/css; charset=utf-8" },
+        { "js", "text/javascript; charset=utf-8" },
+        { "mjs", "text/javascript; charset=utf-8" },
+        { "map", "application/json" },
+        { "webmanifest", "application/manifest+json" },
+        { "svg", "image/svg+xml" },
+        { "png", "image/png" },
+        { "jpg", "image/jpeg" },
+        { "jpeg", "image/jpeg" },
+        { "gif", "image/gif" },
+        { "webp", "image/webp" },
+        { "ico", "image/x-icon" },
+        { "woff", "font/woff" },
+        { "woff2", "font/woff2" }
+    };
+    auto dot = name.rfind('.');
+    if(dot==std::string::npos) return nullptr;
+    auto it = types.find(boost::to_lower_copy(name.substr(dot+1)));
+    return it==types.end() ? nullptr : it->second;
+}
+
+bool StaticFiles::hashed_name(const std::string &name) {
+    // a part between two dots of at least 8 hex digits: app.3f2a9c1d.js
+    std::vector<std::string> parts;
+    boost::split(parts, name, boost::is_any_of("."));
+    for(std::size_t i=1; i+1<parts.size(); i++) {
+        if(parts[i].size()>=8 && parts[i].find_first_not_of("0123456789abcdefABCDEF")==std::string::npos) return true;
+    }
+    return false;
+}
+
+std::shared_ptr<const StaticFiles::mapping> StaticFiles::map_file(const std::string &path, std::string &err) {
+    int fd = open(path.c_str(), O_RDONLY|O_CLOEXEC);
+    if(fd<0) {
+        err = strerror(errno);
+        return nullptr;
+    }
+    struct stat st;
+    if(fstat(fd, &st)) {
+        err = strerror(errno);
+        ::close(fd);
+        return nullptr;
+    }
+    void *p = nullptr;
+    if(st.st_size>0) {
+        p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(p==MAP_FAILED) {
+            err = strerror(errno);
+            ::close(fd);
+            return nullptr;
+        }
+    }
+    ::close(fd);
+    return std::make_shared<const mapping>((const uint8_t *)p, st.st_size);
+}
+
+void StaticFiles::scan(const std::string &dir, const std::string &prefix, unsigned depth) {
+    DIR *d = opendir(dir.c_str());
+    if(!d) {
+        syslog(LOG_ERR, "cannot read directory %s: %s", dir.c_str(), strerror(errno));
+        return;
+    }
+    std::vector<std::string> names;
+    while(dirent *e = readdir(d)) {
+        if(e->d_name[0]!='.') names.push_back(e->d_name);
+    }
+    closedir(d);
+
+    for(auto &name: names) {
+        if(name.find_first_not_of("ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789._-~")!=std::string::npos) continue;
+        std::string path = dir + "/" + name;
+        struct stat st;
+        if(lstat(path.c_str(), &st)) continue;
+        if(S_ISDIR(st.st_mode)) {
+            if(depth<8) scan(path, prefix + name + "/", depth+1);
+            continue;
+        }
+        const char *mime = mime_type(name);
+        if(!S_ISREG(st.st_mode) || !mime) continue;
+
+        std::string err;
+        file f { mime, "", hashed_name(name), map_file(path, err), nullptr, nullptr };
+        if(!f.plain) {
+            syslog(LOG_ERR, "cannot map %s: %s", path.c_str(), err.c_str());
+            continue;
+        }
+        unsigned char md[EVP_MAX_MD_SIZE];
+        unsigned int len = 0;
+        EVP_Digest(f.plain->data, f.plain->size, md, &len, EVP_sha256(), nullptr);
+        char hex[17];
+        for(unsigned i=0; i<8; i++) snprintf(hex+2*i, 3, "%02x", md[i]);
+        f.etag = std::string("\"") + hex + "\"";
+        // precompressed variants, only if at least as new as the file
+        for(auto v: { std::make_pair(".gz", &f.gz), std::make_pair(".br", &f.br) }) {
+            struct stat vst;
+            std::string vpath = path + v.first;
+            if(lstat(vpath.c_str(), &vst) || !S_ISREG(vst.st_mode)) continue;
+            if(vst.st_mtime<st.st_mtime) {
+                syslog(LOG_WARNING, "ignoring %s, it is older than %s", vpath.c_str(), path.c_str());
+                continue;
+            }
+            *v.second = map_file(vpath, err);
+            if(*v.second) mapped += (*v.second)->size;
+        }
+        mapped += f.plain->size;
+        syslog(LOG_DEBUG, "static file /%s%s: %zu bytes, %s%s%s", prefix.c_str(), name.c_str(), f.plain->size, f.etag.c_str(), f.gz ? ", gz" : "", f.br ? ", br" : "");
+        files.emplace("/" + prefix + name, std::move(f));
+    }
+}
+
+int StaticFiles::load(std::string &err) {
+    struct stat st;
+    if(stat(docroot.c_str(), &st) || !S_ISDIR(st.st_mode)) {
+        err = "docroot " + docroot + " is no directory";
+        return 1;
+    }
+    files.clear();
+    mapped = 0;
+    scan(docroot, "", 0);
+    syslog(LOG_INFO, "serving %zu static files, %zu bytes mapped", files.size(), mapped);
+    return 0;
+}
+
+const StaticFiles::file *StaticFiles::find(const std::string &path) const {
+    auto it = files.find(path);
+    return it==files.end() ? nullptr : &it->second;
+}
+
+std::shared_ptr<const StaticFiles::mapping> StaticFiles::select(const file &f, const std::string &accept_encoding, std::string &encoding) {
+    bool br = false, gzip = false;
+    std::vector<std::string> codings;
+    boost::split(codings, accept_encoding, boost::is_any_of(","));
+    for(auto &c: codings) {
+        std::vector<std::string> params;
+        boost::split(params, c, boost::is_any_of(";"));
+        double q = 1;
+        for(auto &p: params) {
+            boost::trim(p);
+            if(boost::starts_with(p, "q=")) q = std::strtod(p.c_str()+2, nullptr);
+        }
+        if(params[0]=="br") br = q>0;
+        if(params[0]=="gzip") gzip = q>0;
+    }
+    std::shared_ptr<const mapping> best = f.plain;
+    encoding = "";
+    if(gzip && f.gz && f.gz->size<best->size) {
+        best = f.gz;
+        encoding = "gzip";
+    }
+    if(br && f.br && f.br->size<best->size) {
+        best = f.br;
+        encoding = "br";
+    }
+    return best;
+}
@@ -0,0 +1,61 @@
+#ifndef LIGHTSRV_STATICFILES_H
+#define LIGHTSRV_STATICFILES_H
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <string>
+
+#include <boost/noncopyable.hpp>
+
+// the web assets below docroot, loaded once at startup: each file is
+// mmap'ed, hashed and typed, together with its precompressed .gz and .br
+// siblings. only files in this manifest are served, and only those with a
+// known web asset extension, since docroot usually also holds the key and
+// the config. no dot files, no symlinks, nothing created later.
+//
+// names carrying a content hash, like app.3f2a9c1d.js, are immutable for a
+// year, browsers do not even revalidate them. everything else gets its
+// hash as etag and no-cache, so a repeat visit costs a 304.
+//
+// replace files by rename, not in place: the mapping of a truncated file
+// faults on access. a restart picks up the new ones.
+
+class StaticFiles : boost::noncopyable {
+public:
+    class mapping : boost::noncopyable {
+    public:
+        mapping(const uint8_t *data, std::size_t size): data(data), size(size) {}
+        ~mapping();
+        const uint8_t *const data;
+        const std::size_t size;
+    };
+    struct file {
+        std::string mime;
+        std::string etag;       // quoted, of the uncompressed content
+        bool immutable;
+        std::shared_ptr<const mapping> plain;
+        std::shared_ptr<const mapping> gz;
+        std::shared_ptr<const mapping> br;
+    };
+    StaticFiles(const std::string &docroot);
+    int load(std::string &err);
+    // path as in the URL, "/app.js"; nullptr if not in the manifest
+    const file *find(const std::string &path) const;
+    // the smallest variant accept_encoding allows, encoding is set to
+    // "br", "gzip" or "" for the plain file
+    static std::shared_ptr<const mapping> select(const file &f, const std::string &accept_encoding, std::string &encoding);
+    std::size_t size() const { return files.size(); }
+    std::size_t bytes() const { return mapped; }
+private:
+    static const char *mime_type(const std::string &name);
+    static bool hashed_name(const std::string &name);
+    static std::shared_ptr<const mapping> map_file(const std::string &path, std::string &err);
+    void scan(const std::string &dir, const std::string &prefix, unsigned depth);
+    std::string docroot;
+    std::map<std::string, file> files;
+    std::size_t mapped;
+};
+
+#endif
@@ -0,0 +1,121 @@
+#include <algorithm>
+#include <limits>
+
+#include "TimeSeries.h"
+
+TimeSeries::ring::ring(unsigned capacity): buf(capacity), head(0), count(0) {
+}
+
+void TimeSeries::ring::push(const point &p) {
+    if(buf.empty()) return;
+    buf[head] = p;
+    head = (head+1)%buf.size();
+    if(count<buf.size()) count++;
+}
+
+unsigned TimeSeries::ring::size() const {
+    return count;
+}
+
+const TimeSeries::point &TimeSeries::ring::at(unsigned i) const {
+    return buf[(head+buf.size()-count+i)%buf.size()];
+}
+
+unsigned TimeSeries::ring::lower_bound(int64_t t) const {
+    unsigned lo=0, hi=count;
+    while(lo<hi) {
+        unsigned mid = lo+(hi-lo)/2;
+        if(at(mid).t<t) lo = mid+1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+std::size_t TimeSeries::ring::memory() const {
+    return buf.capacity()*sizeof(point);
+}
+
+void TimeSeries::bucket::reset(int64_t start) {
+    t = start;
+    sum = 0;
+    min = std::numeric_limits<float>::max();
+    max = std::numeric_limits<float>::lowest();
+    n = 0;
+}
+
+void TimeSeries::bucket::add(float a, float mi, float ma) {
+    sum += a;
+    min = std::min(min, mi);
+    max = std::max(max, ma);
+    n++;
+}
+
+TimeSeries::point TimeSeries::bucket::get() const {
+    return point { t, float(sum/n), min, max };
+}
+
+TimeSeries::TimeSeries(unsigned raw_capacity, unsigned minute_capacity, unsigned hour_capacity):
+    levels { ring(raw_capacity), ring(minute_capacity), ring(hour_capacity) }
+{
+    minute.reset(0);
+    hour.reset(0);
+}
+
+void TimeSeries::add(int64_t t, float value) {
+    std::lock_guard<std::mutex> lock(mtx);
+    if(levels[RAW].size() && t<levels[RAW].at(levels[RAW].size()-1).t) return;
+    levels[RAW].push(point { t, value, value, value });
+
+    int64_t m = t-t%60;
+    if(minute.n && m!=minute.t) {
+        point p = minute.get();
+        levels[MINUTE].push(p);
+        int64_t h = p.t-p.t%3600;
+        if(hour.n && h!=hour.t) {
+            levels[HOUR].push(hour.get());
+            hour.n = 0;
+        }
+        if(!hour.n) hour.reset(h);
+        // the hour is the average of its minutes, not of the raw samples
+        hour.add(p.avg, p.min, p.max);
+        minute.n = 0;
+    }
+    if(!minute.n) minute.reset(m);
+    minute.add(value, value, value);
+}
+
+std::vector<TimeSeries::point> TimeSeries::range(resolution r, int64_t from, int64_t to) const {
+    std::lock_guard<std::mutex> lock(mtx);
+    const ring &l = levels[r];
+    std::vector<point> result;
+    for(unsigned i=l.lower_bound(from); i<l.size() && l.at(i).t<=to; i++) result.push_back(l.at(i));
+    return result;
+}
+
+TimeSeries::resolution TimeSeries::best(int64_t from) const {
+    std::lock_guard<std::mutex> lock(mtx);
+    for(auto r: { RAW, MINUTE }) {
+        if(levels[r].size() && levels[r].at(0).t<=from) return r;
+    }
+    return HOUR;
+}
+
+bool TimeSeries::latest(point &p) const {
+    std::lock_guard<std::mutex> lock(mtx);
+    if(!levels[RAW].size()) return false;
+    p = levels[RAW].at(levels[RAW].size()-1);
+    return true;
+}
+
+std::size_t TimeSeries::memory() const {
+    return levels[RAW].memory()+levels[MINUTE].memory()+levels[HOUR].memory();
+}
+
+const char *TimeSeries::name(resolution r) {
+    switch(r) {
+    case RAW: return "raw";
+    case MINUTE: return "minute";
+    case HOUR: return "hour";
+    }
+    return "";
+}
@@ -0,0 +1,60 @@
+#ifndef LIGHTSRV_TIMESERIES_H
+#define LIGHTSRV_TIMESERIES_H
+
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// fixed memory time series: raw samples plus 1 minute and 1 hour
+// aggregates, each in a ring buffer of fixed capacity, so memory stays the
+// same however long we run. samples must come in with increasing time,
+// which makes range queries a binary search instead of a scan.
+
+class TimeSeries {
+public:
+    enum resolution { RAW, MINUTE, HOUR };
+    struct point {
+        int64_t t;      // unix time in seconds, start of the bucket for aggregates
+        float avg;
+        float min;
+        float max;
+    };
+    TimeSeries(unsigned raw_capacity=3600, unsigned minute_capacity=1440, unsigned hour_capacity=24*366);
+    void add(int64_t t, float value);
+    std::vector<point> range(resolution r, int64_t from, int64_t to) const;
+    // finest resolution still holding data back to from
+    resolution best(int64_t from) const;
+    bool latest(point &p) const;
+    std::size_t memory() const;
+    static const char *name(resolution r);
+private:
+    class ring {
+    public:
+        ring(unsigned capacity);
+        void push(const point &p);
+        unsigned size() const;
+        const point &at(unsigned i) const;  // 0 is the oldest
+        unsigned lower_bound(int64_t t) const;
+        std::size_t memory() const;
+    private:
+        std::vector<point> buf;
+        unsigned head;
+        unsigned count;
+    };
+    struct bucket {
+        int64_t t;
+        double sum;
+        float min;
+        float max;
+        unsigned n;
+        void reset(int64_t start);
+        void add(float avg, float min, float max);
+        point get() const;
+    };
+    mutable std::mutex mtx;
+    ring levels[3];
+    bucket minute, hour;
+};
+
+#endif
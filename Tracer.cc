@@ -0,0 +1,94 @@
+#include <cstdio>
+
+#include "Tracer.h"
+
+Tracer::Tracer(unsigned capacity, unsigned sample_every, unsigned slow_ms):
+    on(capacity>0 && (sample_every>0 || slow_ms>0)), sample_every(sample_every), slow_ns(uint64_t(slow_ms)*1000000),
+    requests(0), ring(capacity), next(0)
+{
+}
+
+Tracer::ptr Tracer::start(const std::string &method, const std::string &path, const std::string &id) {
+    ptr t = std::make_shared<trace>();
+    uint64_t n = ++requests;
+    t->seq = n;
+    if(id!="") t->id = id;
+    else {
+        char buf[17];
+        snprintf(buf, sizeof(buf), "%016llx", (unsigned long long)n);
+        t->id = buf;
+    }
+    t->name = method + " " + path;
+    t->wall_us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+    t->start_ns = now_ns();
+    t->n = 0;
+    return t;
+}
+
+void Tracer::keep(const ptr &t) {
+    uint64_t total = t->n ? t->marks[t->n-1].ns-t->start_ns : 0;
+    bool sampled = sample_every && t->seq%sample_every==0;
+    if(!(slow_ns && total>=slow_ns) && !sampled) return;
+    std::lock_guard<std::mutex> lock(mtx);
+    ring[next++%ring.size()] = t;
+}
+
+std::vector<Tracer::ptr> Tracer::snapshot() const {
+    std::vector<ptr> r;
+    std::lock_guard<std::mutex> lock(mtx);
+    for(std::size_t i=0; i<ring.size() && i<next; i++) r.push_back(ring[(next-1-i)%ring.size()]);
+    return r;
+}
+
+json11::Json Tracer::to_json(unsigned limit) const {
+    json11::Json::array traces;
+    for(auto &t: snapshot()) {
+        if(traces.size()>=limit) break;
+        json11::Json::array stages;
+        uint64_t prev = t->start_ns;
+        for(unsigned i=0; i<t->n; i++) {
+            stages.push_back(json11::Json::object {
+                { "stage", t->marks[i].stage },
+                { "us", (t->marks[i].ns-prev)/1000.0 }
+            });
+            prev = t->marks[i].ns;
+        }
+        traces.push_back(json11::Json::object {
+            { "id", t->id },
+            { "name", t->name },
+            { "start", t->wall_us/1e6 },
+            { "total_us", (prev-t->start_ns)/1000.0 },
+            { "stages", stages }
+        });
+    }
+    return json11::Json::object {
+        { "enabled", on },
+        { "requests", (double)requests.load() },
+        { "traces", traces }
+    };
+}
+
+std::string Tracer::chrome() const {
+    // one complete event per request and one per stage below it, each
+    // request on its own tid so overlapping ones do not get mixed up
+    json11::Json::array events;
+    unsigned tid = 0;
+    for(auto &t: snapshot()) {
+        tid++;
+        uint64_t prev = t->start_ns;
+        uint64_t end = t->n ? t->marks[t->n-1].ns : prev;
+        events.push_back(json11::Json::object {
+            { "name", t->name }, { "ph", "X" }, { "pid", 1 }, { "tid", (int)tid },
+            { "ts", (double)t->wall_us }, { "dur", (end-prev)/1000.0 },
+            { "args", json11::Json::object { { "id", t->id } } }
+        });
+        for(unsigned i=0; i<t->n; i++) {
+            events.push_back(json11::Json::object {
+                { "name", t->marks[i].stage }, { "ph", "X" }, { "pid", 1 }, { "tid", (int)tid },
+                { "ts", t->wall_us+(prev-t->start_ns)/1000.0 }, { "dur", (t->marks[i].ns-prev)/1000.0 }
+            });
+            prev = t->marks[i].ns;
+        }
+    }
+    return json11::Json(json11::Json::object { { "traceEvents", events }, { "displayTimeUnit", "ms" } }).dump();
+}
@@ -0,0 +1,77 @@
+#ifndef LIGHTSRV_TRACER_H
+#define LIGHTSRV_TRACER_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <boost/noncopyable.hpp>
+
+#include "json11.git/json11.hpp"
+
+// per request stage timing. a handler starts a trace with begin() and
+// marks the end of each stage, the trace is kept in a bounded ring when it
+// was sampled (every sample_every-th request) or took at least slow_ms:
+//
+//     Tracer::ptr tr;
+//     if(tracer.enabled()) tr = tracer.begin("PUT", path, request_id);
+//     ...
+//     Tracer::mark(tr, "parse");
+//     ...
+//     tracer.finish(tr);
+//
+// with tracing off, mark() and finish() are a branch each, and checking
+// enabled() first saves building begin()'s arguments.
+
+class Tracer : boost::noncopyable {
+public:
+    static const unsigned max_marks = 16;
+    struct trace {
+        uint64_t seq;
+        std::string id;
+        std::string name;
+        int64_t wall_us;        // start, unix time
+        uint64_t start_ns;      // start, steady clock
+        unsigned n;
+        struct { const char *stage; uint64_t ns; } marks[max_marks];
+    };
+    typedef std::shared_ptr<trace> ptr;
+    Tracer(unsigned capacity, unsigned sample_every, unsigned slow_ms);
+    bool enabled() const { return on; }
+    // id is the client's x-request-id if it sent one, one is made up otherwise
+    ptr begin(const std::string &method, const std::string &path, const std::string &id) {
+        if(!on) return nullptr;
+        return start(method, path, id);
+    }
+    // stage ended now, stage has to be a string literal
+    static void mark(const ptr &t, const char *stage) {
+        if(t && t->n<max_marks) t->marks[t->n++] = { stage, now_ns() };
+    }
+    void finish(const ptr &t) {
+        if(t) keep(t);
+    }
+    // newest first
+    json11::Json to_json(unsigned limit) const;
+    // chrome://tracing / perfetto trace event format
+    std::string chrome() const;
+    static uint64_t now_ns() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+private:
+    ptr start(const std::string &method, const std::string &path, const std::string &id);
+    void keep(const ptr &t);
+    std::vector<ptr> snapshot() const;
+    bool on;
+    unsigned sample_every;
+    uint64_t slow_ns;
+    std::atomic<uint64_t> requests;
+    mutable std::mutex mtx;
+    std::vector<ptr> ring;
+    std::size_t next;
+};
+
+#endif
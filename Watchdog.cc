@@ -0,0 +1,227 @@
+#include <syslog.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <functional>
+
+#include <boost/asio/deadline_timer.hpp>
+
+#include "Watchdog.h"
+#include "PeriodicTask.h"
+
+static const unsigned max_backoff_ms = 60000;
+
+static int64_t now_us() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+Watchdog::Watchdog(BCM2835 &backend, unsigned interval_ms, unsigned stall_ms):
+    backend(backend), automode(nullptr), interval_ms(interval_ms), stall_ms(stall_ms), probing(interval_ms!=0), systemd(false), pinging(false), probe_us(0), max_probe_us(0), pings(0), next_reinit_us(0), backoff_ms(std::max(interval_ms, 1000u)), stopping(false)
+{
+    const char *s = getenv("NOTIFY_SOCKET");
+    systemd = s && *s;
+    // like sd_watchdog_enabled(3): the watchdog is for the process systemd
+    // started, not for a child that inherited the environment
+    const char *pid = getenv("WATCHDOG_PID");
+    pinging = systemd && (!pid || !*pid || std::strtoul(pid, nullptr, 10)==(unsigned long)getpid());
+    if(systemd && !pinging) syslog(LOG_NOTICE, "WATCHDOG_PID %s is not us, not pinging the systemd watchdog", pid);
+    // systemd wants a ping at least every WatchdogSec, better twice as often,
+    // with the probes disabled too or it kills us
+    const char *usec = getenv("WATCHDOG_USEC");
+    if(pinging && usec) {
+        unsigned limit = std::max(std::strtoull(usec, nullptr, 10)/2000, 1ull);
+        if(!probing) {
+            syslog(LOG_NOTICE, "watchdog probes disabled, still pinging systemd every %u ms for WatchdogSec", limit);
+            this->interval_ms = limit;
+        }
+        else if(this->interval_ms>limit) {
+            syslog(LOG_NOTICE, "watchdog interval %u ms lowered to %u ms for WatchdogSec", this->interval_ms, limit);
+            this->interval_ms = limit;
+        }
+    }
+}
+
+Watchdog::~Watchdog() {
+    stop();
+}
+
+void Watchdog::add_loop(boost::asio::io_service &io) {
+    loops.emplace_back(new loop());
+    loop &l = *loops.back();
+    l.io = &io;
+    l.posted_us = l.delay_us = l.max_delay_us = 0;
+    l.stalled = false;
+    l.stalls = 0;
+}
+
+void Watchdog::set_automode(const PeriodicTask *task) {
+    automode = task;
+}
+
+void Watchdog::start() {
+    if(loops.empty()) return;
+    // the first loop runs, i.e. the server listens
+    loops[0]->io->post([this]() {
+        if(notify("READY=1")) syslog(LOG_INFO, "told systemd we are ready");
+    });
+    if(!interval_ms) return;
+    if(probing) syslog(LOG_INFO, "watchdog: probing %zu event loops every %u ms%s", loops.size(), interval_ms, pinging ? ", pinging systemd" : "");
+    thread = std::thread([this](){ run(); });
+}
+
+void Watchdog::stop() {
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        if(stopping) return;
+        stopping = true;
+    }
+    cv.notify_one();
+    if(thread.joinable()) thread.join();
+    notify("STOPPING=1");
+}
+
+void Watchdog::run() {
+    std::unique_lock<std::mutex> lock(mtx);
+    while(!stopping) {
+        int64_t now = now_us();
+        bool stalled = false;
+        for(std::size_t i=0; probing && i<loops.size(); i++) {
+            loop &l = *loops[i];
+            int64_t posted = l.posted_us;
+            if(posted) {
+                // one probe in flight per loop
+                if(now-posted<int64_t(stall_ms)*1000) continue;
+                stalled = true;
+                if(!l.stalled.exchange(true)) {
+                    l.stalls++;
+                    syslog(LOG_ERR, "watchdog: event loop %zu stalled for %lld ms", i, (long long)(now-posted)/1000);
+                }
+                continue;
+            }
+            l.posted_us = now;
+            l.io->post(std::bind(&Watchdog::probe, this, std::ref(l)));
+        }
+        if(!stalled && pinging && notify("WATCHDOG=1")) pings++;
+        cv.wait_for(lock, std::chrono::milliseconds(interval_ms), [this](){ return stopping; });
+    }
+}
+
+void Watchdog::probe(loop &l) {
+    int64_t delay = now_us()-l.posted_us;
+    l.delay_us = delay;
+    if(delay>l.max_delay_us) l.max_delay_us = delay;
+    if(l.stalled.exchange(false)) syslog(LOG_NOTICE, "watchdog: event loop runs again after %lld ms", (long long)delay/1000);
+    if(&l==loops[0].get()) check_backend();
+    l.posted_us = 0;
+}
+
+void Watchdog::check_backend() {
+    int64_t t0 = now_us();
+    int failed = backend.probe();
+    int64_t t = now_us()-t0;
+    probe_us = t;
+    if(t>max_probe_us) max_probe_us = t;
+    if(!failed) {
+        backoff_ms = std::max(interval_ms, 1000u);
+        next_reinit_us = 0;
+        return;
+    }
+    if(t0<next_reinit_us) return;
+    if(backend.reinit()) {
+        next_reinit_us = t0+int64_t(backoff_ms)*1000;
+        syslog(LOG_WARNING, "watchdog: backend still failing, next reinit in %u s", backoff_ms/1000);
+        backoff_ms = std::min(2*backoff_ms, max_backoff_ms);
+    }
+}
+
+std::vector<std::string> Watchdog::problems() const {
+    std::vector<std::string> p;
+    BCM2835::health_t h = backend.health();
+    if(!h.gpio) p.push_back("gpio not available");
+    if(h.has_expander && !h.expander) p.push_back("pca9685 not available");
+    for(std::size_t i=0; i<loops.size(); i++) {
+        if(loops[i]->stalled) p.push_back("event loop " + std::to_string(i) + " stalled");
+    }
+    // a tick missed entirely
+    if(automode && automode->last_run() && std::time(nullptr)-automode->last_run()>2*automode->get_interval()) p.push_back("automode late");
+    return p;
+}
+
+json11::Json Watchdog::to_json() const {
+    std::vector<std::string> p = problems();
+    BCM2835::health_t h = backend.health();
+    time_t now = std::time(nullptr);
+    json11::Json::object hw {
+        { "gpio", h.gpio },
+        { "last_write", (double)h.last_write },
+        { "last_write_age", h.last_write ? (double)(now-h.last_write) : json11::Json() },
+        { "failures", (double)h.failures },
+        { "reinits", (double)h.reinits },
+        { "probe_ms", probe_us/1000.0 },
+        { "max_probe_ms", max_probe_us/1000.0 }
+    };
+    if(h.has_expander) hw["pca9685"] = h.expander;
+    json11::Json::array event_loops;
+    int64_t t = now_us();
+    for(auto &l: loops) {
+        int64_t posted = l->posted_us;
+        event_loops.push_back(json11::Json::object {
+            { "queue_delay_ms", l->delay_us/1000.0 },
+            { "max_queue_delay_ms", l->max_delay_us/1000.0 },
+            // the probe in flight, a stall if this keeps growing
+            { "waiting_ms", posted ? (t-posted)/1000.0 : 0.0 },
+            { "stalled", (bool)l->stalled },
+            { "stalls", (double)l->stalls }
+        });
+    }
+    json11::Json::object doc {
+        { "status", p.empty() ? "ok" : "degraded" },
+        { "problems", p },
+        { "backend", hw },
+        { "event_loops", event_loops },
+        {
+            "watchdog", json11::Json::object {
+                { "probing", probing },
+                { "interval_ms", (int)interval_ms },
+                { "stall_ms", (int)stall_ms },
+                { "systemd", systemd },
+                { "pinging", pinging },
+                { "pings", (double)pings }
+            }
+        }
+    };
+    if(automode) {
+        doc["automode"] = json11::Json::object {
+            { "interval", automode->get_interval() },
+            { "last_tick", (double)automode->last_run() },
+            { "lateness_ms", automode->lateness_us()/1000.0 },
+            { "max_lateness_ms", automode->max_lateness_us()/1000.0 }
+        };
+    }
+    return doc;
+}
+
+bool Watchdog::notify(const std::string &state) {
+    const char *path = getenv("NOTIFY_SOCKET");
+    if(!path || !*path) return false;
+    sockaddr_un sa;
+    std::memset(&sa, 0, sizeof(sa));
+    sa.sun_family = AF_UNIX;
+    std::size_t len = strlen(path);
+    if(len>=sizeof(sa.sun_path)) return false;
+    std::memcpy(sa.sun_path, path, len);
+    // abstract namespace
+    if(sa.sun_path[0]=='@') sa.sun_path[0] = 0;
+    int fd = socket(AF_UNIX, SOCK_DGRAM|SOCK_CLOEXEC, 0);
+    if(fd<0) return false;
+    bool ok = sendto(fd, state.data(), state.size(), MSG_NOSIGNAL|MSG_DONTWAIT, (sockaddr *)&sa, offsetof(sockaddr_un, sun_path)+len)==(ssize_t)state.size();
+    ::close(fd);
+    return ok;
+}
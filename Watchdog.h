@@ -0,0 +1,84 @@
+#ifndef LIGHTSRV_WATCHDOG_H
+#define LIGHTSRV_WATCHDOG_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <boost/asio/io_service.hpp>
+#include <boost/noncopyable.hpp>
+
+#include "json11.git/json11.hpp"
+#include "BCM2835.h"
+
+class PeriodicTask;
+
+// keeps an eye on the event loops and the hardware, for GET /v1/health:
+//
+//  - every interval a probe is posted to each io_service, the time until
+//    it runs is the loop's queue delay. a probe still waiting after stall
+//    ms means the loop is stalled
+//  - the probe on the first loop also times one read through the backend
+//    and re-initializes the backend while it fails, backing off to once
+//    a minute
+//  - under systemd (NOTIFY_SOCKET) it sends READY=1 once the first loop
+//    runs and WATCHDOG=1 while no loop is stalled, so with WatchdogSec a
+//    hung process is killed and restarted. WATCHDOG=1 only if WATCHDOG_PID
+//    is unset or this process
+//
+// the checks run on a thread of their own, a stalled loop does not stop
+// them.
+
+class Watchdog : boost::noncopyable {
+public:
+    // interval 0 disables the probes, READY=1 is sent anyway, and under a
+    // systemd watchdog the pings go on at half WatchdogSec
+    Watchdog(BCM2835 &backend, unsigned interval_ms, unsigned stall_ms);
+    ~Watchdog();
+    // before start()
+    void add_loop(boost::asio::io_service &io);
+    void set_automode(const PeriodicTask *task);
+    void start();
+    void stop();
+    json11::Json to_json() const;
+    // sd_notify(3) without libsystemd, false if not under systemd
+    static bool notify(const std::string &state);
+private:
+    struct loop {
+        boost::asio::io_service *io;
+        std::atomic<int64_t> posted_us;     // of the probe in flight, 0 none
+        std::atomic<int64_t> delay_us;
+        std::atomic<int64_t> max_delay_us;
+        std::atomic<bool> stalled;
+        std::atomic<unsigned long> stalls;
+    };
+    void run();
+    void probe(loop &l);
+    void check_backend();
+    std::vector<std::string> problems() const;
+    BCM2835 &backend;
+    const PeriodicTask *automode;
+    unsigned interval_ms;
+    unsigned stall_ms;
+    bool probing;
+    bool systemd;
+    bool pinging;           // the systemd watchdog is ours, WATCHDOG_PID
+    std::vector<std::unique_ptr<loop>> loops;
+    std::atomic<int64_t> probe_us;
+    std::atomic<int64_t> max_probe_us;
+    std::atomic<unsigned long> pings;
+    // backend reinit backoff, first loop only
+    int64_t next_reinit_us;
+    unsigned backoff_ms;
+    std::mutex mtx;
+    std::condition_variable cv;
+    bool stopping;
+    std::thread thread;
+};
+
+#endif
@@ -35,7 +35,9 @@
 //
 
 #include <syslog.h>
+#include <pthread.h>
 
+#include <cstring>
 #include <ctime>
 
 #include <iostream>
@@ -44,6 +46,10 @@
 #include <string>
 #include <vector>
 #include <chrono>
+#include <iomanip>
+#include <memory>
+#include <thread>
+#include <unordered_map>
 
 #include "config.h"
 
@@ -58,6 +64,26 @@
 #include "PeriodicTask.h"
 
 #include "BCM2835.h"
+#include "ListCache.h"
+#include "Scenes.h"
+#include "Inputs.h"
+#include "Sensors.h"
+#include "ControlLoops.h"
+#include "Simulation.h"
+#include "History.h"
+#include "Aggregator.h"
+#include "Mqtt.h"
+#include "Tracer.h"
+#include "RateLimiter.h"
+#include "Auth.h"
+#include "Arbiter.h"
+#include "CommandQueue.h"
+#include "StaticFiles.h"
+#include "Arena.h"
+#include "Recorder.h"
+#include "Cbor.h"
+#include "PCA9685.h"
+#include "Watchdog.h"
 
 using namespace nghttp2::asio_http2;
 using namespace nghttp2::asio_http2::server;
@@ -71,6 +97,442 @@ static std::function<ssize_t(uint8_t *buf, std::size_t buf_len, uint32_t *data_f
   };
 }
 
+static std::function<ssize_t(uint8_t *buf, std::size_t buf_len, uint32_t *data_flags)> createGeneratorCb(std::shared_ptr<const std::string> str) {
+  auto offset = std::make_shared<std::size_t>(0);
+  return [str, offset](uint8_t *buf, std::size_t buf_len, uint32_t *data_flags) -> ssize_t {
+    std::size_t tx_len = std::min(buf_len, str->size()-*offset);
+    std::copy_n(str->data()+*offset, tx_len, buf);
+    *offset += tx_len;
+    if(*offset==str->size()) *data_flags |= NGHTTP2_DATA_FLAG_EOF;
+    return tx_len;
+  };
+}
+
+// straight from the mapping into the DATA frames, no copy of the file
+static std::function<ssize_t(uint8_t *buf, std::size_t buf_len, uint32_t *data_flags)> createGeneratorCb(std::shared_ptr<const StaticFiles::mapping> m) {
+  auto offset = std::make_shared<std::size_t>(0);
+  return [m, offset](uint8_t *buf, std::size_t buf_len, uint32_t *data_flags) -> ssize_t {
+    std::size_t tx_len = std::min(buf_len, m->size-*offset);
+    std::copy_n(m->data+*offset, tx_len, buf);
+    *offset += tx_len;
+    if(*offset==m->size) *data_flags |= NGHTTP2_DATA_FLAG_EOF;
+    return tx_len;
+  };
+}
+
+// a part of a string split by split_parts(), no copy of its characters
+typedef boost::iterator_range<std::string::const_iterator> part;
+
+// s split at any of seps, in the request's arena. the parts point into s:
+// "/v1/switch/3" by "/" is "", "v1", "switch", "3"
+static Arena::vector<part> split_parts(const std::string &s, const char *seps) {
+  Arena::vector<part> parts;
+  boost::split(parts, s, boost::is_any_of(seps));
+  return parts;
+}
+
+static std::string str(const part &p) {
+  return std::string(p.begin(), p.end());
+}
+
+// value of key in a raw query string like "a=1&since=42", "" if not present
+static std::string query_param(const std::string &raw_query, const std::string &key) {
+  for(auto &p: split_parts(raw_query, "&")) {
+    auto eq = std::find(p.begin(), p.end(), '=');
+    if(boost::equals(boost::make_iterator_range(p.begin(), eq), key)) return eq==p.end() ? "" : percent_decode(std::string(eq+1, p.end()));
+  }
+  return "";
+}
+
+static bool etag_matches(const header_map &h, const std::string &etag) {
+  auto it = h.find("if-none-match");
+  if(it==h.end()) return false;
+  for(auto t: split_parts(it->second.value, ",")) {
+    t = boost::trim_copy(t);
+    if(boost::starts_with(t, "W/")) t.advance_begin(2);
+    if(boost::equals(t, etag) || boost::equals(t, "*")) return true;
+  }
+  return false;
+}
+
+// CBOR request body and reply, negotiated() records them per response from
+// content-type and accept. JSON, the default, has no entry
+enum { CBOR_IN = 1, CBOR_OUT = 2 };
+static thread_local std::unordered_map<const response *, unsigned> formats;
+
+static unsigned format(const response &res) {
+  if(formats.empty()) return 0;
+  auto it = formats.find(&res);
+  return it==formats.end() ? 0 : it->second;
+}
+
+static const char *content_type(const response &res) {
+  return format(res)&CBOR_OUT ? "application/cbor" : "application/json";
+}
+
+// the reply document in the format negotiated for res
+static std::string encode(const response &res, const json11::Json &doc) {
+  if(!(format(res)&CBOR_OUT)) {
+    std::string out = doc.dump();
+    syslog(LOG_DEBUG, "returning response: %s", out.c_str());
+    return out;
+  }
+  if(setlogmask(0) & LOG_MASK(LOG_DEBUG)) syslog(LOG_DEBUG, "returning cbor response: %s", doc.dump().c_str());
+  return Cbor::encode(doc);
+}
+
+static json11::Json parse_body(const response &res, const std::string &raw_body, std::string &err) {
+  if(format(res)&CBOR_IN) return Cbor::decode(raw_body, err);
+  return json11::Json::parse(raw_body, err);
+}
+
+// the state version counts from 1 again when the server restarts, so the
+// /v1/list etags and since= carry the start of this run as well:
+// "<boot>-<version>", the CBOR etag with "-cbor" appended
+static uint64_t boot_id;
+
+// since= of a long poll, "<boot>-<version>" like the etag, false if it is
+// no such thing. a version of another run, or a bare one, is taken as 0,
+// i.e. the client is answered with the current state right away
+static bool parse_since(const std::string &s, uint64_t &version) {
+  char *end;
+  uint64_t first = std::strtoull(s.c_str(), &end, 10);
+  if(end==s.c_str()) return false;
+  if(*end=='\0') {
+    version = 0;
+    return true;
+  }
+  if(*end!='-') return false;
+  const char *v = end+1;
+  version = std::strtoull(v, &end, 10);
+  if(end==v || (*end!='\0' && std::strcmp(end, "-cbor"))) return false;
+  if(first!=boot_id) version = 0;
+  return true;
+}
+
+// a shard's /v1/list body per representation, the JSON one also serves
+// the long polls
+struct list_bodies {
+  ListCache json;
+  ListCache cbor;
+};
+
+static void reply_list(const response &res, list_bodies &lists, const header_map &req_header) {
+  uint64_t version;
+  bool cbor = format(res)&CBOR_OUT;
+  auto body = (cbor ? lists.cbor : lists.json).get(version);
+  // the representations differ, so do their etags; since= takes either
+  std::string etag = "\"" + std::to_string(boot_id) + "-" + std::to_string(version) + (cbor ? "-cbor" : "") + "\"";
+  if(etag_matches(req_header, etag)) {
+    syslog(LOG_DEBUG, "list version %s not modified, returning 304 Not modified", etag.c_str());
+    res.write_head(304, {
+      {"etag", {etag, false}},
+      {"vary", {"accept", false}},
+      {"Access-Control-Allow-Origin", {"*", false}},
+      {"Access-Control-Expose-Headers", {"etag", false}}
+    });
+    res.end();
+    return;
+  }
+  res.write_head(200, {
+    {"content-type", {content_type(res), false}},
+    {"content-length", {std::to_string(body->size()), false}},
+    {"etag", {etag, false}},
+    {"vary", {"accept", false}},
+    {"Access-Control-Allow-Origin", {"*", false}},
+    {"Access-Control-Expose-Headers", {"etag", false}}
+  });
+  if(!cbor) syslog(LOG_DEBUG, "returning response: %s", body->c_str());
+  res.end(createGeneratorCb(body));
+}
+
+// a file of the static manifest in the best encoding the client accepts.
+// the etag differs per encoding, they are different representations
+static void reply_static(const request &req, const response &res, const StaticFiles::file &f) {
+  auto accept = req.header().find("accept-encoding");
+  std::string encoding;
+  auto m = StaticFiles::select(f, accept!=req.header().end() ? accept->second.value : "", encoding);
+  std::string etag = encoding=="" ? f.etag : f.etag.substr(0, f.etag.size()-1) + "-" + encoding + "\"";
+  header_map h {
+    {"etag", {etag, false}},
+    {"cache-control", {f.immutable ? "public, max-age=31536000, immutable" : "no-cache", false}}
+  };
+  if(f.gz || f.br) h.emplace("vary", header_value{"accept-encoding", false});
+  if(etag_matches(req.header(), etag)) {
+    res.write_head(304, std::move(h));
+    res.end();
+    return;
+  }
+  h.emplace("content-type", header_value{f.mime, false});
+  h.emplace("content-length", header_value{std::to_string(m->size), false});
+  if(encoding!="") h.emplace("content-encoding", header_value{encoding, false});
+  res.write_head(200, std::move(h));
+  res.end(createGeneratorCb(m));
+}
+
+// collects the request body and calls cb with it once complete
+static void on_body(const request &req, std::function<void(const std::string &)> cb) {
+  auto ostr = std::make_shared<std::ostringstream>();
+  auto rec = Recorder::current();
+  req.on_data([ostr, cb, rec](const uint8_t *data, std::size_t len) {
+    if(len>0) {
+      ostr->write((const char *)data, len);
+      return;
+    }
+    syslog(LOG_DEBUG, "PUT data: %s", ostr->str().c_str());
+    Recorder::body(rec, ostr->str());
+    cb(ostr->str());
+  });
+}
+
+static void reply_error(const response &res, unsigned status, int code, const std::string &category, const std::string &message) {
+  res.write_head(status, {
+    {"content-type", {content_type(res), false}},
+    {"Access-Control-Allow-Origin", {"*", false}}
+  });
+  json11::Json r = json11::Json::object {
+    {
+      "error", json11::Json::object {
+        { "code", code },
+        { "category", category },
+        { "message", message }
+      }
+    }
+  };
+  res.end(encode(res, r));
+}
+
+static void reply_json(const response &res, const json11::Json &response, const json11::Json &request = json11::Json(), unsigned status = 200) {
+  res.write_head(status, {
+    {"content-type", {content_type(res), false}},
+    {"Access-Control-Allow-Origin", {"*", false}}
+  });
+  json11::Json::object r {
+    {
+      "error", json11::Json::object {
+        { "code", 0 }
+      }
+    },
+    { "response", response }
+  };
+  if(!request.is_null()) r["request"] = request;
+  res.end(encode(res, r));
+}
+
+static void reply_options(const response &res, const std::string &methods) {
+  res.write_head(204, {
+    {"content-length", {"0", false}},
+    {"allow", {methods, false}},
+    {"Access-Control-Allow-Origin", {"*", false}},
+    {"Access-Control-Allow-Methods", {methods, false}},
+    {"Access-Control-Allow-Headers", {"*", false}}
+  });
+  res.end();
+}
+
+// res.on_close() keeps a single callback, so the wrappers and handlers add
+// theirs to a chain per response with add_on_close()
+static thread_local std::unordered_map<const response *, std::vector<close_cb>> close_chains;
+
+// shard of the calling server thread, it picks the shard's own caches.
+// always 0 unless sharded
+static thread_local unsigned shard_index = 0;
+
+static void add_on_close(const response &res, close_cb cb) {
+  auto it = close_chains.find(&res);
+  if(it==close_chains.end()) {
+    it = close_chains.emplace(&res, std::vector<close_cb>()).first;
+    res.on_close([&res](uint32_t error_code) {
+      auto it = close_chains.find(&res);
+      if(it == close_chains.end()) return;
+      auto chain = std::move(it->second);
+      close_chains.erase(it);
+      for(auto &cb: chain) cb(error_code);
+    });
+  }
+  it->second.push_back(cb);
+}
+
+// picks JSON or CBOR for the request body and the reply. an ESP32 wall panel
+// sends accept: application/cbor and gets the same documents, smaller
+static request_cb negotiated(request_cb handler) {
+  return [handler](const request &req, const response &res) {
+    unsigned f = 0;
+    auto it = req.header().find("content-type");
+    if(it!=req.header().end() && boost::starts_with(it->second.value, "application/cbor")) f |= CBOR_IN;
+    it = req.header().find("accept");
+    if(it!=req.header().end() && it->second.value.find("application/cbor")!=std::string::npos) f |= CBOR_OUT;
+    if(f) {
+      formats[&res] = f;
+      add_on_close(res, [&res](uint32_t error_code) {
+        (void)error_code;
+        formats.erase(&res);
+      });
+    }
+    handler(req, res);
+  };
+}
+
+// admission control in front of a handler: requests over the client's rate
+// or the stream caps are answered right away, before their body is read
+static request_cb limited(RateLimiter &limiter, request_cb handler) {
+  if(!limiter.enabled()) return handler;
+  return [&limiter, handler](const request &req, const response &res) {
+    bool write = req.method() == "PUT" || req.method() == "POST" || req.method() == "DELETE";
+    std::string client = req.remote_endpoint().address().to_string();
+    unsigned slot, retry_after;
+    auto v = limiter.admit(client, write ? RateLimiter::WRITE : RateLimiter::READ, slot, retry_after);
+    if(v != RateLimiter::OK) {
+      bool rate = v == RateLimiter::RATE_LIMITED;
+      syslog(LOG_INFO, "%s %s from %s: %s, returning %d", req.method().c_str(), req.uri().path.c_str(), client.c_str(), rate ? "rate limited" : "too many streams", rate ? 429 : 503);
+      res.write_head(rate ? 429 : 503, {
+        {"content-type", {content_type(res), false}},
+        {"retry-after", {std::to_string(retry_after), false}},
+        {"Access-Control-Allow-Origin", {"*", false}}
+      });
+      json11::Json r = json11::Json::object {
+        {
+          "error", json11::Json::object {
+            { "code", 5 },
+            { "category", rate ? "rate limited" : "too many streams" },
+            { "message", "retry after " + std::to_string(retry_after) + " seconds" }
+          }
+        }
+      };
+      res.end(encode(res, r));
+      return;
+    }
+    add_on_close(res, [&limiter, slot](uint32_t error_code) {
+      (void)error_code;
+      limiter.release(slot);
+    });
+    handler(req, res);
+  };
+}
+
+// the synchronous part of a handler allocates its temporaries from the
+// thread's arena, rewound when it returns
+static request_cb scoped(request_cb handler) {
+  return [handler](const request &req, const response &res) {
+    Arena::scope scope;
+    handler(req, res);
+  };
+}
+
+// with --record, requests are captured ahead of the admission control, so
+// a replay offers the load the server got, not the load it admitted
+static request_cb recorded(Recorder &recorder, request_cb handler) {
+  if(!recorder.enabled()) return handler;
+  return [&recorder, handler](const request &req, const response &res) {
+    std::string path = req.uri().raw_path;
+    if(req.uri().raw_query!="") path += "?" + req.uri().raw_query;
+    Recorder::ptr &current = Recorder::current();
+    current = recorder.begin(req.method(), path);
+    handler(req, res);
+    // body readers hold on to it, the others are written now
+    current = nullptr;
+  };
+}
+
+// authentication in front of a handler: requests without the permission
+// for method and path are answered with 401 or 403 before their body is read
+static request_cb authorized(Auth &auth, request_cb handler) {
+  if(!auth.enabled()) return handler;
+  return [&auth, handler](const request &req, const response &res) {
+    auto it = req.header().find("authorization");
+    auto v = auth.check(req.method(), req.uri().path, it!=req.header().end() ? it->second.value : "");
+    if(v != Auth::ALLOWED) {
+      bool unauthenticated = v == Auth::UNAUTHENTICATED;
+      syslog(LOG_INFO, "%s %s from %s: %s, returning %d", req.method().c_str(), req.uri().path.c_str(), req.remote_endpoint().address().to_string().c_str(), unauthenticated ? "not authenticated" : "forbidden", unauthenticated ? 401 : 403);
+      header_map h {
+        {"content-type", {content_type(res), false}},
+        {"Access-Control-Allow-Origin", {"*", false}}
+      };
+      if(unauthenticated) h.emplace("www-authenticate", header_value { "Bearer realm=\"lightsrv\"", false });
+      res.write_head(unauthenticated ? 401 : 403, h);
+      json11::Json r = json11::Json::object {
+        {
+          "error", json11::Json::object {
+            { "code", 6 },
+            { "category", unauthenticated ? "not authenticated" : "forbidden" },
+            { "message", unauthenticated ? "a valid bearer token is required" : "the token does not permit " + req.method() + " " + req.uri().path }
+          }
+        }
+      };
+      res.end(encode(res, r));
+      return;
+    }
+    handler(req, res);
+  };
+}
+
+// for replies produced on another thread: the returned function runs its
+// argument on the io_service of res, unless the stream was closed meanwhile
+static std::function<void(std::function<void()>)> deferred(const response &res) {
+  auto closed = std::make_shared<bool>(false);
+  add_on_close(res, [closed](uint32_t error_code) {
+    (void)error_code;
+    *closed = true;
+  });
+  boost::asio::io_service &io = res.io_service();
+  return [&io, closed](std::function<void()> fn) {
+    io.post([closed, fn]() {
+      if(!*closed) fn();
+    });
+  };
+}
+
+// for the subsystems on the first io_service that have no locks, Scenes
+// and Inputs: fn runs there, the reply it returns back on the thread of res.
+// with shards or threads>1 the handlers run on other threads
+static void run_on(boost::asio::io_service &io, const response &res, std::function<std::function<void()>()> fn) {
+  auto reply = deferred(res);
+  io.post([fn, reply]() { reply(fn()); });
+}
+
+// starts a trace of req if tracing is on, with the client's x-request-id
+static Tracer::ptr begin_trace(Tracer &tracer, const request &req) {
+  if(!tracer.enabled()) return nullptr;
+  auto it = req.header().find("x-request-id");
+  return tracer.begin(req.method(), req.uri().path, it!=req.header().end() ? it->second.value : "");
+}
+
+// the API's claim on a channel it is about to write: "lock": true until
+// released, "hold": seconds, the default hold otherwise. replies 409 if a
+// source with a higher priority holds the channel
+static bool claimed(BCM2835 &backend, Arbiter *arbiter, const response &res, BCM2835::change::kind_t kind, unsigned channel, const json11::Json &body) {
+  if(!arbiter) return true;
+  time_t now = backend.now();
+  time_t hold = body["lock"].bool_value() ? Arbiter::FOREVER : body["hold"].number_value()>=1 ? (time_t)body["hold"].number_value() : 0;
+  if(arbiter->claim(kind, channel, BCM2835::API, hold, now)) return true;
+  auto h = arbiter->get(kind, channel, now);
+  std::string until = h.until==Arbiter::FOREVER ? "until released" : "for another " + std::to_string(h.until-now) + " seconds";
+  syslog(LOG_INFO, "channel %u held by %s %s, returning 409", channel, Arbiter::source_name(h.source), until.c_str());
+  reply_error(res, 409, 7, "conflict", std::string("channel held by ") + Arbiter::source_name(h.source) + " " + until);
+  return false;
+}
+
+// a write to hardware that is gone would be dropped, directly or later by
+// the queue, and a read would get the last written value, both answered as
+// if nothing was wrong; replies 503 instead
+static bool reachable(const BCM2835 &backend, const response &res, BCM2835::change::kind_t kind, unsigned channel) {
+  if(backend.available(kind, channel)) return true;
+  syslog(LOG_INFO, "%s channel %u not available, returning 503", kind==BCM2835::change::SWITCH ? "switch" : "pwm", channel);
+  reply_error(res, 503, 8, "unavailable", "hardware not available, see /v1/health");
+  return false;
+}
+
+// /v1/list, or 503 while any of the hardware is gone
+static void reply_state(const BCM2835 &backend, const response &res, list_bodies &lists, const header_map &req_header) {
+  BCM2835::health_t h = backend.health();
+  if(h.gpio && (!h.has_expander || h.expander)) {
+    reply_list(res, lists, req_header);
+    return;
+  }
+  syslog(LOG_INFO, "hardware not available, returning 503 for the list");
+  reply_error(res, 503, 8, "unavailable", "hardware not available, see /v1/health");
+}
+
 static std::string parse_json_arry(const std::vector<unsigned int> &vec, const std::string &arg, const std::string &prefix) {
   if(arg!="") {
     std::string err;
@@ -96,11 +558,20 @@ static std::string parse_json_arry(const std::vector<unsigned int> &vec, const s
 
 int main(int argc, char *argv[]) {
   auto time_server_start = std::time(nullptr);
+  boot_id = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
 
   boost::program_options::options_description generic("Cmdline options");
   generic.add_options()
     ("help,h", "produce help message")
     ("config,C", boost::program_options::value<std::string>()->default_value("lightsrv.conf"), "config file")
+    ("simulate", boost::program_options::value<std::string>(), "replay automode for day, week, year or N seconds against the mockup backend and print the timeline, then exit")
+    ("sim-start", boost::program_options::value<std::string>(), "simulation start, YYYY-MM-DD local time, default today")
+    ("sim-step", boost::program_options::value<unsigned>(), "simulated seconds per automode tick, default interval")
+    ("sim-format", boost::program_options::value<std::string>()->default_value("csv"), "simulation output format: csv or json")
+    ("issue-token", boost::program_options::value<std::string>(), "print a token signed with auth-secret-file for the given claims (JSON object), then exit")
+    ("token-ttl", boost::program_options::value<unsigned>()->default_value(365*24*3600), "seconds an issued token is valid unless the claims set exp")
+    ("record", boost::program_options::value<std::string>(), "capture the requests with their timing to this file, for lightsrv-replay")
+    ("record-max", boost::program_options::value<unsigned>()->default_value(64), "MB after which recording stops, 0 is unlimited")
   ;
 
   // Declare the supported options.
@@ -114,12 +585,66 @@ int main(int argc, char *argv[]) {
     ("cert,c", boost::program_options::value<std::string>()->default_value("cert.pem"), "cert file")
     ("debug,d", "enable debug logging")
     ("auto,a", "backend: enable automatic mode")
+    ("mockup", "backend: do not touch the gpio hardware, e.g. to run several instances on one machine")
     ("interval,i", boost::program_options::value<unsigned>()->default_value(60), "set compression level")
     ("switch,s", boost::program_options::value<std::string>()->default_value(""), "set switch gpio channels")
     ("pwm,w", boost::program_options::value<std::string>()->default_value(""), "set pwm gpio channels")
+    ("pca9685", boost::program_options::value<std::string>()->default_value(""), "PCA9685 i2c pwm expander, device:address, e.g. /dev/i2c-1:0x40, empty disables")
+    ("pca9685-pwms", boost::program_options::value<unsigned>()->default_value(16), "expander outputs used as pwm channels, numbered after the gpio pwm channels")
+    ("pca9685-frequency", boost::program_options::value<unsigned>()->default_value(1000), "pwm frequency of the expander in Hz, 24 to 1526")
     ("switch-names", boost::program_options::value<std::string>()->default_value(""), "set switch names (JSON array of strings)")
     ("pwm-names", boost::program_options::value<std::string>()->default_value(""), "set pwm names (JSON array of strings)")
     ("inverted,I", "switch channels inverted logic")
+    ("groups", boost::program_options::value<std::string>()->default_value(""), "switch channel groups (JSON object of channel arrays)")
+    ("scenes", boost::program_options::value<std::string>()->default_value(""), "scene definitions (JSON object)")
+    ("scene-file", boost::program_options::value<std::string>()->default_value(""), "file scene definitions are loaded from and stored to")
+    ("fade-step", boost::program_options::value<unsigned>()->default_value(50), "milliseconds between two steps of a scene crossfade")
+    ("inputs", boost::program_options::value<std::string>()->default_value(""), "gpio input channels (JSON array of input objects)")
+    ("gpiochip", boost::program_options::value<std::string>()->default_value("/dev/gpiochip0"), "gpio character device for the input channels")
+    ("sensors", boost::program_options::value<std::string>()->default_value(""), "sensors to sample (JSON array of sensor objects)")
+    ("control", boost::program_options::value<std::string>()->default_value(""), "closed control loops from sensors to switches/pwms (JSON array of loop objects)")
+    ("latitude", boost::program_options::value<double>(), "latitude for solar schedule events, degrees north")
+    ("longitude", boost::program_options::value<double>(), "longitude for solar schedule events, degrees east")
+    ("schedule", boost::program_options::value<std::string>()->default_value(""), "automode switch schedule (JSON array of rule objects), replaces the built in one")
+    ("history-file", boost::program_options::value<std::string>()->default_value(""), "file the state change history and usage rollups are kept in, empty disables them")
+    ("history-events", boost::program_options::value<unsigned>()->default_value(100000), "number of state changes kept in the history file")
+    ("history-days", boost::program_options::value<unsigned>()->default_value(400), "number of days usage rollups are kept in the history file")
+    ("switch-watts", boost::program_options::value<std::string>()->default_value(""), "power draw of each switch channel in watts (JSON array), for energy estimates")
+    ("pwm-watts", boost::program_options::value<std::string>()->default_value(""), "power draw of each pwm channel at full duty in watts (JSON array), for energy estimates")
+    ("peers", boost::program_options::value<std::string>()->default_value(""), "aggregator mode: peer lightsrv instances (JSON array of peer objects)")
+    ("peer-timeout", boost::program_options::value<unsigned>()->default_value(2000), "milliseconds to wait for a peer's answer")
+    ("peer-ca", boost::program_options::value<std::string>()->default_value(""), "CA file to verify the peers' certificates with, empty accepts any")
+    ("mqtt-broker", boost::program_options::value<std::string>()->default_value(""), "MQTT broker to publish state to and take commands from, host[:port], empty disables")
+    ("mqtt-prefix", boost::program_options::value<std::string>()->default_value("lightsrv"), "MQTT topic prefix")
+    ("mqtt-client-id", boost::program_options::value<std::string>()->default_value(""), "MQTT client id, default lightsrv-<hostname>")
+    ("mqtt-user", boost::program_options::value<std::string>()->default_value(""), "MQTT user name")
+    ("mqtt-password", boost::program_options::value<std::string>()->default_value(""), "MQTT password")
+    ("mqtt-keepalive", boost::program_options::value<unsigned>()->default_value(30), "MQTT keepalive in seconds, 0 disables it")
+    ("mqtt-batch", boost::program_options::value<unsigned>()->default_value(50), "milliseconds state changes are collected before they are published")
+    ("trace-buffer", boost::program_options::value<unsigned>()->default_value(256), "number of request traces kept for /v1/debug/traces")
+    ("trace-sample", boost::program_options::value<unsigned>()->default_value(0), "keep the trace of every Nth request, 0 disables sampling")
+    ("trace-slow", boost::program_options::value<unsigned>()->default_value(0), "always keep traces of requests taking at least this many milliseconds, 0 disables")
+    ("rate-read", boost::program_options::value<double>()->default_value(0), "GET requests per second and client, 0 is unlimited")
+    ("burst-read", boost::program_options::value<double>()->default_value(20), "GET requests a client may send at once")
+    ("rate-write", boost::program_options::value<double>()->default_value(0), "PUT/POST requests per second and client, 0 is unlimited")
+    ("burst-write", boost::program_options::value<double>()->default_value(10), "PUT/POST requests a client may send at once")
+    ("max-streams", boost::program_options::value<unsigned>()->default_value(0), "requests in flight at most, a quarter of them reserved for writes, 0 is unlimited")
+    ("client-streams", boost::program_options::value<unsigned>()->default_value(0), "requests in flight per client at most, 0 is unlimited")
+    ("limiter-clients", boost::program_options::value<unsigned>()->default_value(1024), "clients tracked by the rate limiter")
+    ("auth-secret-file", boost::program_options::value<std::string>()->default_value(""), "file with the secret bearer tokens are signed with, empty disables tokens")
+    ("auth-anonymous", boost::program_options::value<std::string>()->default_value("{\"read\": true}"), "permissions of requests without credentials when authentication is on (JSON object)")
+    ("client-ca", boost::program_options::value<std::string>()->default_value(""), "CA file client certificates are verified with, requires one on every connection, empty disables")
+    ("client-certs", boost::program_options::value<std::string>()->default_value(""), "SHA-256 fingerprints of the accepted client certificates (JSON array), empty accepts all signed by client-ca")
+    ("client-cert-permissions", boost::program_options::value<std::string>()->default_value("{\"read\": true}"), "permissions of connections with a valid client certificate (JSON object)")
+    ("auth-cache", boost::program_options::value<unsigned>()->default_value(256), "verified tokens and certificates cached")
+    ("override-hold", boost::program_options::value<unsigned>()->default_value(7200), "seconds a manual change keeps automode and lower priority sources off its channel, 0 disables arbitration")
+    ("source-priorities", boost::program_options::value<std::string>()->default_value(""), "priorities of api, auto, scene, input, control and mqtt for the arbitration (JSON object)")
+    ("shards", boost::program_options::value<unsigned>()->default_value(0), "sharded mode: this many single threaded servers on the same port (SO_REUSEPORT), replaces threads, 0 or 1 disables")
+    ("shard-affinity", "sharded mode: pin shard n to CPU n")
+    ("max-update-rate", boost::program_options::value<double>()->default_value(50), "hardware updates per second for switch/pwm PUTs, newer values replace queued ones, 0 writes each one directly")
+    ("longpoll-timeout", boost::program_options::value<unsigned>()->default_value(30), "max seconds a /v1/list?since= request is parked")
+    ("watchdog-interval", boost::program_options::value<unsigned>()->default_value(1000), "milliseconds between two event loop and hardware probes, also the systemd watchdog ping, 0 disables the probes but not the ping")
+    ("watchdog-stall", boost::program_options::value<unsigned>()->default_value(5000), "milliseconds a probe may wait for its event loop before the loop counts as stalled and systemd is no longer pinged")
   ;
 
   boost::program_options::options_description cmdline_options;
@@ -166,6 +691,19 @@ int main(int argc, char *argv[]) {
   bool has_auto_mode = vm.count("auto")>0;
   unsigned auto_interval = vm["interval"].as<unsigned>();
   bool inverted = vm.count("inverted")>0;
+  unsigned longpoll_timeout = vm["longpoll-timeout"].as<unsigned>();
+  std::string groups_json = vm["groups"].as<std::string>();
+  std::string scenes_json = vm["scenes"].as<std::string>();
+  std::string scene_file = vm["scene-file"].as<std::string>();
+  unsigned fade_step = vm["fade-step"].as<unsigned>();
+  std::string inputs_json = vm["inputs"].as<std::string>();
+  std::string gpiochip = vm["gpiochip"].as<std::string>();
+  std::string sensors_json = vm["sensors"].as<std::string>();
+  std::string control_json = vm["control"].as<std::string>();
+  std::string history_file = vm["history-file"].as<std::string>();
+  unsigned history_events = vm["history-events"].as<unsigned>();
+  unsigned history_days = vm["history-days"].as<unsigned>();
+  std::string peers_json = vm["peers"].as<std::string>();
   std::vector<std::string> switches_str;
   if(vm["switch"].as<std::string>()!="") boost::split(switches_str, vm["switch"].as<std::string>(), boost::is_any_of(","));
   std::vector<std::string> pwms_str;
@@ -179,60 +717,351 @@ int main(int argc, char *argv[]) {
   pwms.resize(pwms_str.size());
   std::transform(pwms_str.begin(), pwms_str.end(), pwms.begin(), [](const std::string &s){  return std::stoi(s); });
 
+  // the expander's outputs are pwm channels following the gpio ones
+  std::string pca9685 = vm["pca9685"].as<std::string>();
+  unsigned expander_pwms = pca9685!="" ? std::min(vm["pca9685-pwms"].as<unsigned>(), PCA9685::max_channels) : 0;
+  std::vector<unsigned> pwm_channels = pwms;
+  pwm_channels.resize(pwms.size()+expander_pwms);
+
   std::string switch_names = parse_json_arry(switches, vm["switch-names"].as<std::string>(), "Switch ");
-  std::string pwm_names = parse_json_arry(pwms, vm["pwm-names"].as<std::string>(), "PWM ");
+  std::string pwm_names = parse_json_arry(pwm_channels, vm["pwm-names"].as<std::string>(), "PWM ");
   syslog(LOG_DEBUG, "switch_names: %s", switch_names.c_str());
   syslog(LOG_DEBUG, "pwm_names: %s", pwm_names.c_str());
 
+  std::vector<double> switch_watts(switches.size(), 0), pwm_watts(pwm_channels.size(), 0);
+  for(auto w: { std::make_pair("switch-watts", &switch_watts), std::make_pair("pwm-watts", &pwm_watts) }) {
+    if(vm[w.first].as<std::string>()=="") continue;
+    std::string err;
+    json11::Json a = json11::Json::parse(vm[w.first].as<std::string>(), err);
+    if(!err.empty()) syslog(LOG_ERR, "%s argument seems to be no valid json: %s", w.first, err.c_str());
+    for(std::size_t i=0; i<a.array_items().size() && i<w.second->size(); i++) (*w.second)[i] = a[i].number_value();
+  }
+
+  Schedule schedule;
+  if(vm.count("latitude") && vm.count("longitude")) {
+    schedule.set_location(vm["latitude"].as<double>(), vm["longitude"].as<double>());
+  }
+  if(vm["schedule"].as<std::string>()!="") {
+    std::string err;
+    json11::Json rules = json11::Json::parse(vm["schedule"].as<std::string>(), err);
+    for(auto &r: rules.array_items()) {
+      if(!err.empty()) break;
+      if(!r["switch"].is_number() || (unsigned)r["switch"].int_value()>=switches.size()) err = "invalid switch channel in rule " + r.dump();
+      else schedule.add_rule(r["switch"].int_value(), r["on"].string_value(), r["off"].string_value(), r["days"].string_value(), r["dates"].string_value(), err);
+    }
+    if(!err.empty()) {
+      syslog(LOG_ERR, "schedule argument ignored: %s", err.c_str());
+      schedule = Schedule();
+    }
+  }
+
+  Auth auth { vm["auth-cache"].as<unsigned>() };
+  {
+    // authentication fails closed: a broken setting stops the server
+    // instead of leaving it open
+    std::string secret_file = vm["auth-secret-file"].as<std::string>(), err;
+    json11::Json anonymous = json11::Json::parse(vm["auth-anonymous"].as<std::string>(), err);
+    if(err.empty() && (secret_file!="" || vm["client-ca"].as<std::string>()!="")) auth.configure(secret_file, anonymous, err);
+    if(err.empty() && vm["client-ca"].as<std::string>()!="" && port=="80") err = "client-ca needs TLS";
+    if(err.empty() && vm["client-ca"].as<std::string>()!="") {
+      json11::Json cert_permissions = json11::Json::parse(vm["client-cert-permissions"].as<std::string>(), err);
+      std::vector<std::string> fingerprints;
+      if(err.empty() && vm["client-certs"].as<std::string>()!="") {
+        json11::Json f = json11::Json::parse(vm["client-certs"].as<std::string>(), err);
+        for(auto &fp: f.array_items()) fingerprints.push_back(fp.string_value());
+      }
+      if(err.empty()) auth.set_client_certs(cert_permissions, fingerprints);
+    }
+    if(!err.empty()) {
+      syslog(LOG_ERR, "invalid authentication settings: %s", err.c_str());
+      std::cerr << "invalid authentication settings: " << err << std::endl;
+      return 1;
+    }
+  }
+
+  if(vm.count("issue-token")) {
+    std::string err, token;
+    json11::Json claims = json11::Json::parse(vm["issue-token"].as<std::string>(), err);
+    if(err.empty() && !claims.is_object()) err = "claims must be a JSON object";
+    if(err.empty()) auth.issue(claims.object_items(), vm["token-ttl"].as<unsigned>(), token, err);
+    if(!err.empty()) {
+      std::cerr << "cannot issue token: " << err << std::endl;
+      return 1;
+    }
+    std::cout << token << std::endl;
+    return 0;
+  }
+
+  if(vm.count("simulate")) {
+    time_t span = simulation_span(vm["simulate"].as<std::string>());
+    if(!span) {
+      std::cerr << "invalid simulation span " << vm["simulate"].as<std::string>() << std::endl;
+      return 1;
+    }
+    time_t start = std::time(nullptr);
+    tm start_tm;
+    localtime_r(&start, &start_tm);
+    if(vm.count("sim-start")) {
+      std::istringstream in(vm["sim-start"].as<std::string>());
+      in >> std::get_time(&start_tm, "%Y-%m-%d");
+      if(in.fail()) {
+        std::cerr << "invalid simulation start " << vm["sim-start"].as<std::string>() << std::endl;
+        return 1;
+      }
+    }
+    start_tm.tm_hour = start_tm.tm_min = start_tm.tm_sec = 0;
+    start_tm.tm_isdst = -1;
+    start = mktime(&start_tm);
+    unsigned step = vm.count("sim-step") ? vm["sim-step"].as<unsigned>() : auto_interval;
+
+    // only warnings and worse, the per tick logging would dominate otherwise
+    setlogmask(LOG_UPTO(LOG_WARNING));
+    BCM2835 backend { switches, pwms, true, inverted, false };
+    backend.set_mockup(true);
+    if(!schedule.empty()) backend.set_schedule(schedule);
+    backend.setup();
+    int ret = simulate(backend, start, start+span, step, vm["sim-format"].as<std::string>(), std::cout);
+    closelog();
+    return ret;
+  }
+
   try {
     BCM2835 backend { switches, pwms, has_auto_mode, inverted, debug };
+    backend.set_mockup(vm.count("mockup")>0);
+    if(!schedule.empty()) backend.set_schedule(schedule);
+    std::unique_ptr<PCA9685> expander;
+    if(expander_pwms) {
+      std::string err;
+      std::unique_ptr<PCA9685::bus> bus;
+      auto colon = pca9685.rfind(':');
+      if(vm.count("mockup")) bus = PCA9685::mock();
+      else if(colon==std::string::npos) err = "no address in " + pca9685;
+      else {
+        std::string a = pca9685.substr(colon+1);
+        char *end;
+        unsigned long address = std::strtoul(a.c_str(), &end, 0);
+        if(a.empty() || *end || address>0x7f) err = "invalid i2c address " + a + " in " + pca9685;
+        else bus = PCA9685::i2c_dev(pca9685.substr(0, colon), address, err);
+      }
+      if(!bus) {
+        syslog(LOG_ERR, "pca9685: %s", err.c_str());
+        std::cerr << "error: pca9685: " << err << std::endl;
+        return 1;
+      }
+      expander.reset(new PCA9685 { std::move(bus), expander_pwms, vm["pca9685-frequency"].as<unsigned>() });
+      backend.set_expander(expander.get());
+    }
     backend.setup();
 
+    std::unique_ptr<Arbiter> arbiter;
+    if(vm["override-hold"].as<unsigned>()>0) {
+      arbiter.reset(new Arbiter { backend.size(), backend.pwm_size(), vm["override-hold"].as<unsigned>() });
+      if(vm["source-priorities"].as<std::string>()!="") {
+        std::string err;
+        json11::Json p = json11::Json::parse(vm["source-priorities"].as<std::string>(), err);
+        if(err.empty()) arbiter->set_priorities(p, err);
+        if(!err.empty()) syslog(LOG_ERR, "source-priorities argument ignored: %s", err.c_str());
+      }
+      backend.set_arbiter(arbiter.get());
+    }
+
+    // before the server: requests still open when it goes hold entries
+    Recorder recorder;
+    if(vm.count("record")) {
+      std::string err;
+      if(recorder.open(vm["record"].as<std::string>(), uint64_t(vm["record-max"].as<unsigned>())<<20, err)) {
+        std::cerr << "error: " << err << std::endl;
+        return 1;
+      }
+    }
+
     boost::system::error_code ec;
 
+    // sharded mode: one single threaded server per shard, all listening on
+    // the same port, the kernel spreads the connections over them. the
+    // subsystems below stay on the first shard's io_service
+    unsigned shards = std::max(vm["shards"].as<unsigned>(), 1u);
     http2 server;
-    server.num_threads(num_threads);
+    server.num_threads(shards>1 ? 1 : num_threads);
+    server.reset();
+    std::vector<std::unique_ptr<http2>> shard_servers;
+    if(shards>1) {
+      server.reuse_port(true);
+      for(unsigned i=1; i<shards; i++) {
+        shard_servers.emplace_back(new http2());
+        shard_servers.back()->num_threads(1);
+        shard_servers.back()->reset();
+        shard_servers.back()->reuse_port(true);
+      }
+    }
+
+    Watchdog watchdog { backend, vm["watchdog-interval"].as<unsigned>(), vm["watchdog-stall"].as<unsigned>() };
+    watchdog.add_loop(server.io_service());
+    for(auto &s: shard_servers) watchdog.add_loop(s->io_service());
+
+    Scenes scenes { server.io_service(), backend, fade_step };
+    {
+      std::string err;
+      if(groups_json!="") {
+        json11::Json g = json11::Json::parse(groups_json, err);
+        if(err.empty()) scenes.set_groups(g, err);
+        if(!err.empty()) syslog(LOG_ERR, "groups argument ignored: %s", err.c_str());
+      }
+      err.clear();
+      if(scenes_json!="") {
+        json11::Json sc = json11::Json::parse(scenes_json, err);
+        if(err.empty()) {
+          for(auto &kv: sc.object_items()) {
+            if(scenes.define(kv.first, kv.second, err)) {
+              syslog(LOG_ERR, "scene %s ignored: %s", kv.first.c_str(), err.c_str());
+            }
+          }
+        }
+        else syslog(LOG_ERR, "scenes argument seems to be no valid json: %s", err.c_str());
+      }
+      err.clear();
+      if(scene_file!="" && scenes.load(scene_file, err)) {
+        syslog(LOG_ERR, "cannot load scene file %s: %s", scene_file.c_str(), err.c_str());
+      }
+    }
+
+    Inputs inputs { server.io_service(), backend, scenes, gpiochip };
+    if(inputs_json!="") {
+      std::string err;
+      json11::Json i = json11::Json::parse(inputs_json, err);
+      if(err.empty()) inputs.configure(i, err);
+      if(!err.empty()) syslog(LOG_ERR, "inputs argument ignored: %s", err.c_str());
+    }
+
+    Sensors sensors;
+    if(sensors_json!="") {
+      std::string err;
+      json11::Json sc = json11::Json::parse(sensors_json, err);
+      if(err.empty()) sensors.configure(sc, err);
+      if(!err.empty()) syslog(LOG_ERR, "sensors argument ignored: %s", err.c_str());
+    }
+    // before starting the sensors, loops may register simulated plants
+    ControlLoops controls { backend, sensors };
+    if(control_json!="") {
+      std::string err;
+      json11::Json cc = json11::Json::parse(control_json, err);
+      if(err.empty()) controls.configure(cc, err);
+      if(!err.empty()) syslog(LOG_ERR, "control argument ignored: %s", err.c_str());
+    }
+    sensors.start();
+    controls.start();
+
+    std::unique_ptr<History> history;
+    if(history_file!="") {
+      history.reset(new History { backend, history_file, history_events, history_days });
+      if(!history->ok()) history.reset();
+    }
 
-    server.handle("/v1/switch/", [&backend](const request &req, const response &res) {
+    Aggregator aggregator { vm["peer-timeout"].as<unsigned>(), vm["peer-ca"].as<std::string>() };
+    if(peers_json!="") {
+      std::string err;
+      json11::Json pc = json11::Json::parse(peers_json, err);
+      if(err.empty()) aggregator.configure(pc, err);
+      if(!err.empty()) syslog(LOG_ERR, "peers argument ignored: %s", err.c_str());
+    }
+    aggregator.start();
+
+    Tracer tracer { vm["trace-buffer"].as<unsigned>(), vm["trace-sample"].as<unsigned>(), vm["trace-slow"].as<unsigned>() };
+
+    RateLimiter limiter {
+      vm["limiter-clients"].as<unsigned>(),
+      { vm["rate-read"].as<double>(), vm["burst-read"].as<double>() },
+      { vm["rate-write"].as<double>(), vm["burst-write"].as<double>() },
+      vm["max-streams"].as<unsigned>(), vm["client-streams"].as<unsigned>()
+    };
+    CommandQueue queue { backend, vm["max-update-rate"].as<double>() };
+    queue.start();
+
+    // every handler goes through the admission control, then authentication
+    auto handle = [&server, &shard_servers, &limiter, &auth, &recorder](const std::string &pattern, request_cb cb) {
+      request_cb h = scoped(recorded(recorder, negotiated(limited(limiter, authorized(auth, cb)))));
+      server.handle(pattern, h);
+      for(auto &s: shard_servers) s->handle(pattern, h);
+    };
+
+    Mqtt mqtt { server.io_service(), backend, vm["mqtt-prefix"].as<std::string>(), vm["mqtt-keepalive"].as<unsigned>(), vm["mqtt-batch"].as<unsigned>() };
+    if(vm["mqtt-broker"].as<std::string>()!="") {
+      std::string err;
+      std::string client_id = vm["mqtt-client-id"].as<std::string>();
+      if(client_id=="") {
+        char hostname[64] = "";
+        gethostname(hostname, sizeof(hostname)-1);
+        client_id = std::string("lightsrv-") + hostname;
+      }
+      if(mqtt.configure(vm["mqtt-broker"].as<std::string>(), client_id, vm["mqtt-user"].as<std::string>(), vm["mqtt-password"].as<std::string>(), err)) {
+        syslog(LOG_ERR, "mqtt-broker argument ignored: %s", err.c_str());
+      }
+      mqtt.start();
+    }
+
+    handle("/v1/switch/", [&backend, &queue, &tracer, &arbiter](const request &req, const response &res) {
       syslog(LOG_DEBUG, "in /v1/switch/ handler");
 
-      std::string path=req.uri().path;
-      std::vector<std::string> paths;
-      boost::split(paths, path, boost::is_any_of("/"));
-      int channel=std::stoi(paths.back());
+      auto paths = split_parts(req.uri().path, "/");
+      int channel=std::stoi(str(paths.back()));
       syslog(LOG_INFO, "received %s %s request", req.method().c_str(), req.uri().path.c_str());
 
       if(req.method() == "PUT") {
+        auto tr = begin_trace(tracer, req);
         std::ostringstream *ostr=new std::ostringstream();
-        req.on_data([&res, ostr, channel, &backend](const uint8_t *data, std::size_t len) {
+        auto rec = Recorder::current();
+        req.on_data([&res, ostr, channel, &backend, &queue, &tracer, &arbiter, tr, rec](const uint8_t *data, std::size_t len) {
           if(len>0) {
             ostr->write((const char *)data, len);
             return;
           }
 
+          Tracer::mark(tr, "body");
           syslog(LOG_INFO, "PUT data: %s", ostr->str().c_str());
+          Tracer::mark(tr, "log_request");
           // convert to json
           std::string err;
           std::string raw_body = ostr->str();
           delete ostr;
+          Recorder::body(rec, raw_body);
 
-          json11::Json body = json11::Json::parse(raw_body, err);
-          if(err.empty()) {
+          json11::Json body = parse_body(res, raw_body, err);
+          Tracer::mark(tr, "parse");
+          if(err.empty() && !reachable(backend, res, BCM2835::change::SWITCH, channel)) {
+            // answered with 503
+          }
+          else if(err.empty() && !claimed(backend, arbiter.get(), res, BCM2835::change::SWITCH, channel, body)) {
+            // answered with 409
+          }
+          else if(err.empty()) {
             bool value = body["on"].bool_value();
 
-            backend.push_autocommit(false);
-            backend.init();
-
-            backend.switch_channel(channel, value);
-            auto retval = backend.get_channel(channel);
-
-            backend.close();
-            backend.pop_autocommit();
+            int retval;
+            if(queue.enabled()) {
+              queue.switch_channel(channel, value);
+              retval = queue.get_channel(channel);
+              Tracer::mark(tr, "enqueue");
+            }
+            else {
+              backend.push_autocommit(false);
+              backend.init();
+              Tracer::mark(tr, "init");
+
+              backend.switch_channel(channel, value);
+              retval = backend.get_channel(channel);
+              Tracer::mark(tr, "gpio");
+
+              backend.close();
+              backend.pop_autocommit();
+              Tracer::mark(tr, "close");
+            }
 
-            res.write_head(200, {
-              {"content-type", {"application/json", false}},
+            header_map h {
+              {"content-type", {content_type(res), false}},
               {"Access-Control-Allow-Origin", {"*", false}}
-            });
+            };
+            if(tr) h.emplace("x-request-id", header_value { tr->id, false });
+            res.write_head(200, h);
             json11::Json r = json11::Json::object {
               {
                 "error", json11::Json::object {
@@ -246,8 +1075,10 @@ int main(int argc, char *argv[]) {
                 }
               }
             };
-            syslog(LOG_DEBUG, "returning response: %s", r.dump().c_str());
-            res.end(r.dump());
+            std::string out = encode(res, r);
+            Tracer::mark(tr, "serialize");
+            res.end(out);
+            Tracer::mark(tr, "write");
           }
           else {
             syslog(LOG_DEBUG, "parse error on json body: %s", raw_body.c_str());
@@ -262,13 +1093,16 @@ int main(int argc, char *argv[]) {
                 }
               }
             };
-            syslog(LOG_DEBUG, "returning response: %s", r.dump().c_str());
-            res.end(r.dump());
+            res.end(encode(res, r));
           }
+          tracer.finish(tr);
         });
       }
+      else if(req.method() == "GET" && !reachable(backend, res, BCM2835::change::SWITCH, channel)) {
+        // answered with 503
+      }
       else if(req.method() == "GET") {
-        res.write_head(200, {{"content-type", {"application/json", false}}});
+        res.write_head(200, {{"content-type", {content_type(res), false}}});
         json11::Json r = json11::Json::object {
           {
             "error", json11::Json::object {
@@ -277,12 +1111,11 @@ int main(int argc, char *argv[]) {
           },
           {
             "response", json11::Json::object {
-              { "on", backend.get_channel(channel) }
+              { "on", queue.get_channel(channel) }
             }
           }
         };
-        syslog(LOG_DEBUG, "returning response: %s", r.dump().c_str());
-        res.end(r.dump());
+        res.end(encode(res, r));
       }
       else if(req.method() == "OPTIONS") {
         res.write_head(204, {
@@ -301,61 +1134,95 @@ int main(int argc, char *argv[]) {
       }
     });
 
-    server.handle("/v1/pwm/", [&backend](const request &req, const response &res) {
+    handle("/v1/pwm/", [&backend, &queue, &tracer, &arbiter](const request &req, const response &res) {
       syslog(LOG_DEBUG, "in /v1/pwm/ handler");
 
-      std::string path=req.uri().path;
-      std::vector<std::string> paths;
-      boost::split(paths, path, boost::is_any_of("/"));
-      int channel=std::stoi(paths.back());
+      auto paths = split_parts(req.uri().path, "/");
+      int channel=std::stoi(str(paths.back()));
       syslog(LOG_INFO, "received %s %s request", req.method().c_str(), req.uri().path.c_str());
 
       if(req.method() == "PUT") {
+        auto tr = begin_trace(tracer, req);
         std::ostringstream *ostr=new std::ostringstream();
-        req.on_data([&res, ostr, channel, &backend](const uint8_t *data, std::size_t len) {
+        auto rec = Recorder::current();
+        req.on_data([&res, ostr, channel, &backend, &queue, &tracer, &arbiter, tr, rec](const uint8_t *data, std::size_t len) {
           if(len>0) {
             ostr->write((const char *)data, len);
             return;
           }
+          Tracer::mark(tr, "body");
           syslog(LOG_DEBUG, "PUT data: %s", ostr->str().c_str());
+          Tracer::mark(tr, "log_request");
 
           // convert to json
           std::string err;
           std::string raw_body = ostr->str();
           delete ostr;
-
-          json11::Json body = json11::Json::parse(raw_body, err);
-          if(err.empty()) {
+          Recorder::body(rec, raw_body);
+
+          json11::Json body = parse_body(res, raw_body, err);
+          Tracer::mark(tr, "parse");
+          // {"raw": 0..4096} sets an expander channel's duty cycle directly
+          bool raw = body["raw"].is_number();
+          if(err.empty() && raw && !backend.has_raw(channel)) {
+            reply_error(res, 400, 3, "invalid parameter", "raw duty cycles are for pca9685 channels only");
+          }
+          else if(err.empty() && !reachable(backend, res, BCM2835::change::PWM, channel)) {
+            // answered with 503
+          }
+          else if(err.empty() && !claimed(backend, arbiter.get(), res, BCM2835::change::PWM, channel, body)) {
+            // answered with 409
+          }
+          else if(err.empty()) {
             int value = body["value"].int_value();
+            unsigned duty = std::max(body["raw"].int_value(), 0);
+
+            unsigned retval;
+            if(queue.enabled()) {
+              if(raw) queue.set_pwm_raw(channel, duty);
+              else queue.set_pwm(channel, value);
+              retval = queue.get_pwm(channel);
+              Tracer::mark(tr, "enqueue");
+            }
+            else {
+              backend.push_autocommit(false);
+              backend.init();
+              Tracer::mark(tr, "init");
+
+              if(raw) backend.set_pwm_raw(channel, duty);
+              else backend.set_pwm(channel, value);
+              retval = backend.get_pwm(channel);
+              Tracer::mark(tr, "pwm");
+
+              backend.close();
+              backend.pop_autocommit();
+              Tracer::mark(tr, "close");
+            }
 
-            backend.push_autocommit(false);
-            backend.init();
-
-            backend.set_pwm(channel, value);
-            auto retval = backend.get_pwm(channel);
-
-            backend.close();
-            backend.pop_autocommit();
-
-            res.write_head(200, {
-              {"content-type", {"application/json", false}},
+            header_map h {
+              {"content-type", {content_type(res), false}},
               {"Access-Control-Allow-Origin", {"*", false}}
-            });
+            };
+            if(tr) h.emplace("x-request-id", header_value { tr->id, false });
+            res.write_head(200, h);
+            json11::Json::object request;
+            if(raw) request["raw"] = (int)duty;
+            else request["value"] = value;
+            json11::Json::object response { { "value", (int)retval } };
+            if(backend.has_raw(channel)) response["raw"] = (int)queue.get_pwm_raw(channel);
             json11::Json r = json11::Json::object {
               {
                 "error", json11::Json::object {
                   { "code", 0 }
                 }
               },
-              { "request", json11::Json::object { { "value", value } } },
-              {
-                "response", json11::Json::object {
-                  { "value", (int)retval }
-                }
-              }
+              { "request", request },
+              { "response", response }
             };
-            syslog(LOG_DEBUG, "returning response: %s", r.dump().c_str());
-            res.end(r.dump());
+            std::string out = encode(res, r);
+            Tracer::mark(tr, "serialize");
+            res.end(out);
+            Tracer::mark(tr, "write");
           }
           else {
             syslog(LOG_DEBUG, "parse error on json body: %s", raw_body.c_str());
@@ -370,27 +1237,27 @@ int main(int argc, char *argv[]) {
                 }
               }
             };
-            syslog(LOG_DEBUG, "returning response: %s", r.dump().c_str());
-            res.end(r.dump());
+            res.end(encode(res, r));
           }
+          tracer.finish(tr);
         });
       }
+      else if(req.method() == "GET" && !reachable(backend, res, BCM2835::change::PWM, channel)) {
+        // answered with 503
+      }
       else if(req.method() == "GET") {
-        res.write_head(200, {{"content-type", {"application/json", false}}});
+        res.write_head(200, {{"content-type", {content_type(res), false}}});
+        json11::Json::object response { { "value", (int)queue.get_pwm(channel) } };
+        if(backend.has_raw(channel)) response["raw"] = (int)queue.get_pwm_raw(channel);
         json11::Json r = json11::Json::object {
           {
             "error", json11::Json::object {
               { "code", 0 }
             }
           },
-          {
-            "response", json11::Json::object {
-              { "value", (int)backend.get_pwm(channel) }
-            }
-          }
+          { "response", response }
         };
-        syslog(LOG_DEBUG, "returning response: %s", r.dump().c_str());
-        res.end(r.dump());
+        res.end(encode(res, r));
       }
       else if(req.method() == "OPTIONS") {
         res.write_head(204, {
@@ -409,49 +1276,121 @@ int main(int argc, char *argv[]) {
       }
     });
 
-    server.handle("/v1/list", [&backend](const request &req, const response &res) {
+    auto list_doc = [&backend]() {
+      backend.push_autocommit(false);
+      backend.init();
+
+      json11::Json::array switches;
+      for(unsigned i=0; i<backend.size(); i++) switches.push_back(backend.get_channel(i));
+      json11::Json::array pwms;
+      for(unsigned i=0; i<backend.pwm_size(); i++) pwms.push_back((int)backend.get_pwm(i));
+
+      backend.close();
+      backend.pop_autocommit();
+
+      auto autoo = json11::Json::object  {
+        { "available", backend.has_autom() }
+      };
+      if(backend.has_autom()) {
+        autoo["value"] = backend.get_auto();
+      }
+      json11::Json r = json11::Json::object {
+        {
+          "error", json11::Json::object {
+            { "code", 0 }
+          }
+        },
+        {
+          "response", json11::Json::object {
+            { "switches", switches },
+            { "pwms", pwms },
+            { "auto", autoo }
+          }
+        }
+      };
+      return r;
+    };
+    // one set of caches per shard, each kept current by the backend's
+    // change feed, so the shards do not share one on the read path. the
+    // CBOR body is only built once a client asks for it
+    std::vector<std::unique_ptr<list_bodies>> list_caches;
+    for(unsigned i=0; i<shards; i++) {
+      list_caches.emplace_back(new list_bodies {
+        { backend, [list_doc]() { return list_doc().dump(); } },
+        { backend, [list_doc]() { return Cbor::encode(list_doc()); } }
+      });
+    }
+
+    handle("/v1/list", [&backend, &list_caches, &aggregator, longpoll_timeout](const request &req, const response &res) {
       syslog(LOG_DEBUG, "in /v1/list handler");
       syslog(LOG_INFO, "received %s %s request", req.method().c_str(), req.uri().path.c_str());
+      list_bodies &lists = *list_caches[shard_index];
 
-      if(req.method() == "GET") {
-        res.write_head(200, {
-          {"content-type", {"application/json", false}},
-          {"Access-Control-Allow-Origin", {"*", false}}
+      if(req.method() == "GET" && query_param(req.uri().raw_query, "merged")=="1") {
+        // the cached state of all peers, ?fresh=1 asks them all first
+        if(aggregator.empty()) {
+          reply_error(res, 404, 2, "not found", "no peers configured");
+          return;
+        }
+        auto later = deferred(res);
+        aggregator.list(query_param(req.uri().raw_query, "fresh")=="1", [&res, later](const json11::Json &merged) {
+          later([&res, merged]() { reply_json(res, merged); });
         });
+      }
+      else if(req.method() == "GET") {
+        std::string since_str = query_param(req.uri().raw_query, "since");
+        if(since_str=="") {
+          reply_state(backend, res, lists, req.header());
+          return;
+        }
 
-        backend.push_autocommit(false);
-        backend.init();
+        // long poll: park the stream until the state version moves past since
+        uint64_t since;
+        if(!parse_since(since_str, since)) {
+          syslog(LOG_DEBUG, "invalid since parameter: %s, returning 400 Bad request", since_str.c_str());
+          res.write_head(400);
+          res.end("Bad request\n");
+          return;
+        }
 
-        json11::Json::array switches;
-        for(unsigned i=0; i<backend.size(); i++) switches.push_back(backend.get_channel(i));
-        json11::Json::array pwms;
-        for(unsigned i=0; i<backend.pwm_size(); i++) pwms.push_back((int)backend.get_pwm(i));
+        auto done = std::make_shared<bool>(false);
+        auto timer = std::make_shared<boost::asio::deadline_timer>(res.io_service(), boost::posix_time::seconds(longpoll_timeout));
+        auto id = std::make_shared<unsigned long>(0);
+        auto header = std::make_shared<header_map>(req.header());
+        boost::asio::io_service &io = res.io_service();
+
+        // the waiter is called from the thread changing the backend, so
+        // everything touching res is posted back to its own io_service
+        *id = lists.json.park(since, [&io, &backend, &res, &lists, done, timer, header](uint64_t version) {
+          (void)version;
+          io.post([&backend, &res, &lists, done, timer, header]() {
+            if(*done) return;
+            *done = true;
+            timer->cancel();
+            reply_state(backend, res, lists, *header);
+          });
+        });
+        if(*id==0) {
+          reply_state(backend, res, lists, *header);
+          return;
+        }
 
-        backend.close();
-        backend.pop_autocommit();
+        add_on_close(res, [&lists, done, timer, id](uint32_t error_code) {
+          (void)error_code;
+          *done = true;
+          timer->cancel();
+          lists.json.unpark(*id);
+        });
 
-        auto autoo = json11::Json::object  {
-          { "available", backend.has_autom() }
-        };
-        if(backend.has_autom()) {
-          autoo["value"] = backend.get_auto();
-        }
-        json11::Json r = json11::Json::object {
-          {
-            "error", json11::Json::object {
-              { "code", 0 }
-            }
-          },
-          {
-            "response", json11::Json::object {
-              { "switches", switches },
-              { "pwms", pwms },
-              { "auto", autoo }
-            }
+        timer->async_wait([&backend, &res, &lists, done, id, header](const boost::system::error_code &ec) {
+          if (ec || *done) {
+            return;
           }
-        };
-        syslog(LOG_DEBUG, "returning response: %s", r.dump().c_str());
-        res.end(r.dump());
+          *done = true;
+          lists.json.unpark(*id);
+          syslog(LOG_DEBUG, "long poll timed out, returning current state");
+          reply_state(backend, res, lists, *header);
+        });
       }
       else if(req.method() == "OPTIONS") {
         res.write_head(204, {
@@ -471,13 +1410,14 @@ int main(int argc, char *argv[]) {
 
     });
 
-    server.handle("/v1/auto", [&backend, &switch_names, &pwm_names](const request &req, const response &res) {
+    handle("/v1/auto", [&backend, &switch_names, &pwm_names](const request &req, const response &res) {
       syslog(LOG_DEBUG, "in /v1/auto handler");
       syslog(LOG_INFO, "received %s %s request", req.method().c_str(), req.uri().path.c_str());
 
       if(req.method() == "PUT") {
         std::ostringstream *ostr=new std::ostringstream();
-        req.on_data([&res, ostr, &backend](const uint8_t *data, std::size_t len) {
+        auto rec = Recorder::current();
+        req.on_data([&res, ostr, &backend, rec](const uint8_t *data, std::size_t len) {
           if(len>0) {
             ostr->write((const char *)data, len);
             return;
@@ -488,8 +1428,9 @@ int main(int argc, char *argv[]) {
           std::string err;
           std::string raw_body = ostr->str();
           delete ostr;
+          Recorder::body(rec, raw_body);
 
-          json11::Json body = json11::Json::parse(raw_body, err);
+          json11::Json body = parse_body(res, raw_body, err);
           if(err.empty()) {
             std::string value_str = body["on"].string_value();
             syslog(LOG_DEBUG, "auto: value_str=%s", value_str.c_str());
@@ -497,7 +1438,7 @@ int main(int argc, char *argv[]) {
             syslog(LOG_DEBUG, "auto: value=%d", value);
             backend.set_auto(value);
             res.write_head(200, {
-              {"content-type", {"application/json", false}},
+              {"content-type", {content_type(res), false}},
               {"Access-Control-Allow-Origin", {"*", false}}
             });
             json11::Json r = json11::Json::object {
@@ -513,8 +1454,7 @@ int main(int argc, char *argv[]) {
                 }
               }
             };
-            syslog(LOG_DEBUG, "returning response: %s", r.dump().c_str());
-            res.end(r.dump());
+            res.end(encode(res, r));
           }
           else {
             syslog(LOG_DEBUG, "parse error on json body: %s", raw_body.c_str());
@@ -529,14 +1469,13 @@ int main(int argc, char *argv[]) {
                 }
               }
             };
-            syslog(LOG_DEBUG, "returning response: %s", r.dump().c_str());
-            res.end(r.dump());
+            res.end(encode(res, r));
           }
         });
       }
       else if(req.method() == "GET") {
         res.write_head(200, {
-          {"content-type", {"application/json", false}},
+          {"content-type", {content_type(res), false}},
           {"Access-Control-Allow-Origin", {"*", false}}
         });
         json11::Json r = json11::Json::object {
@@ -551,8 +1490,7 @@ int main(int argc, char *argv[]) {
             }
           }
         };
-        syslog(LOG_DEBUG, "returning response: %s", r.dump().c_str());
-        res.end(r.dump());
+        res.end(encode(res, r));
       }
       else if(req.method() == "OPTIONS") {
         res.write_head(204, {
@@ -572,77 +1510,658 @@ int main(int argc, char *argv[]) {
 
     });
 
-    server.handle("/", [&backend, &docroot, &switch_names, &pwm_names, time_server_start](const request &req, const response &res) {
-      syslog(LOG_DEBUG, "in / handler");
+    handle("/v1/scene/", [&server, &scenes, &scene_file](const request &req, const response &res) {
+      syslog(LOG_DEBUG, "in /v1/scene/ handler");
       syslog(LOG_INFO, "received %s %s request", req.method().c_str(), req.uri().path.c_str());
 
-      if(req.method() == "OPTIONS") {
-        res.write_head(204, {
-          {"content-length", {"0", false}},
-          {"allow", {"OPTIONS,GET,PUT", false}},
-          {"Access-Control-Allow-Origin", {"*", false}},
-          {"Access-Control-Allow-Methods", {"GET,PUT,OPTIONS", false}},
-          {"Access-Control-Allow-Headers", {"*", false}}
+      // /v1/scene/, /v1/scene/<name> or /v1/scene/<name>/activate
+      auto paths = split_parts(req.uri().path, "/");
+      std::string name = paths.size()>3 ? percent_decode(str(paths[3])) : "";
+      bool activate = paths.size()>4 && boost::equals(paths[4], "activate");
+
+      if(req.method() == "GET") {
+        run_on(server.io_service(), res, [&res, &scenes, name]() -> std::function<void()> {
+          if(name=="") {
+            json11::Json doc = scenes.to_json();
+            return [&res, doc]() { reply_json(res, doc); };
+          }
+          if(scenes.has_scene(name)) {
+            json11::Json doc = scenes.scene(name);
+            return [&res, doc]() { reply_json(res, doc); };
+          }
+          return [&res, name]() { reply_error(res, 404, 2, "not found", "unknown scene " + name); };
         });
-        res.end();
       }
-
-      else if(req.method() == "GET") {
-
-        auto path = percent_decode(req.uri().path);
-        if (path == "/") {
-          path = "/index.html";
-        }
-
-        if (path != "/index.html") {
-          syslog(LOG_ERR, "Request for non-whitelisted file: %s, returning 404 Not found", path.c_str());
-          res.write_head(404);
-          res.end();
+      else if(req.method() == "PUT" && name!="") {
+        on_body(req, [&res, &server, &scenes, &scene_file, name, activate](const std::string &raw_body) {
+          std::string err;
+          json11::Json body;
+          if(raw_body!="") body = parse_body(res, raw_body, err);
+          if(!err.empty()) {
+            reply_error(res, 400, 1, "json parse error", err);
+            return;
+          }
+          run_on(server.io_service(), res, [&res, &scenes, &scene_file, name, activate, body]() -> std::function<void()> {
+            std::string err;
+            if(activate) {
+              double fade = body["fade"].is_number() ? body["fade"].number_value() : -1;
+              if(scenes.activate(name, fade, err)) return [&res, err]() { reply_error(res, 404, 2, "not found", err); };
+              return [&res, name, body]() { reply_json(res, json11::Json::object { { "active", name } }, body); };
+            }
+            if(scenes.define(name, body, err)) return [&res, err]() { reply_error(res, 400, 3, "invalid scene", err); };
+            if(scene_file!="") scenes.save(scene_file);
+            json11::Json doc = scenes.scene(name);
+            return [&res, doc, body]() { reply_json(res, doc, body); };
+          });
+        });
+      }
+      else if(req.method() == "OPTIONS") {
+        reply_options(res, "OPTIONS,GET,PUT");
+      }
+      else {
+        syslog(LOG_DEBUG, "unsupported request method for scene: %s, returning 400 Bad request", req.method().c_str());
+        res.write_head(400);
+        res.end("Bad request\n");
+      }
+    });
+
+    handle("/v1/group/", [&server, &scenes](const request &req, const response &res) {
+      syslog(LOG_DEBUG, "in /v1/group/ handler");
+      syslog(LOG_INFO, "received %s %s request", req.method().c_str(), req.uri().path.c_str());
+
+      auto paths = split_parts(req.uri().path, "/");
+      std::string name = percent_decode(str(paths.back()));
+
+      // body is null for a GET
+      auto group = [&res, &scenes, name](const json11::Json &body) -> std::function<void()> {
+        if(!scenes.has_group(name)) return [&res, name]() { reply_error(res, 404, 2, "not found", "unknown group " + name); };
+        std::string err;
+        if(!body.is_null()) scenes.switch_group(name, body["on"].bool_value(), err);
+        json11::Json doc = json11::Json::object { { "on", scenes.group_state(name) } };
+        return [&res, doc, body]() { reply_json(res, doc, body); };
+      };
+
+      if(req.method() == "PUT") {
+        on_body(req, [&res, &server, group](const std::string &raw_body) {
+          std::string err;
+          json11::Json body = parse_body(res, raw_body, err);
+          if(!err.empty()) {
+            reply_error(res, 400, 1, "json parse error", err);
+            return;
+          }
+          if(body.is_null()) body = json11::Json::object {};
+          run_on(server.io_service(), res, [group, body]() { return group(body); });
+        });
+      }
+      else if(req.method() == "GET") {
+        run_on(server.io_service(), res, [group]() { return group(json11::Json()); });
+      }
+      else if(req.method() == "OPTIONS") {
+        reply_options(res, "OPTIONS,GET,PUT");
+      }
+      else {
+        syslog(LOG_DEBUG, "unsupported request method for group: %s, returning 400 Bad request", req.method().c_str());
+        res.write_head(400);
+        res.end("Bad request\n");
+      }
+    });
+
+    handle("/v1/input/", [&server, &inputs](const request &req, const response &res) {
+      syslog(LOG_DEBUG, "in /v1/input/ handler");
+      syslog(LOG_INFO, "received %s %s request", req.method().c_str(), req.uri().path.c_str());
+
+      auto paths = split_parts(req.uri().path, "/");
+      std::string name = percent_decode(str(paths.back()));
+
+      if(req.method() == "GET") {
+        run_on(server.io_service(), res, [&res, &inputs]() -> std::function<void()> {
+          json11::Json doc = inputs.to_json();
+          return [&res, doc]() { reply_json(res, doc); };
+        });
+      }
+      else if(req.method() == "PUT" && name!="") {
+        // simulated edge, {"edge": "rising"|"falling"}
+        on_body(req, [&res, &server, &inputs, name](const std::string &raw_body) {
+          std::string err;
+          json11::Json body = parse_body(res, raw_body, err);
+          if(!err.empty()) {
+            reply_error(res, 400, 1, "json parse error", err);
+            return;
+          }
+          run_on(server.io_service(), res, [&res, &inputs, name, body]() -> std::function<void()> {
+            if(inputs.inject(name, body["edge"].string_value()=="rising")) return [&res, name]() { reply_error(res, 404, 2, "not found", "unknown input " + name); };
+            json11::Json doc = inputs.to_json();
+            return [&res, doc, body]() { reply_json(res, doc, body); };
+          });
+        });
+      }
+      else if(req.method() == "OPTIONS") {
+        reply_options(res, "OPTIONS,GET,PUT");
+      }
+      else {
+        syslog(LOG_DEBUG, "unsupported request method for input: %s, returning 400 Bad request", req.method().c_str());
+        res.write_head(400);
+        res.end("Bad request\n");
+      }
+    });
+
+    handle("/v1/sensor/", [&sensors](const request &req, const response &res) {
+      syslog(LOG_DEBUG, "in /v1/sensor/ handler");
+      syslog(LOG_INFO, "received %s %s request", req.method().c_str(), req.uri().path.c_str());
+
+      auto paths = split_parts(req.uri().path, "/");
+      std::string name = percent_decode(str(paths.back()));
+
+      if(req.method() == "GET" && name=="") {
+        reply_json(res, sensors.to_json());
+      }
+      else if(req.method() == "GET") {
+        const TimeSeries *series = sensors.series(name);
+        if(!series) {
+          reply_error(res, 404, 2, "not found", "unknown sensor " + name);
           return;
         }
+        // ?from=&to= in unix seconds, default is the last hour, and
+        // optionally res=raw|minute|hour
+        std::string from_str = query_param(req.uri().raw_query, "from");
+        std::string to_str = query_param(req.uri().raw_query, "to");
+        std::string res_str = query_param(req.uri().raw_query, "res");
+        int64_t to = to_str!="" ? std::strtoll(to_str.c_str(), nullptr, 10) : std::time(nullptr);
+        int64_t from = from_str!="" ? std::strtoll(from_str.c_str(), nullptr, 10) : to-3600;
+        TimeSeries::resolution r = series->best(from);
+        if(res_str=="raw") r = TimeSeries::RAW;
+        else if(res_str=="minute") r = TimeSeries::MINUTE;
+        else if(res_str=="hour") r = TimeSeries::HOUR;
+
+        json11::Json::array points;
+        for(auto &p: series->range(r, from, to)) {
+          if(r==TimeSeries::RAW) points.push_back(json11::Json::array { (double)p.t, p.avg });
+          else points.push_back(json11::Json::array { (double)p.t, p.avg, p.min, p.max });
+        }
+        reply_json(res, json11::Json::object {
+          { "name", name },
+          { "resolution", TimeSeries::name(r) },
+          { "from", (double)from },
+          { "to", (double)to },
+          { "points", points }
+        });
+      }
+      else if(req.method() == "OPTIONS") {
+        reply_options(res, "OPTIONS,GET");
+      }
+      else {
+        syslog(LOG_DEBUG, "unsupported request method for sensor: %s, returning 400 Bad request", req.method().c_str());
+        res.write_head(400);
+        res.end("Bad request\n");
+      }
+    });
 
-        path = docroot + "/" + path;
-        std::ifstream t(path);
-        if(!t.good()) {
-          syslog(LOG_ERR, "Cannot open %s: %s, returning 404 Not found", path.c_str(), strerror(errno));
+    handle("/v1/control", [&controls](const request &req, const response &res) {
+      syslog(LOG_DEBUG, "in /v1/control handler");
+      syslog(LOG_INFO, "received %s %s request", req.method().c_str(), req.uri().path.c_str());
+
+      if(req.method() == "GET") {
+        reply_json(res, controls.to_json());
+      }
+      else if(req.method() == "OPTIONS") {
+        reply_options(res, "OPTIONS,GET");
+      }
+      else {
+        syslog(LOG_DEBUG, "unsupported request method for control: %s, returning 400 Bad request", req.method().c_str());
+        res.write_head(400);
+        res.end("Bad request\n");
+      }
+    });
+
+    handle("/v1/history", [&history](const request &req, const response &res) {
+      syslog(LOG_DEBUG, "in /v1/history handler");
+      syslog(LOG_INFO, "received %s %s request", req.method().c_str(), req.uri().path.c_str());
+
+      if(req.method() == "GET") {
+        if(!history) {
+          reply_error(res, 404, 2, "not found", "no history-file configured");
+          return;
+        }
+        // ?from=&to= in unix seconds, default is the last day, and ?limit=
+        // on the number of events, the newest are returned
+        std::string from_str = query_param(req.uri().raw_query, "from");
+        std::string to_str = query_param(req.uri().raw_query, "to");
+        std::string limit_str = query_param(req.uri().raw_query, "limit");
+        int64_t to = to_str!="" ? std::strtoll(to_str.c_str(), nullptr, 10) : std::time(nullptr);
+        int64_t from = from_str!="" ? std::strtoll(from_str.c_str(), nullptr, 10) : to-86400;
+        unsigned limit = limit_str!="" ? std::strtoul(limit_str.c_str(), nullptr, 10) : 1000;
+
+        json11::Json::array events;
+        for(auto &e: history->events(from*1000, to*1000+999, limit)) {
+          events.push_back(json11::Json::object {
+            { "t", e.t_ms/1000.0 },
+            { "kind", History::kind_name(e.kind) },
+            { "channel", (int)e.channel },
+            { "value", (int)e.value },
+            { "source", History::source_name(e.source) }
+          });
+        }
+        reply_json(res, json11::Json::object {
+          { "from", (double)from },
+          { "to", (double)to },
+          { "events", events }
+        });
+      }
+      else if(req.method() == "OPTIONS") {
+        reply_options(res, "OPTIONS,GET");
+      }
+      else {
+        syslog(LOG_DEBUG, "unsupported request method for history: %s, returning 400 Bad request", req.method().c_str());
+        res.write_head(400);
+        res.end("Bad request\n");
+      }
+    });
+
+    handle("/v1/usage", [&history, &switch_watts, &pwm_watts](const request &req, const response &res) {
+      syslog(LOG_DEBUG, "in /v1/usage handler");
+      syslog(LOG_INFO, "received %s %s request", req.method().c_str(), req.uri().path.c_str());
+
+      if(req.method() == "GET") {
+        if(!history) {
+          reply_error(res, 404, 2, "not found", "no history-file configured");
+          return;
+        }
+        // ?kind=switch|pwm&channel= selects one channel, all channels
+        // otherwise; ?from=&to= in unix seconds, default is the last 30 days
+        std::string kind_str = query_param(req.uri().raw_query, "kind");
+        std::string channel_str = query_param(req.uri().raw_query, "channel");
+        std::string from_str = query_param(req.uri().raw_query, "from");
+        std::string to_str = query_param(req.uri().raw_query, "to");
+        time_t to = to_str!="" ? std::strtoll(to_str.c_str(), nullptr, 10) : std::time(nullptr);
+        time_t from = from_str!="" ? std::strtoll(from_str.c_str(), nullptr, 10) : to-30*86400;
+        if(kind_str!="" && kind_str!="switch" && kind_str!="pwm") {
+          reply_error(res, 400, 3, "invalid parameter", "kind must be switch or pwm");
+          return;
+        }
+
+        json11::Json::array channels;
+        auto add = [&](BCM2835::change::kind_t kind, unsigned channel, double watts) {
+          json11::Json::array days;
+          double seconds = 0;
+          for(auto &u: history->usage_of(kind, channel, from, to)) {
+            time_t t = time_t(u.day)*86400;
+            tm day_tm;
+            char date[11];
+            strftime(date, sizeof(date), "%Y-%m-%d", gmtime_r(&t, &day_tm));
+            days.push_back(json11::Json::object { { "date", date }, { "on_hours", u.seconds/3600 } });
+            seconds += u.seconds;
+          }
+          channels.push_back(json11::Json::object {
+            { "kind", History::kind_name(kind) },
+            { "channel", (int)channel },
+            { "on_hours", seconds/3600 },
+            { "energy_kwh", seconds/3600*watts/1000 },
+            { "days", days }
+          });
+        };
+        if(channel_str!="") {
+          unsigned channel = std::strtoul(channel_str.c_str(), nullptr, 10);
+          bool is_pwm = kind_str=="pwm";
+          if(channel>=(is_pwm ? pwm_watts.size() : switch_watts.size())) {
+            reply_error(res, 404, 2, "not found", "unknown channel " + channel_str);
+            return;
+          }
+          add(is_pwm ? BCM2835::change::PWM : BCM2835::change::SWITCH, channel, is_pwm ? pwm_watts[channel] : switch_watts[channel]);
+        }
+        else {
+          if(kind_str!="pwm") for(unsigned i=0; i<switch_watts.size(); i++) add(BCM2835::change::SWITCH, i, switch_watts[i]);
+          if(kind_str!="switch") for(unsigned i=0; i<pwm_watts.size(); i++) add(BCM2835::change::PWM, i, pwm_watts[i]);
+        }
+        reply_json(res, json11::Json::object {
+          { "from", (double)from },
+          { "to", (double)to },
+          { "channels", channels }
+        });
+      }
+      else if(req.method() == "OPTIONS") {
+        reply_options(res, "OPTIONS,GET");
+      }
+      else {
+        syslog(LOG_DEBUG, "unsupported request method for usage: %s, returning 400 Bad request", req.method().c_str());
+        res.write_head(400);
+        res.end("Bad request\n");
+      }
+    });
+
+    auto arbiter_handler = [&backend, &arbiter](const request &req, const response &res) {
+      syslog(LOG_DEBUG, "in /v1/arbiter handler");
+      syslog(LOG_INFO, "received %s %s request", req.method().c_str(), req.uri().path.c_str());
+
+      if(!arbiter) {
+        reply_error(res, 404, 2, "not found", "arbitration is off");
+      }
+      else if(req.method() == "GET") {
+        reply_json(res, arbiter->to_json(backend.now()));
+      }
+      else if(req.method() == "DELETE") {
+        // /v1/arbiter/switch/<n> or /v1/arbiter/pwm/<n> drops the claim,
+        // automode takes the channel over right away
+        auto paths = split_parts(req.uri().path, "/");
+        if(paths.size()!=5 || (!boost::equals(paths[3], "switch") && !boost::equals(paths[3], "pwm")) || !boost::all(paths[4], boost::is_digit()) || paths[4].empty()) {
+          reply_error(res, 404, 2, "not found", "no such channel: " + req.uri().path);
+          return;
+        }
+        bool sw = boost::equals(paths[3], "switch");
+        unsigned channel = std::stoul(str(paths[4]));
+        if(channel>=(sw ? backend.size() : backend.pwm_size())) {
+          reply_error(res, 404, 2, "not found", "no such channel: " + req.uri().path);
+          return;
+        }
+        arbiter->release(sw ? BCM2835::change::SWITCH : BCM2835::change::PWM, channel);
+        if(backend.has_autom()) backend.autom();
+        reply_json(res, arbiter->to_json(backend.now()));
+      }
+      else if(req.method() == "OPTIONS") {
+        reply_options(res, "OPTIONS,GET,DELETE");
+      }
+      else {
+        syslog(LOG_DEBUG, "unsupported request method for arbiter: %s, returning 400 Bad request", req.method().c_str());
+        res.write_head(400);
+        res.end("Bad request\n");
+      }
+    };
+    handle("/v1/arbiter", arbiter_handler);
+    handle("/v1/arbiter/", arbiter_handler);
+
+    // 503 if anything is wrong, for load balancers and monitoring
+    handle("/v1/health", [&watchdog](const request &req, const response &res) {
+      syslog(LOG_DEBUG, "in /v1/health handler");
+      syslog(LOG_INFO, "received %s %s request", req.method().c_str(), req.uri().path.c_str());
+
+      if(req.method() == "GET") {
+        json11::Json doc = watchdog.to_json();
+        reply_json(res, doc, json11::Json(), doc["status"].string_value()=="ok" ? 200 : 503);
+      }
+      else if(req.method() == "OPTIONS") {
+        reply_options(res, "OPTIONS,GET");
+      }
+      else {
+        syslog(LOG_DEBUG, "unsupported request method for health: %s, returning 400 Bad request", req.method().c_str());
+        res.write_head(400);
+        res.end("Bad request\n");
+      }
+    });
+
+    handle("/v1/debug/traces", [&tracer](const request &req, const response &res) {
+      syslog(LOG_DEBUG, "in /v1/debug/traces handler");
+      syslog(LOG_INFO, "received %s %s request", req.method().c_str(), req.uri().path.c_str());
+
+      if(req.method() == "GET" && query_param(req.uri().raw_query, "format")=="chrome") {
+        // save and load into chrome://tracing or ui.perfetto.dev
+        res.write_head(200, {
+          {"content-type", {"application/json", false}},
+          {"content-disposition", {"attachment; filename=\"lightsrv-traces.json\"", false}},
+          {"Access-Control-Allow-Origin", {"*", false}}
+        });
+        res.end(tracer.chrome());
+      }
+      else if(req.method() == "GET") {
+        std::string limit_str = query_param(req.uri().raw_query, "limit");
+        reply_json(res, tracer.to_json(limit_str!="" ? std::strtoul(limit_str.c_str(), nullptr, 10) : 100));
+      }
+      else if(req.method() == "OPTIONS") {
+        reply_options(res, "OPTIONS,GET");
+      }
+      else {
+        syslog(LOG_DEBUG, "unsupported request method for traces: %s, returning 400 Bad request", req.method().c_str());
+        res.write_head(400);
+        res.end("Bad request\n");
+      }
+    });
+
+    handle("/v1/debug/limiter", [&limiter](const request &req, const response &res) {
+      syslog(LOG_DEBUG, "in /v1/debug/limiter handler");
+      syslog(LOG_INFO, "received %s %s request", req.method().c_str(), req.uri().path.c_str());
+
+      if(req.method() == "GET") {
+        reply_json(res, limiter.to_json());
+      }
+      else if(req.method() == "OPTIONS") {
+        reply_options(res, "OPTIONS,GET");
+      }
+      else {
+        syslog(LOG_DEBUG, "unsupported request method for limiter: %s, returning 400 Bad request", req.method().c_str());
+        res.write_head(400);
+        res.end("Bad request\n");
+      }
+    });
+
+    handle("/v1/debug/auth", [&auth](const request &req, const response &res) {
+      syslog(LOG_DEBUG, "in /v1/debug/auth handler");
+      syslog(LOG_INFO, "received %s %s request", req.method().c_str(), req.uri().path.c_str());
+
+      if(req.method() == "GET") {
+        reply_json(res, auth.to_json());
+      }
+      else if(req.method() == "OPTIONS") {
+        reply_options(res, "OPTIONS,GET");
+      }
+      else {
+        syslog(LOG_DEBUG, "unsupported request method for auth: %s, returning 400 Bad request", req.method().c_str());
+        res.write_head(400);
+        res.end("Bad request\n");
+      }
+    });
+
+    handle("/v1/debug/memory", [](const request &req, const response &res) {
+      syslog(LOG_DEBUG, "in /v1/debug/memory handler");
+      syslog(LOG_INFO, "received %s %s request", req.method().c_str(), req.uri().path.c_str());
+
+      if(req.method() == "GET") {
+        reply_json(res, Arena::to_json());
+      }
+      else if(req.method() == "OPTIONS") {
+        reply_options(res, "OPTIONS,GET");
+      }
+      else {
+        syslog(LOG_DEBUG, "unsupported request method for memory: %s, returning 400 Bad request", req.method().c_str());
+        res.write_head(400);
+        res.end("Bad request\n");
+      }
+    });
+
+    handle("/v1/debug/record", [&recorder](const request &req, const response &res) {
+      syslog(LOG_DEBUG, "in /v1/debug/record handler");
+      syslog(LOG_INFO, "received %s %s request", req.method().c_str(), req.uri().path.c_str());
+
+      if(req.method() == "GET") {
+        reply_json(res, recorder.to_json());
+      }
+      else if(req.method() == "OPTIONS") {
+        reply_options(res, "OPTIONS,GET");
+      }
+      else {
+        syslog(LOG_DEBUG, "unsupported request method for record: %s, returning 400 Bad request", req.method().c_str());
+        res.write_head(400);
+        res.end("Bad request\n");
+      }
+    });
+
+    handle("/v1/debug/queue", [&queue](const request &req, const response &res) {
+      syslog(LOG_DEBUG, "in /v1/debug/queue handler");
+      syslog(LOG_INFO, "received %s %s request", req.method().c_str(), req.uri().path.c_str());
+
+      if(req.method() == "GET") {
+        reply_json(res, queue.to_json());
+      }
+      else if(req.method() == "OPTIONS") {
+        reply_options(res, "OPTIONS,GET");
+      }
+      else {
+        syslog(LOG_DEBUG, "unsupported request method for queue: %s, returning 400 Bad request", req.method().c_str());
+        res.write_head(400);
+        res.end("Bad request\n");
+      }
+    });
+
+    handle("/v1/debug/pca9685", [&expander](const request &req, const response &res) {
+      syslog(LOG_DEBUG, "in /v1/debug/pca9685 handler");
+      syslog(LOG_INFO, "received %s %s request", req.method().c_str(), req.uri().path.c_str());
+
+      if(req.method() == "GET") {
+        if(expander) reply_json(res, expander->to_json());
+        else reply_error(res, 404, 2, "not found", "no pca9685 configured");
+      }
+      else if(req.method() == "OPTIONS") {
+        reply_options(res, "OPTIONS,GET");
+      }
+      else {
+        syslog(LOG_DEBUG, "unsupported request method for pca9685: %s, returning 400 Bad request", req.method().c_str());
+        res.write_head(400);
+        res.end("Bad request\n");
+      }
+    });
+
+    handle("/v1/node/", [&aggregator](const request &req, const response &res) {
+      syslog(LOG_DEBUG, "in /v1/node/ handler");
+      syslog(LOG_INFO, "received %s %s request", req.method().c_str(), req.uri().path.c_str());
+
+      // /v1/node/<id>/<path> is routed to /v1/<path> of peer id
+      std::string rest = req.uri().path.substr(std::string("/v1/node/").size());
+      auto slash = rest.find('/');
+      std::string id = percent_decode(rest.substr(0, slash));
+
+      if(req.method() == "GET" && id=="") {
+        auto later = deferred(res);
+        aggregator.status([&res, later](const json11::Json &peers) {
+          later([&res, peers]() { reply_json(res, peers); });
+        });
+        return;
+      }
+      if(!aggregator.has(id)) {
+        reply_error(res, 404, 2, "not found", "unknown node " + id);
+        return;
+      }
+      if(slash==std::string::npos || slash+1==rest.size()) {
+        reply_error(res, 404, 2, "not found", "no path on node " + id);
+        return;
+      }
+      std::string path = "/v1/" + rest.substr(slash+1);
+      if(req.uri().raw_query!="") path += "?" + req.uri().raw_query;
+      std::string method = req.method();
+
+      auto later = deferred(res);
+      auto forward = [&aggregator, &res, later, id, method, path](const std::string &body) {
+        aggregator.forward(id, method, path, body, [&res, later](const Aggregator::result &r) {
+          later([&res, r]() {
+            if(r.error!="") {
+              reply_error(res, r.status, 4, "peer error", r.error);
+              return;
+            }
+            std::string err;
+            json11::Json doc;
+            if(format(res)&CBOR_OUT) doc = json11::Json::parse(r.body, err);
+            if(format(res)&CBOR_OUT && err.empty()) {
+              res.write_head(r.status, {
+                {"content-type", {"application/cbor", false}},
+                {"Access-Control-Allow-Origin", {"*", false}}
+              });
+              res.end(Cbor::encode(doc));
+              return;
+            }
+            res.write_head(r.status, {
+              {"content-type", {"application/json", false}},
+              {"Access-Control-Allow-Origin", {"*", false}}
+            });
+            res.end(r.body);
+          });
+        });
+      };
+      if(method == "PUT" || method == "POST") {
+        // the peers get JSON whatever the client sent
+        on_body(req, [&res, forward](const std::string &body) {
+          if(!(format(res)&CBOR_IN)) {
+            forward(body);
+            return;
+          }
+          std::string err;
+          json11::Json doc = Cbor::decode(body, err);
+          if(!err.empty()) reply_error(res, 400, 1, "json parse error", err);
+          else forward(doc.dump());
+        });
+      }
+      else forward("");
+    });
+
+    StaticFiles static_files { docroot };
+    {
+      std::string err;
+      if(static_files.load(err)) syslog(LOG_ERR, "no static files: %s", err.c_str());
+    }
+
+    handle("/", [&backend, &static_files, &switch_names, &pwm_names, &list_caches, &auth, time_server_start](const request &req, const response &res) {
+      syslog(LOG_DEBUG, "in / handler");
+      syslog(LOG_INFO, "received %s %s request", req.method().c_str(), req.uri().path.c_str());
+
+      if(req.method() == "OPTIONS") {
+        res.write_head(204, {
+          {"content-length", {"0", false}},
+          {"allow", {"OPTIONS,GET,PUT", false}},
+          {"Access-Control-Allow-Origin", {"*", false}},
+          {"Access-Control-Allow-Methods", {"GET,PUT,OPTIONS", false}},
+          {"Access-Control-Allow-Headers", {"*", false}}
+        });
+        res.end();
+      }
+
+      else if(req.method() == "GET") {
+
+        auto path = percent_decode(req.uri().path);
+        if (path == "/") {
+          path = "/index.html";
+        }
+
+        const StaticFiles::file *f = static_files.find(path);
+        if (!f) {
+          syslog(LOG_ERR, "Request for non-whitelisted file: %s, returning 404 Not found", path.c_str());
           res.write_head(404);
           res.end();
           return;
         }
 
-        std::string str;
-
-        t.seekg(0, std::ios::end);   
-        str.reserve(t.tellg());
-        t.seekg(0, std::ios::beg);
+        // everything but the page itself is served as is
+        if (path != "/index.html") {
+          reply_static(req, res, *f);
+          return;
+        }
 
-        str.assign((std::istreambuf_iterator<char>(t)),
-                    std::istreambuf_iterator<char>());
-        t.close();
+        std::string str((const char *)f->plain->data, f->plain->size);
 
         boost::replace_all(str, "\"%%SWITCH_NAMES%%\"", switch_names);
         boost::replace_all(str, "\"%%PWM_NAMES%%\"", pwm_names);
+        // the current /v1/list body saves the page its first request, unless
+        // the client could not have read it
+        auto authorization = req.header().find("authorization");
+        if(auth.check("GET", "/v1/list", authorization!=req.header().end() ? authorization->second.value : "") == Auth::ALLOWED) {
+          uint64_t version;
+          std::string state = *list_caches[shard_index]->json.get(version);
+          boost::replace_all(state, "</", "<\\/");
+          boost::replace_all(str, "\"%%INITIAL_STATE%%\"", state);
+        }
 
         std::istringstream *istr=new std::istringstream(str);
 
-        res.on_close([istr](uint32_t cause){
+        add_on_close(res, [istr](uint32_t cause){
           (void)cause;
           delete istr;
         });
 
         auto header = header_map();
-        struct stat stbuf;
-        if (stat(path.c_str(), &stbuf) == 0) {
-          header.emplace("content-length",
-                        //header_value{std::to_string(stbuf.st_size), false});
-                        header_value{std::to_string(str.size()), false});
-          // in principle that would be the modification date of the index.html file or the config file or the server binary
-          // maybe server restart time is a reasonable approximation?
-          header.emplace("last-modified",
-                        header_value{http_date(time_server_start), false});
-                        //header_value{http_date(std::time(nullptr)), false});
-                        //header_value{http_date(stbuf.st_mtime), false});
-        }
+        header.emplace("content-type", header_value{f->mime, false});
+        header.emplace("content-length",
+                      header_value{std::to_string(str.size()), false});
+        // in principle that would be the modification date of the index.html file or the config file or the server binary
+        // maybe server restart time is a reasonable approximation?
+        header.emplace("last-modified",
+                      header_value{http_date(time_server_start), false});
+                      //header_value{http_date(std::time(nullptr)), false});
+        // with the state inlined the page is never the same twice
+        header.emplace("cache-control", header_value{"no-cache", false});
         res.write_head(200, std::move(header));
         res.end(createGeneratorCb(istr));
       }
@@ -728,9 +2247,17 @@ int main(int argc, char *argv[]) {
       ptls->use_private_key_file(key_file, boost::asio::ssl::context::pem);
       ptls->use_certificate_chain_file(cert_file);
       configure_tls_context_easy(ec, *ptls);
+      std::string client_ca = vm["client-ca"].as<std::string>();
+      if(client_ca!="") {
+        // mutual TLS: the handshake fails without an accepted client certificate
+        ptls->load_verify_file(client_ca);
+        ptls->set_verify_mode(boost::asio::ssl::verify_peer | boost::asio::ssl::verify_fail_if_no_peer_cert);
+        ptls->set_verify_callback([&auth](bool preverified, boost::asio::ssl::verify_context &ctx) {
+          return auth.verify_certificate(preverified, ctx.native_handle());
+        });
+      }
     }
 
-    server.reset();
     boost::asio::io_service &sv = server.io_service();
     std::shared_ptr<PeriodicTask> task(nullptr);
     if(backend.has_autom()) {
@@ -740,9 +2267,37 @@ int main(int argc, char *argv[]) {
     else {
       syslog(LOG_INFO, "Not installing automode handler since the backend does not support it");
     }
+    watchdog.set_automode(task.get());
+    if(shards>1) {
+      bool affinity = vm.count("shard-affinity")>0;
+      unsigned cpus = std::max(std::thread::hardware_concurrency(), 1u);
+      for(unsigned i=0; i<shards; i++) {
+        // runs on the shard's thread before its first request
+        (i ? shard_servers[i-1]->io_service() : server.io_service()).post([i, affinity, cpus]() {
+          shard_index = i;
+          if(!affinity) return;
+          cpu_set_t set;
+          CPU_ZERO(&set);
+          CPU_SET(i%cpus, &set);
+          if(pthread_setaffinity_np(pthread_self(), sizeof(set), &set)) syslog(LOG_ERR, "cannot pin shard %u to cpu %u", i, i%cpus);
+        });
+      }
+      for(auto &s: shard_servers) {
+        if (s->no_reset_listen_and_serve(ec, ptls.get(), addr, port, true)) {
+          std::cerr << "error: " << ec.message() << std::endl;
+        }
+      }
+      syslog(LOG_INFO, "serving with %u shards", shards);
+    }
+    watchdog.start();
     if (server.no_reset_listen_and_serve(ec, ptls.get(), addr, port)) {
       std::cerr << "error: " << ec.message() << std::endl;
     }
+    watchdog.stop();
+    for(auto &s: shard_servers) {
+      s->stop();
+      s->join();
+    }
 
   } catch (std::exception &e) {
     std::cerr << "exception: " << e.what() << "\n";
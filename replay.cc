@@ -0,0 +1,293 @@
+// lightsrv-replay: plays a request recording made with lightsrv --record
+// against a server, at the recorded pace or faster, and prints the latency
+// distribution per route.
+//
+//     lightsrv --mockup --port 8443 &
+//     lightsrv-replay --port 8443 --speed 4 requests.lsrt
+
+#include <syslog.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <boost/algorithm/string.hpp>
+#include <boost/asio/deadline_timer.hpp>
+#include <boost/asio/io_service.hpp>
+#include <boost/asio/ssl.hpp>
+#include <boost/program_options.hpp>
+
+#include <nghttp2/asio_http2_client.h>
+
+#include "json11.git/json11.hpp"
+#include "Recorder.h"
+
+using namespace nghttp2::asio_http2;
+typedef std::chrono::steady_clock steady;
+
+// GET /v1/pwm/3 and GET /v1/pwm/4 are one route, long polls are one apart
+// from plain polls since they wait for a change
+static std::string route(const Recorder::entry &e) {
+  std::string path = e.path.substr(0, e.path.find('?'));
+  std::vector<std::string> parts;
+  boost::split(parts, path, boost::is_any_of("/"));
+  for(auto &p: parts) {
+    if(p!="" && p.find_first_not_of("0123456789")==std::string::npos) p = "N";
+  }
+  std::string r = e.method + " " + boost::join(parts, "/");
+  if(e.path.find("since=")!=std::string::npos) r += "?since";
+  return r;
+}
+
+// a recorded since= refers to a version of the recording server; it is
+// replaced by the last version this replay saw, or dropped before the first
+static std::string rewrite_since(const std::string &path, const std::string &version) {
+  auto q = path.find('?');
+  if(q==std::string::npos) return path;
+  std::vector<std::string> params, out;
+  boost::split(params, path.substr(q+1), boost::is_any_of("&"));
+  for(auto &p: params) {
+    if(!boost::starts_with(p, "since=")) out.push_back(p);
+    else if(version!="") out.push_back("since=" + version);
+  }
+  return path.substr(0, q) + (out.empty() ? "" : "?" + boost::join(out, "&"));
+}
+
+static double percentile(const std::vector<double> &sorted, double p) {
+  if(sorted.empty()) return 0;
+  std::size_t rank = std::ceil(p*sorted.size());
+  return sorted[std::min(std::max<std::size_t>(rank, 1), sorted.size())-1];
+}
+
+struct stats {
+  std::vector<double> ms;
+  unsigned long errors = 0;
+  std::map<int, unsigned long> status;
+};
+
+int main(int argc, char *argv[]) {
+  boost::program_options::options_description desc("Allowed options");
+  desc.add_options()
+    ("help,h", "produce help message")
+    ("host", boost::program_options::value<std::string>()->default_value("127.0.0.1"), "server to replay against")
+    ("port,p", boost::program_options::value<std::string>()->default_value("443"), "its port")
+    ("no-tls", "plain HTTP/2, for a server on port 80")
+    ("ca", boost::program_options::value<std::string>(), "verify the server certificate against this CA file, not verified otherwise")
+    ("token", boost::program_options::value<std::string>()->default_value(""), "bearer token sent with every request")
+    ("speed", boost::program_options::value<double>()->default_value(1), "replay speed, 2 plays an hour of traffic in half an hour")
+    ("connections", boost::program_options::value<unsigned>()->default_value(1), "HTTP/2 connections the requests are spread over")
+    ("timeout", boost::program_options::value<unsigned>()->default_value(60), "seconds to wait for the outstanding requests after the last one was sent")
+    ("format", boost::program_options::value<std::string>()->default_value("text"), "output format: text or json")
+    ("file", boost::program_options::value<std::string>(), "the recording")
+  ;
+  boost::program_options::positional_options_description pos;
+  pos.add("file", 1);
+  boost::program_options::variables_map vm;
+  try {
+    boost::program_options::store(boost::program_options::command_line_parser(argc, argv).options(desc).positional(pos).run(), vm);
+    boost::program_options::notify(vm);
+  }
+  catch(const std::exception &e) {
+    std::cerr << "error: " << e.what() << std::endl;
+    return 1;
+  }
+  if(vm.count("help") || !vm.count("file")) {
+    std::cout << "usage: lightsrv-replay [options] recording\n" << desc << "\n";
+    return vm.count("help") ? 0 : 1;
+  }
+  openlog("lightsrv-replay", LOG_PERROR, LOG_USER);
+  setlogmask(LOG_UPTO(LOG_WARNING));
+
+  time_t recorded_at;
+  std::vector<Recorder::entry> entries;
+  std::string err;
+  if(Recorder::load(vm["file"].as<std::string>(), recorded_at, entries, err)) {
+    std::cerr << "error: " << err << std::endl;
+    return 1;
+  }
+  if(entries.empty()) {
+    std::cerr << "error: no requests in " << vm["file"].as<std::string>() << std::endl;
+    return 1;
+  }
+  double speed = vm["speed"].as<double>();
+  if(speed<=0) {
+    std::cerr << "error: invalid speed" << std::endl;
+    return 1;
+  }
+
+  std::string host = vm["host"].as<std::string>();
+  std::string port = vm["port"].as<std::string>();
+  bool tls = !vm.count("no-tls");
+  std::string token = vm["token"].as<std::string>();
+  std::string base = std::string(tls ? "https://" : "http://") + host + ":" + port;
+
+  boost::asio::io_service io;
+  boost::asio::ssl::context tls_ctx(boost::asio::ssl::context::sslv23);
+  boost::system::error_code ec;
+  if(tls) {
+    client::configure_tls_context(ec, tls_ctx);
+    if(vm.count("ca")) {
+      tls_ctx.load_verify_file(vm["ca"].as<std::string>());
+      tls_ctx.set_verify_mode(boost::asio::ssl::verify_peer);
+      tls_ctx.set_verify_callback(boost::asio::ssl::rfc2818_verification(host));
+    }
+    else {
+      tls_ctx.set_verify_mode(boost::asio::ssl::verify_none);
+    }
+  }
+
+  std::vector<std::unique_ptr<client::session>> sessions;
+  unsigned connected = 0, failed = 0;
+  std::size_t next = 0, done = 0;
+  std::string version;        // of the last /v1/list answer
+  double max_late_ms = 0;
+  std::map<std::string, stats> routes;
+  steady::time_point t0;
+  boost::asio::deadline_timer timer(io);
+
+  auto finish = [&]() {
+    timer.cancel();
+    for(auto &s: sessions) s->shutdown();
+  };
+
+  auto submit = [&](const Recorder::entry &e) {
+    std::string r = route(e);
+    header_map h;
+    if(e.body!="") h.emplace("content-type", header_value { "application/json", false });
+    if(token!="") h.emplace("authorization", header_value { "Bearer " + token, true });
+    std::string uri = base + rewrite_since(e.path, version);
+    auto &s = *sessions[next%sessions.size()];
+    const client::request *req = e.body=="" ? s.submit(ec, e.method, uri, h) : s.submit(ec, e.method, uri, e.body, h);
+    if(!req) {
+      routes[r].errors++;
+      if(++done==entries.size()) finish();
+      return;
+    }
+    auto sent = steady::now();
+    auto status = std::make_shared<int>(0);
+    bool list = boost::starts_with(e.path, "/v1/list");
+    req->on_response([status, list, &version](const client::response &res) {
+      *status = res.status_code();
+      auto it = res.header().find("etag");
+      // "<boot>-<version>" for since=, of the JSON etag or the CBOR one
+      if(list && it!=res.header().end()) version = boost::erase_last_copy(boost::trim_copy_if(it->second.value, boost::is_any_of("\"W/")), "-cbor");
+    });
+    req->on_close([&, r, sent, status](uint32_t error_code) {
+      stats &st = routes[r];
+      if(error_code || !*status) st.errors++;
+      else {
+        st.ms.push_back(std::chrono::duration<double, std::milli>(steady::now()-sent).count());
+        st.status[*status]++;
+      }
+      if(++done==entries.size()) finish();
+    });
+  };
+
+  // one timer walks the recording, each wakeup sends whatever is due
+  std::function<void()> schedule = [&]() {
+    auto now = steady::now();
+    while(next<entries.size()) {
+      auto due = t0 + std::chrono::microseconds((uint64_t)(entries[next].offset_us/speed));
+      if(due>now) break;
+      max_late_ms = std::max(max_late_ms, std::chrono::duration<double, std::milli>(now-due).count());
+      submit(entries[next]);
+      next++;
+    }
+    if(next<entries.size()) {
+      auto due = t0 + std::chrono::microseconds((uint64_t)(entries[next].offset_us/speed));
+      timer.expires_from_now(boost::posix_time::microseconds(std::chrono::duration_cast<std::chrono::microseconds>(due-now).count()));
+      timer.async_wait([&](const boost::system::error_code &ec) {
+        if(!ec) schedule();
+      });
+    }
+    else {
+      // the stragglers get timeout seconds
+      timer.expires_from_now(boost::posix_time::seconds(vm["timeout"].as<unsigned>()));
+      timer.async_wait([&](const boost::system::error_code &ec) {
+        if(ec) return;
+        std::cerr << "warning: " << entries.size()-done << " requests still outstanding, giving up" << std::endl;
+        finish();
+      });
+    }
+  };
+
+  unsigned connections = std::max(vm["connections"].as<unsigned>(), 1u);
+  for(unsigned i=0; i<connections; i++) {
+    if(tls) sessions.emplace_back(new client::session(io, tls_ctx, host, port));
+    else sessions.emplace_back(new client::session(io, host, port));
+    sessions.back()->on_connect([&](boost::asio::ip::tcp::resolver::iterator) {
+      // all connections up before the clock starts
+      if(++connected<connections) return;
+      t0 = steady::now();
+      schedule();
+    });
+    sessions.back()->on_error([&](const boost::system::error_code &ec) {
+      std::cerr << "error: " << base << ": " << ec.message() << std::endl;
+      failed++;
+      finish();
+    });
+  }
+  io.run();
+  if(failed && !connected) return 1;
+
+  double seconds = std::chrono::duration<double>(steady::now()-t0).count();
+  double recorded = entries.back().offset_us/1e6;
+  json11::Json::object out_routes;
+  stats all;
+  for(auto &kv: routes) {
+    stats &st = kv.second;
+    std::sort(st.ms.begin(), st.ms.end());
+    all.ms.insert(all.ms.end(), st.ms.begin(), st.ms.end());
+    all.errors += st.errors;
+    json11::Json::object status;
+    for(auto &s: st.status) {
+      status[std::to_string(s.first)] = (double)s.second;
+      all.status[s.first] += s.second;
+    }
+    out_routes[kv.first] = json11::Json::object {
+      { "count", (double)st.ms.size() },
+      { "errors", (double)st.errors },
+      { "status", status },
+      { "p50_ms", percentile(st.ms, 0.5) },
+      { "p90_ms", percentile(st.ms, 0.9) },
+      { "p99_ms", percentile(st.ms, 0.99) },
+      { "max_ms", st.ms.empty() ? 0.0 : st.ms.back() }
+    };
+  }
+  std::sort(all.ms.begin(), all.ms.end());
+
+  if(vm["format"].as<std::string>()=="json") {
+    std::cout << json11::Json(json11::Json::object {
+      { "requests", (double)entries.size() },
+      { "errors", (double)all.errors },
+      { "recorded_at", (double)recorded_at },
+      { "recorded_seconds", recorded },
+      { "replay_seconds", seconds },
+      { "speed", speed },
+      { "max_late_ms", max_late_ms },
+      { "p50_ms", percentile(all.ms, 0.5) },
+      { "p90_ms", percentile(all.ms, 0.9) },
+      { "p99_ms", percentile(all.ms, 0.99) },
+      { "p999_ms", percentile(all.ms, 0.999) },
+      { "max_ms", all.ms.empty() ? 0.0 : all.ms.back() },
+      { "routes", out_routes }
+    }).dump() << std::endl;
+    return all.errors ? 2 : 0;
+  }
+
+  printf("%zu requests, %.1f s recorded, replayed in %.1f s at %gx, sending at most %.1f ms late\n", entries.size(), recorded, seconds, speed, max_late_ms);
+  printf("%-32s %8s %6s %9s %9s %9s %9s %9s\n", "route", "count", "errors", "p50 ms", "p90 ms", "p99 ms", "p99.9 ms", "max ms");
+  auto line = [](const std::string &name, const stats &st) {
+    printf("%-32s %8zu %6lu %9.2f %9.2f %9.2f %9.2f %9.2f\n", name.c_str(), st.ms.size(), st.errors,
+      percentile(st.ms, 0.5), percentile(st.ms, 0.9), percentile(st.ms, 0.99), percentile(st.ms, 0.999), st.ms.empty() ? 0.0 : st.ms.back());
+  };
+  for(auto &kv: routes) line(kv.first, kv.second);
+  line("all", all);
+  return all.errors ? 2 : 0;
+}